@@ -15,6 +15,12 @@
  *
  * Modified by Intel Corporation.
  * - stripped out Parcel usage
+ * - added allocation from camera_metadata pools
+ * - added batch updates
+ * - added updates typed by tag at compile time
+ * - added tracking of the tags changed by updates
+ * - erasing leaves tombstones, which are compacted before the buffer is
+ *   handed out
  *
  */
 
@@ -35,24 +41,44 @@ namespace android {
 //typedef Parcel::WritableBlob WritableBlob;
 //typedef Parcel::ReadableBlob ReadableBlob;
 
+// freed buffers kept per capacity by the shared pool
+static const size_t SHARED_POOL_FREE_BUFFERS = 8;
+
 CameraMetadata::CameraMetadata() :
-        mBuffer(NULL), mLocked(false) {
+        mBuffer(NULL), mLocked(false), mPool(NULL), mAllDirty(false) {
 }
 
 CameraMetadata::CameraMetadata(size_t entryCapacity, size_t dataCapacity) :
-        mLocked(false)
+        mLocked(false), mPool(NULL), mAllDirty(false)
 {
     mBuffer = allocate_camera_metadata(entryCapacity, dataCapacity);
 }
 
+CameraMetadata::CameraMetadata(camera_metadata_pool_t *pool,
+        size_t entryCapacity, size_t dataCapacity) :
+        mBuffer(NULL), mLocked(false), mPool(pool), mAllDirty(false)
+{
+    if (entryCapacity > 0) {
+        mBuffer = allocate_pooled_camera_metadata(mPool, entryCapacity,
+                dataCapacity);
+    }
+}
+
 CameraMetadata::CameraMetadata(const CameraMetadata &other) :
-        mLocked(false) {
-    mBuffer = clone_camera_metadata(other.mBuffer);
+        mLocked(false), mPool(other.mPool), mAllDirty(false) {
+    mBuffer = clone_pooled_camera_metadata(mPool, other.mBuffer);
 }
 
 CameraMetadata::CameraMetadata(camera_metadata_t *buffer) :
-        mBuffer(NULL), mLocked(false) {
+        mBuffer(NULL), mLocked(false), mPool(NULL), mAllDirty(false) {
     acquire(buffer);
+    clearDirty();
+}
+
+camera_metadata_pool_t *CameraMetadata::sharedPool() {
+    static camera_metadata_pool_t *pool =
+            create_camera_metadata_pool(SHARED_POOL_FREE_BUFFERS);
+    return pool;
 }
 
 CameraMetadata &CameraMetadata::operator=(const CameraMetadata &other) {
@@ -66,7 +92,8 @@ CameraMetadata &CameraMetadata::operator=(const camera_metadata_t *buffer) {
     }
 
     if (CC_LIKELY(buffer != mBuffer)) {
-        camera_metadata_t *newBuffer = clone_camera_metadata(buffer);
+        camera_metadata_t *newBuffer = clone_pooled_camera_metadata(mPool,
+                buffer);
         clear();
         mBuffer = newBuffer;
     }
@@ -79,6 +106,10 @@ CameraMetadata::~CameraMetadata() {
 }
 
 const camera_metadata_t* CameraMetadata::getAndLock() const {
+    // users of the buffer don't need to skip erased entries
+    if (mBuffer != NULL) {
+        compact_camera_metadata(mBuffer);
+    }
     mLocked = true;
     return mBuffer;
 }
@@ -102,8 +133,12 @@ camera_metadata_t* CameraMetadata::release() {
         ALOGE("%s: CameraMetadata is locked", __FUNCTION__);
         return NULL;
     }
+    if (mBuffer != NULL) {
+        compact_camera_metadata(mBuffer);
+    }
     camera_metadata_t *released = mBuffer;
     mBuffer = NULL;
+    mAllDirty = true;
     return released;
 }
 
@@ -113,9 +148,10 @@ void CameraMetadata::clear() {
         return;
     }
     if (mBuffer) {
-        free_camera_metadata(mBuffer);
+        free_pooled_camera_metadata(mPool, mBuffer);
         mBuffer = NULL;
     }
+    mAllDirty = true;
 }
 
 void CameraMetadata::acquire(camera_metadata_t *buffer) {
@@ -152,12 +188,14 @@ status_t CameraMetadata::append(const camera_metadata_t* other) {
     size_t extraData = get_camera_metadata_data_count(other);
     resizeIfNeeded(extraEntries, extraData);
 
+    mAllDirty = true;
     return append_camera_metadata(mBuffer, other);
 }
 
 size_t CameraMetadata::entryCount() const {
     return (mBuffer == NULL) ? 0 :
-            get_camera_metadata_entry_count(mBuffer);
+            get_camera_metadata_entry_count(mBuffer) -
+            get_camera_metadata_tombstone_count(mBuffer);
 }
 
 bool CameraMetadata::isEmpty() const {
@@ -283,7 +321,6 @@ status_t CameraMetadata::update(uint32_t tag,
 
 status_t CameraMetadata::updateImpl(uint32_t tag, const void *data,
         size_t data_count) {
-    status_t res;
     if (mLocked) {
         ALOGE("%s: CameraMetadata is locked", __FUNCTION__);
         return INVALID_OPERATION;
@@ -293,6 +330,16 @@ status_t CameraMetadata::updateImpl(uint32_t tag, const void *data,
         ALOGE("%s: Tag %d not found", __FUNCTION__, tag);
         return BAD_VALUE;
     }
+    return updateImpl(tag, type, data, data_count);
+}
+
+status_t CameraMetadata::updateImpl(uint32_t tag, int type, const void *data,
+        size_t data_count) {
+    status_t res;
+    if (mLocked) {
+        ALOGE("%s: CameraMetadata is locked", __FUNCTION__);
+        return INVALID_OPERATION;
+    }
     // Safety check - ensure that data isn't pointing to this metadata, since
     // that would get invalidated if a resize is needed
     size_t bufferSize = get_camera_metadata_size(mBuffer);
@@ -310,15 +357,7 @@ status_t CameraMetadata::updateImpl(uint32_t tag, const void *data,
     res = resizeIfNeeded(1, data_size);
 
     if (res == OK) {
-        camera_metadata_entry_t entry;
-        res = find_camera_metadata_entry(mBuffer, tag, &entry);
-        if (res == NAME_NOT_FOUND) {
-            res = add_camera_metadata_entry(mBuffer,
-                    tag, data, data_count);
-        } else if (res == OK) {
-            res = update_camera_metadata_entry(mBuffer,
-                    entry.index, data, data_count, NULL);
-        }
+        res = setEntry(tag, type, data, data_count);
     }
 
     if (res != OK) {
@@ -338,6 +377,129 @@ status_t CameraMetadata::updateImpl(uint32_t tag, const void *data,
     return res;
 }
 
+status_t CameraMetadata::setEntry(uint32_t tag, int type, const void *data,
+        size_t data_count) {
+    camera_metadata_entry_t entry;
+    status_t res = find_camera_metadata_entry(mBuffer, tag, &entry);
+    if (res == NAME_NOT_FOUND) {
+        res = add_camera_metadata_entry_of_type(mBuffer,
+                tag, type, data, data_count);
+    } else if (res == OK) {
+        if (entry.count == data_count && (data_count == 0 ||
+                memcmp(entry.data.u8, data,
+                        data_count * camera_metadata_type_size[type]) == 0)) {
+            // the entry already has these values
+            return OK;
+        }
+        res = update_camera_metadata_entry(mBuffer,
+                entry.index, data, data_count, NULL);
+    }
+    if (res == OK) {
+        markDirty(tag);
+    }
+    return res;
+}
+
+static void getArrayUpdate(const void *updates, size_t i,
+        CameraMetadata::Update *update) {
+    *update = static_cast<const CameraMetadata::Update*>(updates)[i];
+}
+
+static void getEntryUpdate(const void *updates, size_t i,
+        CameraMetadata::Update *update) {
+    camera_metadata_ro_entry_t entry;
+    get_camera_metadata_ro_entry(static_cast<const camera_metadata_t*>(updates),
+            i, &entry);
+    update->tag = entry.tag;
+    update->type = entry.type;
+    update->data = entry.data.u8;
+    update->count = entry.count;
+}
+
+status_t CameraMetadata::updateBatch(const Update *updates, size_t count) {
+    return updateBatchImpl(updates, count, getArrayUpdate);
+}
+
+status_t CameraMetadata::updateBatch(const camera_metadata_t *updates) {
+    if (updates == NULL) {
+        return OK;
+    }
+    if (get_camera_metadata_tombstone_count(updates) > 0) {
+        // the entries of a compacted copy are all live
+        CameraMetadata compacted(mPool);
+        compacted = updates;
+        const camera_metadata_t *buffer = compacted.getAndLock();
+        status_t res = updateBatch(buffer);
+        compacted.unlock(buffer);
+        return res;
+    }
+    return updateBatchImpl(updates, get_camera_metadata_entry_count(updates),
+            getEntryUpdate);
+}
+
+status_t CameraMetadata::updateBatchImpl(const void *updates, size_t count,
+        void (*getUpdate)(const void *updates, size_t i, Update *update)) {
+    status_t res;
+    if (mLocked) {
+        ALOGE("%s: CameraMetadata is locked", __FUNCTION__);
+        return INVALID_OPERATION;
+    }
+    if (count == 0) {
+        return OK;
+    }
+
+    // check all updates before changing anything, and sum up their data
+    size_t bufferSize = get_camera_metadata_size(mBuffer);
+    uintptr_t bufAddr = reinterpret_cast<uintptr_t>(mBuffer);
+    size_t extraData = 0;
+    for (size_t i = 0; i < count; i++) {
+        Update u;
+        getUpdate(updates, i, &u);
+        if ( (res = checkType(u.tag, u.type)) != OK) {
+            return res;
+        }
+        uintptr_t dataAddr = reinterpret_cast<uintptr_t>(u.data);
+        if (mBuffer != NULL &&
+                dataAddr > bufAddr && dataAddr < (bufAddr + bufferSize)) {
+            ALOGE("%s: Update attempted with data from the same metadata buffer!",
+                    __FUNCTION__);
+            return INVALID_OPERATION;
+        }
+        extraData += calculate_camera_metadata_entry_data_size(u.type, u.count);
+    }
+
+    // updated entries free their old data, so this is enough for all of them
+    res = resizeIfNeeded(count, extraData);
+    if (res != OK) {
+        return res;
+    }
+
+    for (size_t i = 0; i < count && res == OK; i++) {
+        Update u;
+        getUpdate(updates, i, &u);
+        res = setEntry(u.tag, u.type, u.data, u.count);
+        if (res != OK) {
+            ALOGE("%s: Unable to update metadata entry %s.%s (%x): %s (%d)",
+                    __FUNCTION__, get_camera_metadata_section_name(u.tag),
+                    get_camera_metadata_tag_name(u.tag), u.tag,
+                    strerror(-res), res);
+        }
+    }
+    if (res == OK) {
+        res = sort_camera_metadata(mBuffer);
+    }
+
+    IF_ALOGV() {
+        ALOGE_IF(validate_camera_metadata_structure(mBuffer, /*size*/NULL) !=
+                 OK,
+
+                 "%s: Failed to validate metadata structure after update %p",
+                 __FUNCTION__, mBuffer);
+    }
+
+    return res;
+}
+
 bool CameraMetadata::exists(uint32_t tag) const {
     camera_metadata_ro_entry entry;
     return find_camera_metadata_ro_entry(mBuffer, tag, &entry) == 0;
@@ -387,28 +549,67 @@ status_t CameraMetadata::erase(uint32_t tag) {
                 get_camera_metadata_tag_name(tag), tag, strerror(-res), res);
         return res;
     }
-    res = delete_camera_metadata_entry(mBuffer, entry.index);
+    res = erase_camera_metadata_entry(mBuffer, entry.index);
     if (res != OK) {
         ALOGE("%s: Error deleting entry %s.%s (%x): %s %d",
                 __FUNCTION__,
                 get_camera_metadata_section_name(tag),
                 get_camera_metadata_tag_name(tag), tag, strerror(-res), res);
+    } else {
+        markDirty(tag);
     }
     return res;
 }
 
+bool CameraMetadata::isDirty() const {
+    return mAllDirty || !mDirtyTags.isEmpty();
+}
+
+bool CameraMetadata::isDirty(uint32_t tag) const {
+    if (mAllDirty) {
+        return true;
+    }
+    for (size_t i = 0; i < mDirtyTags.size(); i++) {
+        if (mDirtyTags[i] == tag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void CameraMetadata::clearDirty() {
+    mAllDirty = false;
+    mDirtyTags.clear();
+}
+
+void CameraMetadata::markDirty(uint32_t tag) {
+    if (!isDirty(tag)) {
+        mDirtyTags.push_back(tag);
+    }
+}
+
 void CameraMetadata::dump(int fd, int verbosity, int indentation) const {
     dump_indented_camera_metadata(mBuffer, fd, verbosity, indentation);
 }
 
 status_t CameraMetadata::resizeIfNeeded(size_t extraEntries, size_t extraData) {
     if (mBuffer == NULL) {
-        mBuffer = allocate_camera_metadata(extraEntries * 2, extraData * 2);
+        mBuffer = allocate_pooled_camera_metadata(mPool, extraEntries * 2,
+                extraData * 2);
         if (mBuffer == NULL) {
             ALOGE("%s: Can't allocate larger metadata buffer", __FUNCTION__);
             return NO_MEMORY;
         }
     } else {
+        // erased entries take up room until they are compacted
+        if (get_camera_metadata_tombstone_count(mBuffer) > 0 &&
+                (get_camera_metadata_entry_count(mBuffer) + extraEntries >
+                        get_camera_metadata_entry_capacity(mBuffer) ||
+                 get_camera_metadata_data_count(mBuffer) + extraData >
+                        get_camera_metadata_data_capacity(mBuffer))) {
+            compact_camera_metadata(mBuffer);
+        }
+
         size_t currentEntryCount = get_camera_metadata_entry_count(mBuffer);
         size_t currentEntryCap = get_camera_metadata_entry_capacity(mBuffer);
         size_t newEntryCount = currentEntryCount +
@@ -426,14 +627,14 @@ status_t CameraMetadata::resizeIfNeeded(size_t extraEntries, size_t extraData) {
         if (newEntryCount > currentEntryCap ||
                 newDataCount > currentDataCap) {
             camera_metadata_t *oldBuffer = mBuffer;
-            mBuffer = allocate_camera_metadata(newEntryCount,
+            mBuffer = allocate_pooled_camera_metadata(mPool, newEntryCount,
                     newDataCount);
             if (mBuffer == NULL) {
                 ALOGE("%s: Can't allocate larger metadata buffer", __FUNCTION__);
                 return NO_MEMORY;
             }
             append_camera_metadata(mBuffer, oldBuffer);
-            free_camera_metadata(oldBuffer);
+            free_pooled_camera_metadata(mPool, oldBuffer);
         }
     }
     return OK;
@@ -692,6 +893,8 @@ void CameraMetadata::swap(CameraMetadata& other) {
 
     other.mBuffer = thisBuf;
     mBuffer = otherBuf;
+    mAllDirty = true;
+    other.mAllDirty = true;
 }
 
 }; // namespace android
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "Camera2-MetadataSnapshot"
+#include <utils/Log.h>
+
+#include <sched.h>
+#include <camera/CameraMetadata.h>
+#include <camera/CameraMetadataSnapshot.h>
+
+namespace android {
+
+CameraMetadataSnapshot::CameraMetadataSnapshot(camera_metadata_t *buffer) :
+        mBuffer(buffer) {
+    // erased entries are dropped before the readers share the buffer
+    if (mBuffer != NULL) {
+        compact_camera_metadata(mBuffer);
+    }
+}
+
+CameraMetadataSnapshot::~CameraMetadataSnapshot() {
+    if (mBuffer != NULL) {
+        free_pooled_camera_metadata(CameraMetadata::sharedPool(), mBuffer);
+    }
+}
+
+sp<CameraMetadataSnapshot> CameraMetadataSnapshot::acquire(
+        CameraMetadata &metadata) {
+    return new CameraMetadataSnapshot(metadata.release());
+}
+
+sp<CameraMetadataSnapshot> CameraMetadataSnapshot::acquire(
+        camera_metadata_t *buffer) {
+    return new CameraMetadataSnapshot(buffer);
+}
+
+size_t CameraMetadataSnapshot::entryCount() const {
+    return (mBuffer == NULL) ? 0 :
+            get_camera_metadata_entry_count(mBuffer) -
+            get_camera_metadata_tombstone_count(mBuffer);
+}
+
+CameraMetadataPublisher::CameraMetadataPublisher(
+        const sp<CameraMetadataSnapshot> &snapshot) :
+        mCurrent(NULL), mEpoch(0) {
+    mReaders[0] = 0;
+    mReaders[1] = 0;
+    publish(snapshot);
+}
+
+CameraMetadataPublisher::~CameraMetadataPublisher() {
+    CameraMetadataSnapshot *current = mCurrent.exchange(NULL);
+    if (current != NULL) {
+        current->decStrong(this);
+    }
+}
+
+sp<CameraMetadataSnapshot> CameraMetadataPublisher::current() const {
+    std::atomic<uint32_t> &readers = mReaders[mEpoch.load() & 1];
+    readers++;
+    sp<CameraMetadataSnapshot> snapshot = mCurrent.load();
+    readers--;
+    return snapshot;
+}
+
+void CameraMetadataPublisher::publish(
+        const sp<CameraMetadataSnapshot> &snapshot) {
+    sp<CameraMetadataSnapshot> published =
+            (snapshot != NULL) ? snapshot : CameraMetadataSnapshot::acquire(NULL);
+    Mutex::Autolock l(mWriteLock);
+
+    published->incStrong(this);
+    CameraMetadataSnapshot *old = mCurrent.exchange(published.get());
+    if (old == NULL) {
+        return;
+    }
+
+    // a reader may have loaded the old pointer, but not referenced it yet.
+    // Each group of readers is waited for once after the exchange, while
+    // new readers count in the other group.
+    for (int i = 0; i < 2; i++) {
+        std::atomic<uint32_t> &readers = mReaders[mEpoch.fetch_add(1) & 1];
+        while (readers.load() != 0) {
+            sched_yield();
+        }
+    }
+    old->decStrong(this);
+}
+
+}; // namespace android
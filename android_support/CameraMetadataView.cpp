@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "Camera2-MetadataView"
+#include <utils/Log.h>
+
+#include <camera/CameraMetadataView.h>
+
+namespace android {
+
+CameraMetadataView::CameraMetadataView(const camera_metadata_t *buffer) :
+        mBuffer(buffer), mPrefetchedCount(0) {
+}
+
+void CameraMetadataView::prefetch(const uint32_t *tags, size_t count) {
+    mPrefetchedCount = 0;
+    if (count > MAX_PREFETCHED_TAGS) {
+        ALOGW("%s: Prefetching only %zu of %zu tags", __FUNCTION__,
+                MAX_PREFETCHED_TAGS, count);
+        count = MAX_PREFETCHED_TAGS;
+    }
+    for (size_t i = 0; i < count; i++) {
+        camera_metadata_ro_entry &entry = mPrefetched[mPrefetchedCount++];
+        if (mBuffer == NULL ||
+                find_camera_metadata_ro_entry(mBuffer, tags[i], &entry) != 0) {
+            // remember missing tags too
+            entry.tag = tags[i];
+            entry.count = 0;
+            entry.data.u8 = NULL;
+        }
+    }
+}
+
+size_t CameraMetadataView::entryCount() const {
+    return (mBuffer == NULL) ? 0 :
+            get_camera_metadata_entry_count(mBuffer) -
+            get_camera_metadata_tombstone_count(mBuffer);
+}
+
+camera_metadata_ro_entry CameraMetadataView::find(uint32_t tag) const {
+    for (size_t i = 0; i < mPrefetchedCount; i++) {
+        if (mPrefetched[i].tag == tag) {
+            return mPrefetched[i];
+        }
+    }
+
+    camera_metadata_ro_entry entry;
+    if (mBuffer == NULL ||
+            find_camera_metadata_ro_entry(mBuffer, tag, &entry) != 0) {
+        entry.tag = tag;
+        entry.count = 0;
+        entry.data.u8 = NULL;
+    }
+    return entry;
+}
+
+}; // namespace android
@@ -15,6 +15,10 @@
  *
  * Modified by Intel Corporation.
  * - removed dependency to binder parcels
+ * - added allocation from camera_metadata pools
+ * - added batch updates
+ * - added updates and lookups typed by tag at compile time
+ * - added tracking of the tags changed by updates
  *
  */
 
@@ -22,6 +26,7 @@
 #define ANDROID_CLIENT_CAMERA2_CAMERAMETADATA_CPP
 
 #include "system/camera_metadata.h"
+#include "camera/CameraMetadataTraits.h"
 #include <utils/String8.h>
 #include <utils/Vector.h>
 
@@ -39,6 +44,11 @@ class CameraMetadata {
     /** Creates an object with space for entryCapacity entries, with
      * dataCapacity extra storage */
     CameraMetadata(size_t entryCapacity, size_t dataCapacity = 10);
+    /** Creates an object which allocates its buffers from a pool, and gives
+     * them back to it when it resizes or clears. Copies use the same pool.
+     * The buffer is allocated by the first update if entryCapacity is 0 */
+    CameraMetadata(camera_metadata_pool_t *pool, size_t entryCapacity = 0,
+            size_t dataCapacity = 10);
 
     ~CameraMetadata();
 
@@ -147,6 +157,42 @@ class CameraMetadata {
         return update(tag, data.array(), data.size());
     }
 
+    /**
+     * Update metadata entry of a tag known at compile time. Data of another
+     * type than the one of the tag does not compile, so the type of the tag
+     * is not looked up.
+     */
+    template<uint32_t Tag>
+    status_t update(const typename TagTraits<Tag>::type *data,
+            size_t data_count) {
+        return updateImpl(Tag, TagTraits<Tag>::typeId, data, data_count);
+    }
+
+    /**
+     * One metadata entry update of a batch. The data is of the given type,
+     * which must match the type of the tag.
+     */
+    struct Update {
+        uint32_t tag;
+        uint8_t type;
+        const void *data;
+        size_t count;
+    };
+
+    /**
+     * Update several metadata entries, creating the ones that don't exist.
+     * The space for all of them is reserved up front, so the buffer is
+     * reallocated at most once, and it is sorted once at the end. Nothing is
+     * updated if the type of an update does not match its tag.
+     */
+    status_t updateBatch(const Update *updates, size_t count);
+
+    /**
+     * Update the metadata entries with all entries of another buffer, as a
+     * batch.
+     */
+    status_t updateBatch(const camera_metadata_t *updates);
+
     /**
      * Check if a metadata entry exists for a given tag id
      *
@@ -164,7 +210,21 @@ class CameraMetadata {
     camera_metadata_ro_entry find(uint32_t tag) const;
 
     /**
-     * Delete metadata entry by tag
+     * Get the values of a tag known at compile time, typed by the tag, or
+     * NULL if there is no entry. The number of values is stored in count.
+     */
+    template<uint32_t Tag>
+    const typename TagTraits<Tag>::type *get(size_t *count) const {
+        camera_metadata_ro_entry entry = find(Tag);
+        *count = entry.count;
+        return reinterpret_cast<const typename TagTraits<Tag>::type*>(
+                entry.data.u8);
+    }
+
+    /**
+     * Delete metadata entry by tag. This takes constant time, the space of the
+     * entry is reclaimed when the buffer is compacted, at the latest when it
+     * is handed out by getAndLock() or release().
      */
     status_t erase(uint32_t tag);
 
@@ -174,6 +234,25 @@ class CameraMetadata {
      */
     void swap(CameraMetadata &other);
 
+    /**
+     * Has any entry changed since the last clearDirty(), or since the object
+     * was constructed. Updates which leave an entry with the values it had
+     * do not count. Replacing or appending whole buffers (assignment,
+     * acquire(), append(), release(), clear(), swap()) counts as changing
+     * every tag.
+     */
+    bool isDirty() const;
+
+    /**
+     * Has the entry of a tag changed since the last clearDirty()
+     */
+    bool isDirty(uint32_t tag) const;
+
+    /**
+     * Forget the changes made so far
+     */
+    void clearDirty();
+
     /**
      * Dump contents into FD for debugging. The verbosity levels are
      * 0: Tag entry information only, no data values
@@ -185,6 +264,12 @@ class CameraMetadata {
      */
     void dump(int fd, int verbosity = 1, int indentation = 0) const;
 
+    /**
+     * A process wide pool, for metadata which is cloned and resized on the
+     * capture path. It lives until the process exits.
+     */
+    static camera_metadata_pool_t *sharedPool();
+
     /**
      * Serialization over Binder
      */
@@ -213,6 +298,9 @@ class CameraMetadata {
   private:
     camera_metadata_t *mBuffer;
     mutable bool       mLocked;
+    camera_metadata_pool_t *mPool;
+    Vector<uint32_t>   mDirtyTags;
+    bool               mAllDirty;
 
     /**
      * Check if tag has a given type
@@ -224,6 +312,30 @@ class CameraMetadata {
      */
     status_t updateImpl(uint32_t tag, const void *data, size_t data_count);
 
+    /**
+     * Update entry method for a tag of a known type
+     */
+    status_t updateImpl(uint32_t tag, int type, const void *data,
+            size_t data_count);
+
+    /**
+     * Add or update the entry of a tag, unless it already has the values,
+     * and mark the tag dirty. The buffer must have room for it.
+     */
+    status_t setEntry(uint32_t tag, int type, const void *data,
+            size_t data_count);
+
+    /**
+     * Add a tag to the dirty tags
+     */
+    void markDirty(uint32_t tag);
+
+    /**
+     * Base batch update method, getUpdate gets the update i of updates
+     */
+    status_t updateBatchImpl(const void *updates, size_t count,
+            void (*getUpdate)(const void *updates, size_t i, Update *update));
+
     /**
      * Resize metadata buffer if needed by reallocating it and copying it over.
      */
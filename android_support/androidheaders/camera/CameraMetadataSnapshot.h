@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_CLIENT_CAMERA2_CAMERAMETADATASNAPSHOT_H
+#define ANDROID_CLIENT_CAMERA2_CAMERAMETADATASNAPSHOT_H
+
+#include <atomic>
+#include "system/camera_metadata.h"
+#include <utils/RefBase.h>
+#include <utils/Mutex.h>
+
+namespace android {
+
+class CameraMetadata;
+
+/**
+ * An immutable camera_metadata_t buffer shared by reference counting. Copies
+ * of an sp<CameraMetadataSnapshot> share the buffer, and any number of
+ * threads may read it at the same time without locking. To change the
+ * metadata, copy it into a CameraMetadata, change that and take a new
+ * snapshot of it.
+ */
+class CameraMetadataSnapshot : public LightRefBase<CameraMetadataSnapshot> {
+  public:
+    /**
+     * Takes the buffer of a CameraMetadata, which is left empty, without
+     * copying it.
+     */
+    static sp<CameraMetadataSnapshot> acquire(CameraMetadata &metadata);
+
+    /**
+     * Takes ownership of a raw metadata buffer, which may be NULL for empty
+     * metadata.
+     */
+    static sp<CameraMetadataSnapshot> acquire(camera_metadata_t *buffer);
+
+    ~CameraMetadataSnapshot();
+
+    /**
+     * The buffer, which must not be changed. NULL for empty metadata.
+     */
+    const camera_metadata_t *buffer() const { return mBuffer; }
+
+    /**
+     * Number of metadata entries.
+     */
+    size_t entryCount() const;
+
+    /**
+     * Is the buffer empty (no entries)
+     */
+    bool isEmpty() const { return entryCount() == 0; }
+
+  private:
+    explicit CameraMetadataSnapshot(camera_metadata_t *buffer);
+
+    // a snapshot is only shared, never copied
+    CameraMetadataSnapshot(const CameraMetadataSnapshot &);
+    CameraMetadataSnapshot &operator=(const CameraMetadataSnapshot &);
+
+    camera_metadata_t *mBuffer;
+};
+
+/**
+ * The current version of some metadata, as a snapshot. Writers publish new
+ * snapshots, and readers take the current one, without waiting for the
+ * writers or for each other.
+ *
+ * The snapshot pointer is swapped atomically. A writer keeps the reference
+ * of the snapshot it replaced until the readers which may have loaded the
+ * old pointer, but not yet referenced it, are done. The readers are counted
+ * in two alternating groups, which the writer waits for in turn, so that
+ * new readers never hold up a writer.
+ */
+class CameraMetadataPublisher {
+  public:
+    explicit CameraMetadataPublisher(
+            const sp<CameraMetadataSnapshot> &snapshot = NULL);
+    ~CameraMetadataPublisher();
+
+    /**
+     * The current snapshot, which is never NULL.
+     */
+    sp<CameraMetadataSnapshot> current() const;
+
+    /**
+     * Replace the current snapshot, NULL publishes empty metadata.
+     */
+    void publish(const sp<CameraMetadataSnapshot> &snapshot);
+
+  private:
+    // a publisher cannot be copied
+    CameraMetadataPublisher(const CameraMetadataPublisher &);
+    CameraMetadataPublisher &operator=(const CameraMetadataPublisher &);
+
+    std::atomic<CameraMetadataSnapshot*> mCurrent; // holds one reference
+    mutable std::atomic<uint32_t> mEpoch;
+    mutable std::atomic<uint32_t> mReaders[2];
+    Mutex mWriteLock;                              // serializes writers
+};
+
+}; // namespace android
+
+#endif
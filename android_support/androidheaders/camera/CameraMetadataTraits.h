@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_CLIENT_CAMERA2_CAMERAMETADATATRAITS_H
+#define ANDROID_CLIENT_CAMERA2_CAMERAMETADATATRAITS_H
+
+#include "system/camera_metadata.h"
+
+namespace android {
+
+/**
+ * The camera_metadata type of the values of a C++ type.
+ */
+template<typename T> struct CameraMetadataType;
+template<> struct CameraMetadataType<uint8_t> {
+    static constexpr uint8_t value = TYPE_BYTE;
+};
+template<> struct CameraMetadataType<int32_t> {
+    static constexpr uint8_t value = TYPE_INT32;
+};
+template<> struct CameraMetadataType<float> {
+    static constexpr uint8_t value = TYPE_FLOAT;
+};
+template<> struct CameraMetadataType<int64_t> {
+    static constexpr uint8_t value = TYPE_INT64;
+};
+template<> struct CameraMetadataType<double> {
+    static constexpr uint8_t value = TYPE_DOUBLE;
+};
+template<> struct CameraMetadataType<camera_metadata_rational_t> {
+    static constexpr uint8_t value = TYPE_RATIONAL;
+};
+
+/**
+ * The C++ type of the values of a tag, as TagTraits<Tag>::type, and its
+ * camera_metadata type as TagTraits<Tag>::typeId. Only the android tags have
+ * traits, using any other tag does not compile.
+ */
+template<uint32_t Tag> struct TagTraits;
+
+/**
+ * All android tags with the C++ type of their values, for X(tag, type).
+ *
+ * ! Keep in sync with camera_metadata_tag_info.c !
+ * The list is kept by hand. The CameraMetadataTest.tagTraits unit test
+ * checks that it has every tag of the tag_info_t tables there, with the
+ * same type.
+ */
+#define CAMERA_METADATA_TAG_TYPES(X) \
+    X(ANDROID_COLOR_CORRECTION_MODE,                             uint8_t) \
+    X(ANDROID_COLOR_CORRECTION_TRANSFORM,                        camera_metadata_rational_t) \
+    X(ANDROID_COLOR_CORRECTION_GAINS,                            float) \
+    X(ANDROID_COLOR_CORRECTION_ABERRATION_MODE,                  uint8_t) \
+    X(ANDROID_COLOR_CORRECTION_AVAILABLE_ABERRATION_MODES,       uint8_t) \
+    X(ANDROID_CONTROL_AE_ANTIBANDING_MODE,                       uint8_t) \
+    X(ANDROID_CONTROL_AE_EXPOSURE_COMPENSATION,                  int32_t) \
+    X(ANDROID_CONTROL_AE_LOCK,                                   uint8_t) \
+    X(ANDROID_CONTROL_AE_MODE,                                   uint8_t) \
+    X(ANDROID_CONTROL_AE_REGIONS,                                int32_t) \
+    X(ANDROID_CONTROL_AE_TARGET_FPS_RANGE,                       int32_t) \
+    X(ANDROID_CONTROL_AE_PRECAPTURE_TRIGGER,                     uint8_t) \
+    X(ANDROID_CONTROL_AF_MODE,                                   uint8_t) \
+    X(ANDROID_CONTROL_AF_REGIONS,                                int32_t) \
+    X(ANDROID_CONTROL_AF_TRIGGER,                                uint8_t) \
+    X(ANDROID_CONTROL_AWB_LOCK,                                  uint8_t) \
+    X(ANDROID_CONTROL_AWB_MODE,                                  uint8_t) \
+    X(ANDROID_CONTROL_AWB_REGIONS,                               int32_t) \
+    X(ANDROID_CONTROL_CAPTURE_INTENT,                            uint8_t) \
+    X(ANDROID_CONTROL_EFFECT_MODE,                               uint8_t) \
+    X(ANDROID_CONTROL_MODE,                                      uint8_t) \
+    X(ANDROID_CONTROL_SCENE_MODE,                                uint8_t) \
+    X(ANDROID_CONTROL_VIDEO_STABILIZATION_MODE,                  uint8_t) \
+    X(ANDROID_CONTROL_AE_AVAILABLE_ANTIBANDING_MODES,            uint8_t) \
+    X(ANDROID_CONTROL_AE_AVAILABLE_MODES,                        uint8_t) \
+    X(ANDROID_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES,            int32_t) \
+    X(ANDROID_CONTROL_AE_COMPENSATION_RANGE,                     int32_t) \
+    X(ANDROID_CONTROL_AE_COMPENSATION_STEP,                      camera_metadata_rational_t) \
+    X(ANDROID_CONTROL_AF_AVAILABLE_MODES,                        uint8_t) \
+    X(ANDROID_CONTROL_AVAILABLE_EFFECTS,                         uint8_t) \
+    X(ANDROID_CONTROL_AVAILABLE_SCENE_MODES,                     uint8_t) \
+    X(ANDROID_CONTROL_AVAILABLE_VIDEO_STABILIZATION_MODES,       uint8_t) \
+    X(ANDROID_CONTROL_AWB_AVAILABLE_MODES,                       uint8_t) \
+    X(ANDROID_CONTROL_MAX_REGIONS,                               int32_t) \
+    X(ANDROID_CONTROL_SCENE_MODE_OVERRIDES,                      uint8_t) \
+    X(ANDROID_CONTROL_AE_PRECAPTURE_ID,                          int32_t) \
+    X(ANDROID_CONTROL_AE_STATE,                                  uint8_t) \
+    X(ANDROID_CONTROL_AF_STATE,                                  uint8_t) \
+    X(ANDROID_CONTROL_AF_TRIGGER_ID,                             int32_t) \
+    X(ANDROID_CONTROL_AWB_STATE,                                 uint8_t) \
+    X(ANDROID_CONTROL_AVAILABLE_HIGH_SPEED_VIDEO_CONFIGURATIONS, int32_t) \
+    X(ANDROID_CONTROL_AE_LOCK_AVAILABLE,                         uint8_t) \
+    X(ANDROID_CONTROL_AWB_LOCK_AVAILABLE,                        uint8_t) \
+    X(ANDROID_CONTROL_AVAILABLE_MODES,                           uint8_t) \
+    X(ANDROID_DEMOSAIC_MODE,                                     uint8_t) \
+    X(ANDROID_EDGE_MODE,                                         uint8_t) \
+    X(ANDROID_EDGE_STRENGTH,                                     uint8_t) \
+    X(ANDROID_EDGE_AVAILABLE_EDGE_MODES,                         uint8_t) \
+    X(ANDROID_FLASH_FIRING_POWER,                                uint8_t) \
+    X(ANDROID_FLASH_FIRING_TIME,                                 int64_t) \
+    X(ANDROID_FLASH_MODE,                                        uint8_t) \
+    X(ANDROID_FLASH_COLOR_TEMPERATURE,                           uint8_t) \
+    X(ANDROID_FLASH_MAX_ENERGY,                                  uint8_t) \
+    X(ANDROID_FLASH_STATE,                                       uint8_t) \
+    X(ANDROID_FLASH_INFO_AVAILABLE,                              uint8_t) \
+    X(ANDROID_FLASH_INFO_CHARGE_DURATION,                        int64_t) \
+    X(ANDROID_HOT_PIXEL_MODE,                                    uint8_t) \
+    X(ANDROID_HOT_PIXEL_AVAILABLE_HOT_PIXEL_MODES,               uint8_t) \
+    X(ANDROID_JPEG_GPS_COORDINATES,                              double) \
+    X(ANDROID_JPEG_GPS_PROCESSING_METHOD,                        uint8_t) \
+    X(ANDROID_JPEG_GPS_TIMESTAMP,                                int64_t) \
+    X(ANDROID_JPEG_ORIENTATION,                                  int32_t) \
+    X(ANDROID_JPEG_QUALITY,                                      uint8_t) \
+    X(ANDROID_JPEG_THUMBNAIL_QUALITY,                            uint8_t) \
+    X(ANDROID_JPEG_THUMBNAIL_SIZE,                               int32_t) \
+    X(ANDROID_JPEG_AVAILABLE_THUMBNAIL_SIZES,                    int32_t) \
+    X(ANDROID_JPEG_MAX_SIZE,                                     int32_t) \
+    X(ANDROID_JPEG_SIZE,                                         int32_t) \
+    X(ANDROID_LENS_APERTURE,                                     float) \
+    X(ANDROID_LENS_FILTER_DENSITY,                               float) \
+    X(ANDROID_LENS_FOCAL_LENGTH,                                 float) \
+    X(ANDROID_LENS_FOCUS_DISTANCE,                               float) \
+    X(ANDROID_LENS_OPTICAL_STABILIZATION_MODE,                   uint8_t) \
+    X(ANDROID_LENS_FACING,                                       uint8_t) \
+    X(ANDROID_LENS_POSE_ROTATION,                                float) \
+    X(ANDROID_LENS_POSE_TRANSLATION,                             float) \
+    X(ANDROID_LENS_FOCUS_RANGE,                                  float) \
+    X(ANDROID_LENS_STATE,                                        uint8_t) \
+    X(ANDROID_LENS_INTRINSIC_CALIBRATION,                        float) \
+    X(ANDROID_LENS_RADIAL_DISTORTION,                            float) \
+    X(ANDROID_LENS_INFO_AVAILABLE_APERTURES,                     float) \
+    X(ANDROID_LENS_INFO_AVAILABLE_FILTER_DENSITIES,              float) \
+    X(ANDROID_LENS_INFO_AVAILABLE_FOCAL_LENGTHS,                 float) \
+    X(ANDROID_LENS_INFO_AVAILABLE_OPTICAL_STABILIZATION,         uint8_t) \
+    X(ANDROID_LENS_INFO_HYPERFOCAL_DISTANCE,                     float) \
+    X(ANDROID_LENS_INFO_MINIMUM_FOCUS_DISTANCE,                  float) \
+    X(ANDROID_LENS_INFO_SHADING_MAP_SIZE,                        int32_t) \
+    X(ANDROID_LENS_INFO_FOCUS_DISTANCE_CALIBRATION,              uint8_t) \
+    X(ANDROID_NOISE_REDUCTION_MODE,                              uint8_t) \
+    X(ANDROID_NOISE_REDUCTION_STRENGTH,                          uint8_t) \
+    X(ANDROID_NOISE_REDUCTION_AVAILABLE_NOISE_REDUCTION_MODES,   uint8_t) \
+    X(ANDROID_QUIRKS_METERING_CROP_REGION,                       uint8_t) \
+    X(ANDROID_QUIRKS_TRIGGER_AF_WITH_AUTO,                       uint8_t) \
+    X(ANDROID_QUIRKS_USE_ZSL_FORMAT,                             uint8_t) \
+    X(ANDROID_QUIRKS_USE_PARTIAL_RESULT,                         uint8_t) \
+    X(ANDROID_QUIRKS_PARTIAL_RESULT,                             uint8_t) \
+    X(ANDROID_REQUEST_FRAME_COUNT,                               int32_t) \
+    X(ANDROID_REQUEST_ID,                                        int32_t) \
+    X(ANDROID_REQUEST_INPUT_STREAMS,                             int32_t) \
+    X(ANDROID_REQUEST_METADATA_MODE,                             uint8_t) \
+    X(ANDROID_REQUEST_OUTPUT_STREAMS,                            int32_t) \
+    X(ANDROID_REQUEST_TYPE,                                      uint8_t) \
+    X(ANDROID_REQUEST_MAX_NUM_OUTPUT_STREAMS,                    int32_t) \
+    X(ANDROID_REQUEST_MAX_NUM_REPROCESS_STREAMS,                 int32_t) \
+    X(ANDROID_REQUEST_MAX_NUM_INPUT_STREAMS,                     int32_t) \
+    X(ANDROID_REQUEST_PIPELINE_DEPTH,                            uint8_t) \
+    X(ANDROID_REQUEST_PIPELINE_MAX_DEPTH,                        uint8_t) \
+    X(ANDROID_REQUEST_PARTIAL_RESULT_COUNT,                      int32_t) \
+    X(ANDROID_REQUEST_AVAILABLE_CAPABILITIES,                    uint8_t) \
+    X(ANDROID_REQUEST_AVAILABLE_REQUEST_KEYS,                    int32_t) \
+    X(ANDROID_REQUEST_AVAILABLE_RESULT_KEYS,                     int32_t) \
+    X(ANDROID_REQUEST_AVAILABLE_CHARACTERISTICS_KEYS,            int32_t) \
+    X(ANDROID_SCALER_CROP_REGION,                                int32_t) \
+    X(ANDROID_SCALER_AVAILABLE_FORMATS,                          int32_t) \
+    X(ANDROID_SCALER_AVAILABLE_JPEG_MIN_DURATIONS,               int64_t) \
+    X(ANDROID_SCALER_AVAILABLE_JPEG_SIZES,                       int32_t) \
+    X(ANDROID_SCALER_AVAILABLE_MAX_DIGITAL_ZOOM,                 float) \
+    X(ANDROID_SCALER_AVAILABLE_PROCESSED_MIN_DURATIONS,          int64_t) \
+    X(ANDROID_SCALER_AVAILABLE_PROCESSED_SIZES,                  int32_t) \
+    X(ANDROID_SCALER_AVAILABLE_RAW_MIN_DURATIONS,                int64_t) \
+    X(ANDROID_SCALER_AVAILABLE_RAW_SIZES,                        int32_t) \
+    X(ANDROID_SCALER_AVAILABLE_INPUT_OUTPUT_FORMATS_MAP,         int32_t) \
+    X(ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS,            int32_t) \
+    X(ANDROID_SCALER_AVAILABLE_MIN_FRAME_DURATIONS,              int64_t) \
+    X(ANDROID_SCALER_AVAILABLE_STALL_DURATIONS,                  int64_t) \
+    X(ANDROID_SCALER_CROPPING_TYPE,                              uint8_t) \
+    X(ANDROID_SENSOR_EXPOSURE_TIME,                              int64_t) \
+    X(ANDROID_SENSOR_FRAME_DURATION,                             int64_t) \
+    X(ANDROID_SENSOR_SENSITIVITY,                                int32_t) \
+    X(ANDROID_SENSOR_REFERENCE_ILLUMINANT1,                      uint8_t) \
+    X(ANDROID_SENSOR_REFERENCE_ILLUMINANT2,                      uint8_t) \
+    X(ANDROID_SENSOR_CALIBRATION_TRANSFORM1,                     camera_metadata_rational_t) \
+    X(ANDROID_SENSOR_CALIBRATION_TRANSFORM2,                     camera_metadata_rational_t) \
+    X(ANDROID_SENSOR_COLOR_TRANSFORM1,                           camera_metadata_rational_t) \
+    X(ANDROID_SENSOR_COLOR_TRANSFORM2,                           camera_metadata_rational_t) \
+    X(ANDROID_SENSOR_FORWARD_MATRIX1,                            camera_metadata_rational_t) \
+    X(ANDROID_SENSOR_FORWARD_MATRIX2,                            camera_metadata_rational_t) \
+    X(ANDROID_SENSOR_BASE_GAIN_FACTOR,                           camera_metadata_rational_t) \
+    X(ANDROID_SENSOR_BLACK_LEVEL_PATTERN,                        int32_t) \
+    X(ANDROID_SENSOR_MAX_ANALOG_SENSITIVITY,                     int32_t) \
+    X(ANDROID_SENSOR_ORIENTATION,                                int32_t) \
+    X(ANDROID_SENSOR_PROFILE_HUE_SAT_MAP_DIMENSIONS,             int32_t) \
+    X(ANDROID_SENSOR_TIMESTAMP,                                  int64_t) \
+    X(ANDROID_SENSOR_TEMPERATURE,                                float) \
+    X(ANDROID_SENSOR_NEUTRAL_COLOR_POINT,                        camera_metadata_rational_t) \
+    X(ANDROID_SENSOR_NOISE_PROFILE,                              double) \
+    X(ANDROID_SENSOR_PROFILE_HUE_SAT_MAP,                        float) \
+    X(ANDROID_SENSOR_PROFILE_TONE_CURVE,                         float) \
+    X(ANDROID_SENSOR_GREEN_SPLIT,                                float) \
+    X(ANDROID_SENSOR_TEST_PATTERN_DATA,                          int32_t) \
+    X(ANDROID_SENSOR_TEST_PATTERN_MODE,                          int32_t) \
+    X(ANDROID_SENSOR_AVAILABLE_TEST_PATTERN_MODES,               int32_t) \
+    X(ANDROID_SENSOR_ROLLING_SHUTTER_SKEW,                       int64_t) \
+    X(ANDROID_SENSOR_INFO_ACTIVE_ARRAY_SIZE,                     int32_t) \
+    X(ANDROID_SENSOR_INFO_SENSITIVITY_RANGE,                     int32_t) \
+    X(ANDROID_SENSOR_INFO_COLOR_FILTER_ARRANGEMENT,              uint8_t) \
+    X(ANDROID_SENSOR_INFO_EXPOSURE_TIME_RANGE,                   int64_t) \
+    X(ANDROID_SENSOR_INFO_MAX_FRAME_DURATION,                    int64_t) \
+    X(ANDROID_SENSOR_INFO_PHYSICAL_SIZE,                         float) \
+    X(ANDROID_SENSOR_INFO_PIXEL_ARRAY_SIZE,                      int32_t) \
+    X(ANDROID_SENSOR_INFO_WHITE_LEVEL,                           int32_t) \
+    X(ANDROID_SENSOR_INFO_TIMESTAMP_SOURCE,                      uint8_t) \
+    X(ANDROID_SENSOR_INFO_LENS_SHADING_APPLIED,                  uint8_t) \
+    X(ANDROID_SENSOR_INFO_PRE_CORRECTION_ACTIVE_ARRAY_SIZE,      int32_t) \
+    X(ANDROID_SHADING_MODE,                                      uint8_t) \
+    X(ANDROID_SHADING_STRENGTH,                                  uint8_t) \
+    X(ANDROID_SHADING_AVAILABLE_MODES,                           uint8_t) \
+    X(ANDROID_STATISTICS_FACE_DETECT_MODE,                       uint8_t) \
+    X(ANDROID_STATISTICS_HISTOGRAM_MODE,                         uint8_t) \
+    X(ANDROID_STATISTICS_SHARPNESS_MAP_MODE,                     uint8_t) \
+    X(ANDROID_STATISTICS_HOT_PIXEL_MAP_MODE,                     uint8_t) \
+    X(ANDROID_STATISTICS_FACE_IDS,                               int32_t) \
+    X(ANDROID_STATISTICS_FACE_LANDMARKS,                         int32_t) \
+    X(ANDROID_STATISTICS_FACE_RECTANGLES,                        int32_t) \
+    X(ANDROID_STATISTICS_FACE_SCORES,                            uint8_t) \
+    X(ANDROID_STATISTICS_HISTOGRAM,                              int32_t) \
+    X(ANDROID_STATISTICS_SHARPNESS_MAP,                          int32_t) \
+    X(ANDROID_STATISTICS_LENS_SHADING_CORRECTION_MAP,            uint8_t) \
+    X(ANDROID_STATISTICS_LENS_SHADING_MAP,                       float) \
+    X(ANDROID_STATISTICS_PREDICTED_COLOR_GAINS,                  float) \
+    X(ANDROID_STATISTICS_PREDICTED_COLOR_TRANSFORM,              camera_metadata_rational_t) \
+    X(ANDROID_STATISTICS_SCENE_FLICKER,                          uint8_t) \
+    X(ANDROID_STATISTICS_HOT_PIXEL_MAP,                          int32_t) \
+    X(ANDROID_STATISTICS_LENS_SHADING_MAP_MODE,                  uint8_t) \
+    X(ANDROID_STATISTICS_INFO_AVAILABLE_FACE_DETECT_MODES,       uint8_t) \
+    X(ANDROID_STATISTICS_INFO_HISTOGRAM_BUCKET_COUNT,            int32_t) \
+    X(ANDROID_STATISTICS_INFO_MAX_FACE_COUNT,                    int32_t) \
+    X(ANDROID_STATISTICS_INFO_MAX_HISTOGRAM_COUNT,               int32_t) \
+    X(ANDROID_STATISTICS_INFO_MAX_SHARPNESS_MAP_VALUE,           int32_t) \
+    X(ANDROID_STATISTICS_INFO_SHARPNESS_MAP_SIZE,                int32_t) \
+    X(ANDROID_STATISTICS_INFO_AVAILABLE_HOT_PIXEL_MAP_MODES,     uint8_t) \
+    X(ANDROID_STATISTICS_INFO_AVAILABLE_LENS_SHADING_MAP_MODES,  uint8_t) \
+    X(ANDROID_TONEMAP_CURVE_BLUE,                                float) \
+    X(ANDROID_TONEMAP_CURVE_GREEN,                               float) \
+    X(ANDROID_TONEMAP_CURVE_RED,                                 float) \
+    X(ANDROID_TONEMAP_MODE,                                      uint8_t) \
+    X(ANDROID_TONEMAP_MAX_CURVE_POINTS,                          int32_t) \
+    X(ANDROID_TONEMAP_AVAILABLE_TONE_MAP_MODES,                  uint8_t) \
+    X(ANDROID_TONEMAP_GAMMA,                                     float) \
+    X(ANDROID_TONEMAP_PRESET_CURVE,                              uint8_t) \
+    X(ANDROID_LED_TRANSMIT,                                      uint8_t) \
+    X(ANDROID_LED_AVAILABLE_LEDS,                                uint8_t) \
+    X(ANDROID_INFO_SUPPORTED_HARDWARE_LEVEL,                     uint8_t) \
+    X(ANDROID_BLACK_LEVEL_LOCK,                                  uint8_t) \
+    X(ANDROID_SYNC_FRAME_NUMBER,                                 int64_t) \
+    X(ANDROID_SYNC_MAX_LATENCY,                                  int32_t) \
+    X(ANDROID_REPROCESS_EFFECTIVE_EXPOSURE_FACTOR,               float) \
+    X(ANDROID_REPROCESS_MAX_CAPTURE_STALL,                       int32_t) \
+    X(ANDROID_DEPTH_MAX_DEPTH_SAMPLES,                           int32_t) \
+    X(ANDROID_DEPTH_AVAILABLE_DEPTH_STREAM_CONFIGURATIONS,       int32_t) \
+    X(ANDROID_DEPTH_AVAILABLE_DEPTH_MIN_FRAME_DURATIONS,         int64_t) \
+    X(ANDROID_DEPTH_AVAILABLE_DEPTH_STALL_DURATIONS,             int64_t) \
+    X(ANDROID_DEPTH_DEPTH_IS_EXCLUSIVE,                          uint8_t)
+
+#define CAMERA_METADATA_TAG_TRAITS(tag, T)                              \
+    template<> struct TagTraits<tag> {                                  \
+        typedef T type;                                                 \
+        static constexpr uint8_t typeId = CameraMetadataType<T>::value; \
+    };
+CAMERA_METADATA_TAG_TYPES(CAMERA_METADATA_TAG_TRAITS)
+#undef CAMERA_METADATA_TAG_TRAITS
+
+}; // namespace android
+
+#endif
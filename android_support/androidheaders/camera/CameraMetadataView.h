@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_CLIENT_CAMERA2_CAMERAMETADATAVIEW_H
+#define ANDROID_CLIENT_CAMERA2_CAMERAMETADATAVIEW_H
+
+#include "system/camera_metadata.h"
+#include "camera/CameraMetadataTraits.h"
+
+namespace android {
+
+/**
+ * A read-only view of a camera_metadata_t buffer owned by someone else, such
+ * as the result of a capture result callback, which is only valid during the
+ * callback. Unlike a CameraMetadata, the view neither copies nor allocates
+ * anything, and it must not outlive the buffer.
+ *
+ * Tags which are read several times can be prefetched, their entries are
+ * then looked up once and kept in the view.
+ */
+class CameraMetadataView {
+  public:
+    static const size_t MAX_PREFETCHED_TAGS = 16;
+
+    explicit CameraMetadataView(const camera_metadata_t *buffer = NULL);
+
+    /**
+     * Look up the entries of tags, up to MAX_PREFETCHED_TAGS of them, so
+     * that finding them later does not search the buffer. Replaces the
+     * tags prefetched before.
+     */
+    void prefetch(const uint32_t *tags, size_t count);
+
+    const camera_metadata_t *buffer() const { return mBuffer; }
+
+    /**
+     * Number of metadata entries.
+     */
+    size_t entryCount() const;
+
+    /**
+     * Is the buffer empty (no entries)
+     */
+    bool isEmpty() const { return entryCount() == 0; }
+
+    /**
+     * Get metadata entry by tag id, the count is 0 if there is none
+     */
+    camera_metadata_ro_entry find(uint32_t tag) const;
+
+    /**
+     * Get the values of a tag, or NULL if there is no entry or its values
+     * are not of type T. The number of values is stored in count.
+     */
+    template<typename T>
+    const T *find(uint32_t tag, size_t *count) const {
+        camera_metadata_ro_entry entry = find(tag);
+        if (entry.count == 0 || entry.type != CameraMetadataType<T>::value) {
+            *count = 0;
+            return NULL;
+        }
+        *count = entry.count;
+        return reinterpret_cast<const T*>(entry.data.u8);
+    }
+
+    /**
+     * Get the single value of a tag. Returns false, leaving value alone, if
+     * the tag does not have exactly one value of type T.
+     */
+    template<typename T>
+    bool get(uint32_t tag, T *value) const {
+        size_t count;
+        const T *data = find<T>(tag, &count);
+        if (data == NULL || count != 1) {
+            return false;
+        }
+        *value = data[0];
+        return true;
+    }
+
+  private:
+    const camera_metadata_t *mBuffer;
+    size_t mPrefetchedCount;
+    camera_metadata_ro_entry mPrefetched[MAX_PREFETCHED_TAGS];
+};
+
+}; // namespace android
+
+#endif
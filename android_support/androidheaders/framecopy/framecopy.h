@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FRAMECOPY_FRAMECOPY_H
+#define _FRAMECOPY_FRAMECOPY_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Copies of whole frames, for framebuffer posts and buffer to buffer copies
+ * of consumers (libframecopy).
+ *
+ * Copies larger than the caches are done with non-temporal AVX2 or SSE2
+ * stores, which go to memory without first reading the destination into
+ * the cache and without evicting the working set of other threads. Very
+ * large copies are split into stripes over a few threads. Small copies are
+ * plain memcpy calls. The source and destination must not overlap.
+ */
+void frame_copy(void *dst, const void *src, size_t size);
+
+/*
+ * Copies height rows of width bytes between buffers with different strides,
+ * such as a gralloc buffer with padded rows into a framebuffer. Contiguous
+ * rows are copied as a single block.
+ */
+void frame_copy_2d(void *dst, size_t dstStride,
+                   const void *src, size_t srcStride,
+                   size_t width, size_t height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FRAMECOPY_FRAMECOPY_H */
@@ -151,8 +151,13 @@ enum {
 };
 
 enum gralloc_perform_operations {
-    GRALLOC_MAP_FD,  /* for mapping (read-only) an fd */
-    GRALLOC_UNMAP_FD /* for unmapping an fd */
+    GRALLOC_MAP_FD,   /* for mapping (read-only) an fd */
+    GRALLOC_UNMAP_FD, /* for unmapping an fd */
+    GRALLOC_TRIM_POOL, /* for releasing recycled buffers, down to a byte count */
+    GRALLOC_GET_PINNED_SIZE, /* for querying the bytes of mlocked mappings */
+    GRALLOC_SET_BACKEND, /* for choosing the allocation backend by name */
+    GRALLOC_RESERVE_HANDLES, /* for pre-sizing the handle slab to a buffer count */
+    GRALLOC_GET_GENERATION /* for telling a handle from a later one in its slot */
 };
 
 /*****************************************************************************/
@@ -12,6 +12,14 @@
  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
  * See the License for the specific language governing permissions and
  * limitations under the License.
+ *
+ * Modified by Intel Corporation.
+ * - added pools of camera_metadata buffers
+ * - added adding entries of a type known by the caller
+ * - added diffs of two metadata buffers
+ * - added erasing entries as tombstones, which are compacted later
+ * - added finding tags by their names through perfect hashes
+ *
  */
 
 #ifndef SYSTEM_MEDIA_INCLUDE_ANDROID_CAMERA_METADATA_H
@@ -210,6 +218,60 @@ camera_metadata_t *place_camera_metadata(void *dst, size_t dst_size,
 ANDROID_API
 void free_camera_metadata(camera_metadata_t *metadata);
 
+/**
+ * A pool of freed camera_metadata buffers, kept in free lists by capacity, so
+ * that buffers which are allocated and freed over and over, such as request
+ * settings and capture results, are reused instead of going through malloc.
+ * Pools are safe to use from several threads.
+ */
+typedef struct camera_metadata_pool camera_metadata_pool_t;
+
+/**
+ * Create a pool, which keeps up to max_free_buffers freed buffers of each
+ * capacity.
+ */
+ANDROID_API
+camera_metadata_pool_t *create_camera_metadata_pool(size_t max_free_buffers);
+
+/**
+ * Destroy a pool and free the buffers it keeps. Buffers allocated from the
+ * pool which are still in use must be freed with free_camera_metadata()
+ * afterwards.
+ */
+ANDROID_API
+void destroy_camera_metadata_pool(camera_metadata_pool_t *pool);
+
+/**
+ * Allocate a camera_metadata structure like allocate_camera_metadata(), from
+ * the free buffers of the pool if it has one. The capacities are rounded up
+ * to powers of two. A NULL pool allocates like allocate_camera_metadata().
+ *
+ * The result can be given back to the pool with
+ * free_pooled_camera_metadata(), or freed with free_camera_metadata().
+ */
+ANDROID_API
+camera_metadata_t *allocate_pooled_camera_metadata(camera_metadata_pool_t *pool,
+        size_t entry_capacity,
+        size_t data_capacity);
+
+/**
+ * Give a camera_metadata structure allocated with
+ * allocate_camera_metadata() or one of the pool functions back to the pool,
+ * or free it if the pool keeps enough buffers of its capacity already. A NULL
+ * pool frees like free_camera_metadata().
+ */
+ANDROID_API
+void free_pooled_camera_metadata(camera_metadata_pool_t *pool,
+        camera_metadata_t *metadata);
+
+/**
+ * Clone a camera_metadata structure like clone_camera_metadata(), into a
+ * buffer from the pool.
+ */
+ANDROID_API
+camera_metadata_t *clone_pooled_camera_metadata(camera_metadata_pool_t *pool,
+        const camera_metadata_t *src);
+
 /**
  * Calculate the buffer size needed for a metadata structure of entry_count
  * metadata entries, needing a total of data_count bytes of extra data storage.
@@ -234,7 +296,9 @@ ANDROID_API
 size_t get_camera_metadata_compact_size(const camera_metadata_t *metadata);
 
 /**
- * Get the current number of entries in the metadata packet.
+ * Get the current number of entries in the metadata packet. This includes
+ * entries erased with erase_camera_metadata_entry() until the packet is
+ * compacted.
  *
  * metadata packet must be valid, which can be checked before the call with
  * validate_camera_metadata_structure().
@@ -342,6 +406,20 @@ int add_camera_metadata_entry(camera_metadata_t *dst,
         const void *data,
         size_t data_count);
 
+/**
+ * Add a metadata entry like add_camera_metadata_entry(), for callers which
+ * already know the type of the tag, which is then not looked up. The type
+ * must be the type of the tag.
+ *
+ * Returns 0 on success. A non-0 value is returned on error.
+ */
+ANDROID_API
+int add_camera_metadata_entry_of_type(camera_metadata_t *dst,
+        uint32_t tag,
+        uint8_t type,
+        const void *data,
+        size_t data_count);
+
 /**
  * Sort the metadata buffer for fast searching. If already marked as sorted,
  * does nothing. Adding or appending entries to the buffer will place the buffer
@@ -361,7 +439,8 @@ int sort_camera_metadata(camera_metadata_t *dst);
  * the entry. The data pointer points to the real data in the buffer, and can be
  * updated as long as the data count does not change.
  *
- * Returns 0 on success. A non-0 value is returned on error.
+ * Returns 0 on success, and -ENOENT for an erased entry, which iterations over
+ * all entries skip. A non-0 value is returned on error.
  */
 ANDROID_API
 int get_camera_metadata_entry(camera_metadata_t *src,
@@ -390,7 +469,9 @@ int find_camera_metadata_entry(camera_metadata_t *src,
         camera_metadata_entry_t *entry);
 
 /**
- * Find an entry with given tag value, but disallow editing the data
+ * Find an entry with given tag value, but disallow editing the data. Lookups
+ * do not write to the packet, which may be shared by several threads or be
+ * in read-only memory.
  */
 ANDROID_API
 int find_camera_metadata_ro_entry(const camera_metadata_t *src,
@@ -407,6 +488,39 @@ ANDROID_API
 int delete_camera_metadata_entry(camera_metadata_t *dst,
         size_t index);
 
+/**
+ * Erase an entry at given index. Unlike delete_camera_metadata_entry(), this
+ * takes constant time: the entry stays in the packet as a tombstone, which
+ * lookups and iterations skip, and its entry and data space is reclaimed by
+ * compact_camera_metadata(). Sorting is maintained, and the indices of the
+ * other entries stay valid until the packet is compacted.
+ *
+ * The packet is compacted by this call once tombstones outnumber the live
+ * entries, and by adding an entry to a packet which has no room left
+ * otherwise, as well as by sorting and cloning.
+ *
+ * Returns 0 on success. A non-0 value is returned on error.
+ */
+ANDROID_API
+int erase_camera_metadata_entry(camera_metadata_t *dst,
+        size_t index);
+
+/**
+ * Remove the tombstones of erased entries and their data from the packet.
+ * This moves entries, so it invalidates existing camera_metadata_entry
+ * instances and entry indices, but maintains sorting.
+ *
+ * Returns 0 on success. A non-0 value is returned on error.
+ */
+ANDROID_API
+int compact_camera_metadata(camera_metadata_t *dst);
+
+/**
+ * Get the number of erased entries which were not compacted yet.
+ */
+ANDROID_API
+size_t get_camera_metadata_tombstone_count(const camera_metadata_t *metadata);
+
 /**
  * Updates a metadata entry with new data. If the data size is changing, may
  * need to adjust the data array, making this an O(N) operation. If the data
@@ -423,6 +537,43 @@ int update_camera_metadata_entry(camera_metadata_t *dst,
         size_t data_count,
         camera_metadata_entry_t *updated_entry);
 
+/**
+ * The ways an entry can differ between two metadata buffers, as reported by
+ * diff_camera_metadata().
+ */
+enum {
+    // The tag only has an entry in the second buffer
+    CAMERA_METADATA_ENTRY_ADDED,
+    // The tag only has an entry in the first buffer
+    CAMERA_METADATA_ENTRY_REMOVED,
+    // The tag has entries of different types, counts or values in both
+    CAMERA_METADATA_ENTRY_CHANGED,
+};
+
+/**
+ * Called by diff_camera_metadata() for each differing tag, with its entry in
+ * the first buffer as a, or NULL if added, and its entry in the second buffer
+ * as b, or NULL if removed.
+ */
+typedef void (*camera_metadata_diff_callback_t)(void *user, int change,
+        const camera_metadata_ro_entry_t *a,
+        const camera_metadata_ro_entry_t *b);
+
+/**
+ * Compare the entries of two metadata buffers, and call callback, unless it
+ * is NULL, for each tag that was added, removed or changed from a to b. If
+ * both buffers are sorted, they are merged in a single pass and the tags are
+ * reported in ascending order, otherwise each entry is looked up in the other
+ * buffer. Neither buffer is modified.
+ *
+ * Returns the number of differing tags, or a negative value on error.
+ */
+ANDROID_API
+int diff_camera_metadata(const camera_metadata_t *a,
+        const camera_metadata_t *b,
+        camera_metadata_diff_callback_t callback,
+        void *user);
+
 /**
  * Retrieve human-readable name of section the tag is in. Returns NULL if
  * no such tag is defined. Returns NULL for tags in the vendor section, unless
@@ -447,6 +598,18 @@ const char *get_camera_metadata_tag_name(uint32_t tag);
 ANDROID_API
 int get_camera_metadata_tag_type(uint32_t tag);
 
+/**
+ * Find the tag of a full tag name, the section name and the tag name joined
+ * by a '.', such as "android.control.aeMode". Vendor tags are found once
+ * set_camera_metadata_vendor_ops() has been used. A lookup hashes the name
+ * once and compares it with one tag name.
+ *
+ * Returns 0 and sets tag if the name is found, NOT_FOUND (-ENOENT) if it is
+ * not, and a non-0 value on other errors.
+ */
+ANDROID_API
+int find_camera_metadata_tag(const char *name, uint32_t *tag);
+
 /**
  * Set up vendor-specific tag query methods. These are needed to properly add
  * entries with vendor-specified tags and to use the
@@ -60,6 +60,18 @@ public:
     // is already signalled, so using this is usually not necessary.
     bool isValid() const { return mFenceFd != -1; }
 
+    // create returns a new unsignaled fence for producers that do not get
+    // fences from a kernel sync driver.  It is backed by an eventfd and can
+    // be waited on, merged and passed to other processes like a sync fence.
+    // NO_FENCE is returned on error.
+    static sp<Fence> create();
+
+    // signal signals a fence returned by create(), recording the current
+    // system monotonic clock time as its signal time.  Signaling a fence
+    // again has no effect.  Fences from a sync driver are signaled by the
+    // kernel, for these INVALID_OPERATION is returned.
+    status_t signal();
+
     // wait waits for up to timeout milliseconds for the fence to signal.  If
     // the fence signals then NO_ERROR is returned. If the timeout expires
     // before the fence signals then -ETIME is returned.  A timeout of
@@ -13,6 +13,10 @@
 ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 ** See the License for the specific language governing permissions and
 ** limitations under the License.
+*
+* Modified by Intel Corporation.
+* - replaced the allocation list with sharded records and added getStats
+*
 */
 
 #ifndef ANDROID_BUFFER_ALLOCATOR_H
@@ -24,6 +28,7 @@
 
 #include <utils/Errors.h>
 #include <utils/KeyedVector.h>
+#include <utils/Vector.h>
 #include <utils/threads.h>
 #include <utils/Singleton.h>
 
@@ -69,6 +74,20 @@ public:
     void dump(String8& res) const;
     static void dumpToSystemLog();
 
+    struct alloc_stats_t {
+        PixelFormat format;     // 0 in the totals
+        uint32_t usage;         // 0 in the totals
+        size_t count;           // live buffers
+        size_t bytes;           // live bytes
+        size_t maxBytes;        // high-water mark of bytes
+    };
+
+    // getStats returns the totals of the buffers allocated through the
+    // allocator and, if perFormat is given, one entry per format and usage
+    // seen so far. It takes no lock, so the counters may be a few
+    // allocations apart from each other while other threads allocate.
+    alloc_stats_t getStats(Vector<alloc_stats_t>* perFormat = NULL) const;
+
 private:
     struct alloc_rec_t {
         uint32_t width;
@@ -79,8 +98,19 @@ private:
         size_t size;
     };
 
-    static Mutex sLock;
-    static KeyedVector<buffer_handle_t, alloc_rec_t> sAllocList;
+    // the records are spread over shards by handle, each with its own
+    // lock and counters, so that threads allocating in parallel do not
+    // serialize on one lock
+    struct alloc_shard_t;
+    struct stats_slot_t;
+    enum { SHARD_COUNT = 16, STATS_SLOT_COUNT = 64 };
+
+    static alloc_shard_t sShards[SHARD_COUNT];
+    static stats_slot_t sStatsSlots[STATS_SLOT_COUNT];
+
+    static alloc_shard_t& shardFor(buffer_handle_t handle);
+    static stats_slot_t* statsSlotFor(PixelFormat format, uint32_t usage);
+    static void account(const alloc_rec_t& rec, bool add);
 
     friend class Singleton<GraphicBufferAllocator>;
     GraphicBufferAllocator();
@@ -12,6 +12,15 @@
  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
  * See the License for the specific language governing permissions and
  * limitations under the License.
+ *
+ * Modified by Intel Corporation.
+ * - added a tag index for constant time lookups
+ * - added pools of camera_metadata buffers
+ * - added adding entries of a type known by the caller
+ * - added diffs of two metadata buffers
+ * - added erasing entries as tombstones, which are compacted later
+ * - added finding tags by their names through perfect hashes
+ *
  */
 
 #include <inttypes.h>
@@ -21,8 +30,10 @@
 #define LOG_TAG "camera_metadata"
 #include <cutils/log.h>
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #define OK         0
@@ -81,9 +92,15 @@ typedef uint32_t metadata_size_t;
  *   | free space for                                |
  *   | (data_capacity-data_count) bytes              |
  *   |-----------------------------------------------|
+ *   | tag index, if index_start is not 0            |
+ *   |-----------------------------------------------|
  *
  * With the total length of the whole packet being camera_metadata.size bytes.
  *
+ * Entries erased by erase_camera_metadata_entry stay in the entry array as
+ * tombstones, with type TYPE_TOMBSTONE and no data, until the packet is
+ * compacted. Their data stays in the data array until then too, unused.
+ *
  * In short, the entries and data are contiguous in memory after the metadata
  * header.
  */
@@ -98,6 +115,8 @@ struct camera_metadata {
     metadata_size_t          data_count;
     metadata_size_t          data_capacity;
     metadata_uptrdiff_t      data_start; // Offset from camera_metadata
+    metadata_uptrdiff_t      index_start; // Offset from camera_metadata, or 0
+    metadata_size_t          tombstone_count; // Erased entries, not compacted
     uint8_t                  reserved[];
 };
 
@@ -131,6 +150,10 @@ typedef union camera_metadata_data {
 
 /** Flag definitions */
 #define FLAG_SORTED 0x00000001
+#define FLAG_INDEXED 0x00000002 // the tag index matches the entries
+
+/** The type of erased entries, which are skipped until they are compacted */
+#define TYPE_TOMBSTONE 0xFF
 
 /** Tag information */
 
@@ -169,6 +192,87 @@ static uint8_t *get_data(const camera_metadata_t *metadata) {
     return (uint8_t*)metadata + metadata->data_start;
 }
 
+static int is_tombstone(const camera_metadata_buffer_entry_t *entry) {
+    return entry->type == TYPE_TOMBSTONE;
+}
+
+/**
+ * The tag index gives the entry of every tag of the android sections in
+ * constant time, whether the entries are sorted or not. It has a slot per
+ * tag, the slots of a section starting at index_section_base[section], and
+ * a slot holds the entry index + 1 of the first entry with its tag, or 0 if
+ * there is none.
+ *
+ * Packets allocated with allocate_camera_metadata for INDEX_MIN_ENTRIES or
+ * more entries have room for an index after the data. Only the functions
+ * changing a packet write its index: adding entries adds them to it, and
+ * sorting, deleting and compacting entries, which move entries around,
+ * rebuild it. The slot of an erased tag keeps pointing to the tombstone,
+ * and lookups of it search the entries, which finds a duplicate entry of the
+ * tag, if there is one.
+ * Vendor tags and packets without a built index are searched as before.
+ *
+ * Lookups never write to the packet, so that threads may look up a shared
+ * packet at the same time, and packets in read-only memory can be looked up.
+ */
+typedef uint16_t metadata_index_t;
+#define INDEX_MIN_ENTRIES 16
+#define INDEX_MAX_ENTRIES 0xFFFF
+
+static uint32_t index_section_base[ANDROID_SECTION_COUNT + 1];
+
+__attribute__((constructor))
+static void init_index_section_base() {
+    uint32_t base = 0;
+    for (size_t i = 0; i < ANDROID_SECTION_COUNT; i++) {
+        index_section_base[i] = base;
+        base += camera_metadata_section_bounds[i][1] -
+                camera_metadata_section_bounds[i][0];
+    }
+    index_section_base[ANDROID_SECTION_COUNT] = base;
+}
+
+static size_t get_index_size() {
+    return sizeof(metadata_index_t[index_section_base[ANDROID_SECTION_COUNT]]);
+}
+
+static int get_index_slot(uint32_t tag) {
+    uint32_t tag_section = tag >> 16;
+    if (tag_section >= ANDROID_SECTION_COUNT ||
+            tag >= camera_metadata_section_bounds[tag_section][1]) {
+        return -1;
+    }
+    return index_section_base[tag_section] + (tag & 0xFFFF);
+}
+
+static metadata_index_t *get_index(const camera_metadata_t *metadata) {
+    return (metadata_index_t*)((uint8_t*)metadata + metadata->index_start);
+}
+
+static void index_add_entry(camera_metadata_t *dst, size_t index) {
+    camera_metadata_buffer_entry_t *entries = get_entries(dst);
+    if (is_tombstone(&entries[index])) return;
+    int slot = get_index_slot(entries[index].tag);
+    if (slot < 0) return;
+
+    metadata_index_t *tag_index = get_index(dst);
+    // a duplicate tag keeps its first entry, like the linear search
+    if (tag_index[slot] == 0 ||
+            is_tombstone(&entries[tag_index[slot] - 1])) {
+        tag_index[slot] = index + 1;
+    }
+}
+
+static void build_index(camera_metadata_t *dst) {
+    if (dst->index_start == 0) return;
+
+    memset(get_index(dst), 0, get_index_size());
+    for (size_t i = 0; i < dst->entry_count; i++) {
+        index_add_entry(dst, i);
+    }
+    dst->flags |= FLAG_INDEXED;
+}
+
 size_t get_camera_metadata_alignment() {
     return METADATA_PACKET_ALIGNMENT;
 }
@@ -189,19 +293,60 @@ camera_metadata_t *allocate_copy_camera_metadata_checked(
         free(buffer);
         return NULL;
     }
+    // the index of an untrusted packet is rebuilt before it is used
+    metadata->flags &= ~FLAG_INDEXED;
+    build_index(metadata);
 
     return metadata;
 }
 
+/**
+ * The size of a packet from allocate_camera_metadata, which includes the
+ * tag index of packets with enough entries. index_start is set to where the
+ * index goes, or to 0.
+ */
+static size_t calculate_allocation_size(size_t entry_capacity,
+                                        size_t data_capacity,
+                                        size_t *index_start) {
+    size_t memory_needed = calculate_camera_metadata_size(entry_capacity,
+                                                          data_capacity);
+    *index_start = 0;
+    if (entry_capacity >= INDEX_MIN_ENTRIES &&
+            entry_capacity <= INDEX_MAX_ENTRIES) {
+        *index_start = ALIGN_TO(memory_needed, sizeof(metadata_index_t));
+        memory_needed = *index_start + get_index_size();
+    }
+    return memory_needed;
+}
+
+static camera_metadata_t *place_allocated_camera_metadata(void *buffer,
+                                                          size_t entry_capacity,
+                                                          size_t data_capacity) {
+    size_t index_start;
+    size_t memory_needed = calculate_allocation_size(entry_capacity,
+                                                     data_capacity,
+                                                     &index_start);
+    camera_metadata_t *metadata = place_camera_metadata(buffer, memory_needed,
+                                                        entry_capacity,
+                                                        data_capacity);
+    if (metadata != NULL && index_start != 0) {
+        metadata->size = memory_needed;
+        metadata->index_start = index_start;
+        build_index(metadata);
+        assert(validate_camera_metadata_structure(metadata, NULL) == OK);
+    }
+    return metadata;
+}
+
 camera_metadata_t *allocate_camera_metadata(size_t entry_capacity,
                                             size_t data_capacity) {
 
-    size_t memory_needed = calculate_camera_metadata_size(entry_capacity,
-                                                          data_capacity);
-    void *buffer = malloc(memory_needed);
-    return place_camera_metadata(buffer, memory_needed,
-                                 entry_capacity,
-                                 data_capacity);
+    size_t index_start;
+    void *buffer = malloc(calculate_allocation_size(entry_capacity,
+                                                    data_capacity,
+                                                    &index_start));
+    return place_allocated_camera_metadata(buffer, entry_capacity,
+                                           data_capacity);
 }
 
 camera_metadata_t *place_camera_metadata(void *dst,
@@ -227,6 +372,8 @@ camera_metadata_t *place_camera_metadata(void *dst,
     size_t data_unaligned = (uint8_t*)(get_entries(metadata) +
             metadata->entry_capacity) - (uint8_t*)metadata;
     metadata->data_start = ALIGN_TO(data_unaligned, DATA_ALIGNMENT);
+    metadata->index_start = 0;
+    metadata->tombstone_count = 0;
 
     assert(validate_camera_metadata_structure(metadata, NULL) == OK);
     return metadata;
@@ -235,6 +382,143 @@ void free_camera_metadata(camera_metadata_t *metadata) {
     free(metadata);
 }
 
+/**
+ * Pools round capacities up to powers of two between these shifts, which
+ * gives a free list per pair of entry and data capacities. Larger buffers
+ * are not pooled. The free buffers of a list are linked through the first
+ * bytes of their data.
+ */
+#define POOL_MIN_ENTRY_SHIFT 4  // 16 entries
+#define POOL_MAX_ENTRY_SHIFT 12 // 4096 entries
+#define POOL_MIN_DATA_SHIFT  8  // 256 bytes
+#define POOL_MAX_DATA_SHIFT  20 // 1 MB
+#define POOL_ENTRY_CLASSES (POOL_MAX_ENTRY_SHIFT - POOL_MIN_ENTRY_SHIFT + 1)
+#define POOL_DATA_CLASSES  (POOL_MAX_DATA_SHIFT - POOL_MIN_DATA_SHIFT + 1)
+
+struct camera_metadata_pool {
+    pthread_mutex_t    lock;
+    size_t             max_free_buffers;
+    camera_metadata_t *free_buffers[POOL_ENTRY_CLASSES][POOL_DATA_CLASSES];
+    size_t             free_count[POOL_ENTRY_CLASSES][POOL_DATA_CLASSES];
+};
+
+/** The shift of the smallest power of two >= max(value, 1 << min_shift) */
+static int pool_shift(size_t value, int min_shift) {
+    int shift = min_shift;
+    while (shift < (int)(sizeof(size_t) * 8 - 1) && ((size_t)1 << shift) < value) {
+        shift++;
+    }
+    return shift;
+}
+
+static camera_metadata_t *pool_next(camera_metadata_t *metadata) {
+    camera_metadata_t *next;
+    memcpy(&next, get_data(metadata), sizeof(next));
+    return next;
+}
+
+static void pool_set_next(camera_metadata_t *metadata,
+                          camera_metadata_t *next) {
+    memcpy(get_data(metadata), &next, sizeof(next));
+}
+
+camera_metadata_pool_t *create_camera_metadata_pool(size_t max_free_buffers) {
+    camera_metadata_pool_t *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->max_free_buffers = max_free_buffers;
+    return pool;
+}
+
+void destroy_camera_metadata_pool(camera_metadata_pool_t *pool) {
+    if (pool == NULL) return;
+
+    for (size_t e = 0; e < POOL_ENTRY_CLASSES; e++) {
+        for (size_t d = 0; d < POOL_DATA_CLASSES; d++) {
+            camera_metadata_t *metadata = pool->free_buffers[e][d];
+            while (metadata != NULL) {
+                camera_metadata_t *next = pool_next(metadata);
+                free_camera_metadata(metadata);
+                metadata = next;
+            }
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+camera_metadata_t *allocate_pooled_camera_metadata(camera_metadata_pool_t *pool,
+        size_t entry_capacity,
+        size_t data_capacity) {
+    if (pool == NULL) {
+        return allocate_camera_metadata(entry_capacity, data_capacity);
+    }
+
+    int entry_shift = pool_shift(entry_capacity, POOL_MIN_ENTRY_SHIFT);
+    int data_shift = pool_shift(data_capacity, POOL_MIN_DATA_SHIFT);
+    if (entry_shift > POOL_MAX_ENTRY_SHIFT || data_shift > POOL_MAX_DATA_SHIFT) {
+        return allocate_camera_metadata(entry_capacity, data_capacity);
+    }
+    entry_capacity = (size_t)1 << entry_shift;
+    data_capacity = (size_t)1 << data_shift;
+
+    camera_metadata_t **list = &pool->free_buffers
+            [entry_shift - POOL_MIN_ENTRY_SHIFT][data_shift - POOL_MIN_DATA_SHIFT];
+    pthread_mutex_lock(&pool->lock);
+    camera_metadata_t *metadata = *list;
+    if (metadata != NULL) {
+        *list = pool_next(metadata);
+        pool->free_count[entry_shift - POOL_MIN_ENTRY_SHIFT]
+                        [data_shift - POOL_MIN_DATA_SHIFT]--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (metadata == NULL) {
+        return allocate_camera_metadata(entry_capacity, data_capacity);
+    }
+    return place_allocated_camera_metadata(metadata, entry_capacity,
+                                           data_capacity);
+}
+
+void free_pooled_camera_metadata(camera_metadata_pool_t *pool,
+        camera_metadata_t *metadata) {
+    if (metadata == NULL) return;
+    if (pool == NULL) {
+        free_camera_metadata(metadata);
+        return;
+    }
+
+    // only buffers of exactly the layout the pool allocates are kept
+    int entry_shift = pool_shift(metadata->entry_capacity, POOL_MIN_ENTRY_SHIFT);
+    int data_shift = pool_shift(metadata->data_capacity, POOL_MIN_DATA_SHIFT);
+    size_t index_start;
+    if (entry_shift > POOL_MAX_ENTRY_SHIFT || data_shift > POOL_MAX_DATA_SHIFT ||
+            metadata->entry_capacity != (size_t)1 << entry_shift ||
+            metadata->data_capacity != (size_t)1 << data_shift ||
+            metadata->size != calculate_allocation_size(metadata->entry_capacity,
+                                                        metadata->data_capacity,
+                                                        &index_start)) {
+        free_camera_metadata(metadata);
+        return;
+    }
+
+    size_t e = entry_shift - POOL_MIN_ENTRY_SHIFT;
+    size_t d = data_shift - POOL_MIN_DATA_SHIFT;
+    pthread_mutex_lock(&pool->lock);
+    int kept = pool->free_count[e][d] < pool->max_free_buffers;
+    if (kept) {
+        pool_set_next(metadata, pool->free_buffers[e][d]);
+        pool->free_buffers[e][d] = metadata;
+        pool->free_count[e][d]++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!kept) {
+        free_camera_metadata(metadata);
+    }
+}
+
 size_t calculate_camera_metadata_size(size_t entry_count,
                                       size_t data_count) {
     size_t memory_needed = sizeof(camera_metadata_t);
@@ -286,9 +570,10 @@ camera_metadata_t* copy_camera_metadata(void *dst, size_t dst_size,
     camera_metadata_t *metadata =
         place_camera_metadata(dst, dst_size, src->entry_count, src->data_count);
 
-    metadata->flags = src->flags;
+    metadata->flags = src->flags & ~FLAG_INDEXED;
     metadata->entry_count = src->entry_count;
     metadata->data_count = src->data_count;
+    metadata->tombstone_count = src->tombstone_count;
 
     memcpy(get_entries(metadata), get_entries(src),
             sizeof(camera_metadata_buffer_entry_t[metadata->entry_count]));
@@ -383,9 +668,32 @@ int validate_camera_metadata_structure(const camera_metadata_t *metadata,
         return ERROR;
     }
 
+    if (metadata->index_start != 0) {
+        const size_t index_end = metadata->index_start + get_index_size();
+        if (metadata->index_start < data_end ||
+            metadata->index_start % sizeof(metadata_index_t) != 0 ||
+            index_end > metadata->size) {
+
+            ALOGE("%s: Index start (%" PRIu32 ") should be aligned after the "
+                  "data end (%" PRIu32 "), and the index end (%zu) should be "
+                  "<= total size (%" PRIu32 ")",
+                  __FUNCTION__, metadata->index_start, data_end, index_end,
+                  metadata->size);
+            return ERROR;
+        }
+    }
+
+    if (metadata->tombstone_count > metadata->entry_count) {
+        ALOGE("%s: Tombstone count (%" PRIu32 ") should be <= entry count "
+              "(%" PRIu32 ")",
+              __FUNCTION__, metadata->tombstone_count, metadata->entry_count);
+        return ERROR;
+    }
+
     // Validate each entry
     const metadata_size_t entry_count = metadata->entry_count;
     camera_metadata_buffer_entry_t *entries = get_entries(metadata);
+    size_t tombstones = 0;
 
     for (size_t i = 0; i < entry_count; ++i) {
 
@@ -398,6 +706,17 @@ int validate_camera_metadata_structure(const camera_metadata_t *metadata,
 
         camera_metadata_buffer_entry_t entry = entries[i];
 
+        if (is_tombstone(&entry)) {
+            if (entry.count != 0 || entry.data.offset != 0) {
+                ALOGE("%s: Entry index %zu is a tombstone, but has %" PRIu32
+                      " items at offset %" PRIu32,
+                      __FUNCTION__, i, entry.count, entry.data.offset);
+                return ERROR;
+            }
+            tombstones++;
+            continue;
+        }
+
         if (entry.type >= NUM_TYPES) {
             ALOGE("%s: Entry index %zu had a bad type %d",
                   __FUNCTION__, i, entry.type);
@@ -452,6 +771,12 @@ int validate_camera_metadata_structure(const camera_metadata_t *metadata,
         } // else data stored inline, so we look at value which can be anything.
     }
 
+    if (tombstones != metadata->tombstone_count) {
+        ALOGE("%s: Found %zu tombstones, but the tombstone count is %" PRIu32,
+              __FUNCTION__, tombstones, metadata->tombstone_count);
+        return ERROR;
+    }
+
     return OK;
 }
 
@@ -475,6 +800,11 @@ int append_camera_metadata(camera_metadata_t *dst,
             }
         }
     }
+    if (dst->flags & FLAG_INDEXED) {
+        for (size_t i = 0; i < src->entry_count; i++) {
+            index_add_entry(dst, dst->entry_count + i);
+        }
+    }
     if (dst->entry_count == 0) {
         // Appending onto empty buffer, keep sorted state
         dst->flags |= src->flags & FLAG_SORTED;
@@ -486,6 +816,7 @@ int append_camera_metadata(camera_metadata_t *dst,
     }
     dst->entry_count += src->entry_count;
     dst->data_count += src->data_count;
+    dst->tombstone_count += src->tombstone_count;
 
     assert(validate_camera_metadata_structure(dst, NULL) == OK);
     return OK;
@@ -499,6 +830,9 @@ camera_metadata_t *clone_camera_metadata(const camera_metadata_t *src) {
         get_camera_metadata_data_count(src));
     if (clone != NULL) {
         res = append_camera_metadata(clone, src);
+        if (res == OK) {
+            res = compact_camera_metadata(clone);
+        }
         if (res != OK) {
             free_camera_metadata(clone);
             clone = NULL;
@@ -508,6 +842,20 @@ camera_metadata_t *clone_camera_metadata(const camera_metadata_t *src) {
     return clone;
 }
 
+camera_metadata_t *clone_pooled_camera_metadata(camera_metadata_pool_t *pool,
+        const camera_metadata_t *src) {
+    if (src == NULL) return NULL;
+    camera_metadata_t *clone = allocate_pooled_camera_metadata(pool,
+        get_camera_metadata_entry_count(src),
+        get_camera_metadata_data_count(src));
+    if (clone != NULL && (append_camera_metadata(clone, src) != OK ||
+            compact_camera_metadata(clone) != OK)) {
+        free_pooled_camera_metadata(pool, clone);
+        clone = NULL;
+    }
+    return clone;
+}
+
 size_t calculate_camera_metadata_entry_data_size(uint8_t type,
         size_t data_count) {
     if (type >= NUM_TYPES) return 0;
@@ -523,12 +871,18 @@ static int add_camera_metadata_entry_raw(camera_metadata_t *dst,
         size_t data_count) {
 
     if (dst == NULL) return ERROR;
-    if (dst->entry_count == dst->entry_capacity) return ERROR;
     if (data == NULL) return ERROR;
 
     size_t data_bytes =
             calculate_camera_metadata_entry_data_size(type, data_count);
-    if (data_bytes + dst->data_count > dst->data_capacity) return ERROR;
+    if (dst->entry_count == dst->entry_capacity ||
+            data_bytes + dst->data_count > dst->data_capacity) {
+        // erased entries may leave enough room once they are compacted
+        if (dst->tombstone_count == 0) return ERROR;
+        compact_camera_metadata(dst);
+        if (dst->entry_count == dst->entry_capacity) return ERROR;
+        if (data_bytes + dst->data_count > dst->data_capacity) return ERROR;
+    }
 
     size_t data_payload_bytes =
             data_count * camera_metadata_type_size[type];
@@ -547,6 +901,9 @@ static int add_camera_metadata_entry_raw(camera_metadata_t *dst,
                 data_payload_bytes);
         dst->data_count += data_bytes;
     }
+    if (dst->flags & FLAG_INDEXED) {
+        index_add_entry(dst, dst->entry_count);
+    }
     dst->entry_count++;
     dst->flags &= ~FLAG_SORTED;
     assert(validate_camera_metadata_structure(dst, NULL) == OK);
@@ -571,6 +928,24 @@ int add_camera_metadata_entry(camera_metadata_t *dst,
             data_count);
 }
 
+int add_camera_metadata_entry_of_type(camera_metadata_t *dst,
+        uint32_t tag,
+        uint8_t type,
+        const void *data,
+        size_t data_count) {
+
+    if (type >= NUM_TYPES) {
+        ALOGE("%s: Invalid type %d for tag %04x.", __FUNCTION__, type, tag);
+        return ERROR;
+    }
+
+    return add_camera_metadata_entry_raw(dst,
+            tag,
+            type,
+            data,
+            data_count);
+}
+
 static int compare_entry_tags(const void *p1, const void *p2) {
     uint32_t tag1 = ((camera_metadata_buffer_entry_t*)p1)->tag;
     uint32_t tag2 = ((camera_metadata_buffer_entry_t*)p2)->tag;
@@ -583,10 +958,12 @@ int sort_camera_metadata(camera_metadata_t *dst) {
     if (dst == NULL) return ERROR;
     if (dst->flags & FLAG_SORTED) return OK;
 
+    compact_camera_metadata(dst);
     qsort(get_entries(dst), dst->entry_count,
             sizeof(camera_metadata_buffer_entry_t),
             compare_entry_tags);
     dst->flags |= FLAG_SORTED;
+    build_index(dst);
 
     assert(validate_camera_metadata_structure(dst, NULL) == OK);
     return OK;
@@ -599,6 +976,7 @@ int get_camera_metadata_entry(camera_metadata_t *src,
     if (index >= src->entry_count) return ERROR;
 
     camera_metadata_buffer_entry_t *buffer_entry = get_entries(src) + index;
+    if (is_tombstone(buffer_entry)) return NOT_FOUND;
 
     entry->index = index;
     entry->tag = buffer_entry->tag;
@@ -625,6 +1003,18 @@ int find_camera_metadata_entry(camera_metadata_t *src,
         camera_metadata_entry_t *entry) {
     if (src == NULL) return ERROR;
 
+    int slot = (src->flags & FLAG_INDEXED) ? get_index_slot(tag) : -1;
+    if (slot >= 0) {
+        uint32_t index_plus_one = get_index(src)[slot];
+        if (index_plus_one == 0) return NOT_FOUND;
+        if (index_plus_one <= src->entry_count &&
+                get_entries(src)[index_plus_one - 1].tag == tag &&
+                !is_tombstone(&get_entries(src)[index_plus_one - 1])) {
+            return get_camera_metadata_entry(src, index_plus_one - 1, entry);
+        }
+        // an erased entry or an inconsistent index, search the entries instead
+    }
+
     uint32_t index;
     if (src->flags & FLAG_SORTED) {
         // Sorted entries, do a binary search
@@ -636,13 +1026,14 @@ int find_camera_metadata_entry(camera_metadata_t *src,
                 src->entry_count,
                 sizeof(camera_metadata_buffer_entry_t),
                 compare_entry_tags);
-        if (search_entry == NULL) return NOT_FOUND;
+        // a sorted packet has no other entry of the tag of a tombstone
+        if (search_entry == NULL || is_tombstone(search_entry)) return NOT_FOUND;
         index = search_entry - get_entries(src);
     } else {
         // Not sorted, linear search
         camera_metadata_buffer_entry_t *search_entry = get_entries(src);
         for (index = 0; index < src->entry_count; index++, search_entry++) {
-            if (search_entry->tag == tag) {
+            if (search_entry->tag == tag && !is_tombstone(search_entry)) {
                 break;
             }
         }
@@ -661,6 +1052,90 @@ int find_camera_metadata_ro_entry(const camera_metadata_t *src,
 }
 
 
+static int entries_equal(const camera_metadata_ro_entry_t *a,
+        const camera_metadata_ro_entry_t *b) {
+    return a->type == b->type && a->count == b->count &&
+            memcmp(a->data.u8, b->data.u8,
+                    a->count * camera_metadata_type_size[a->type]) == 0;
+}
+
+/**
+ * Reports a difference of the entries with the indices index_a of a and
+ * index_b of b, if any. An index of -1 stands for a missing entry.
+ */
+static int diff_entries(const camera_metadata_t *a, int index_a,
+        const camera_metadata_t *b, int index_b,
+        camera_metadata_diff_callback_t callback, void *user) {
+    camera_metadata_ro_entry_t entry_a, entry_b;
+    if (index_a >= 0) get_camera_metadata_ro_entry(a, index_a, &entry_a);
+    if (index_b >= 0) get_camera_metadata_ro_entry(b, index_b, &entry_b);
+
+    int change;
+    if (index_a < 0) {
+        change = CAMERA_METADATA_ENTRY_ADDED;
+    } else if (index_b < 0) {
+        change = CAMERA_METADATA_ENTRY_REMOVED;
+    } else if (!entries_equal(&entry_a, &entry_b)) {
+        change = CAMERA_METADATA_ENTRY_CHANGED;
+    } else {
+        return 0;
+    }
+    if (callback != NULL) {
+        callback(user, change, index_a >= 0 ? &entry_a : NULL,
+                index_b >= 0 ? &entry_b : NULL);
+    }
+    return 1;
+}
+
+int diff_camera_metadata(const camera_metadata_t *a,
+        const camera_metadata_t *b,
+        camera_metadata_diff_callback_t callback,
+        void *user) {
+    if (a == NULL || b == NULL) return -EINVAL;
+
+    int diffs = 0;
+    const camera_metadata_buffer_entry_t *entries_a = get_entries(a);
+    const camera_metadata_buffer_entry_t *entries_b = get_entries(b);
+    size_t i = 0, j = 0;
+
+    if ((a->flags & FLAG_SORTED) && (b->flags & FLAG_SORTED)) {
+        while (i < a->entry_count || j < b->entry_count) {
+            if (i < a->entry_count && is_tombstone(&entries_a[i])) {
+                i++;
+            } else if (j < b->entry_count && is_tombstone(&entries_b[j])) {
+                j++;
+            } else if (j == b->entry_count || (i < a->entry_count &&
+                    entries_a[i].tag < entries_b[j].tag)) {
+                diffs += diff_entries(a, i++, b, -1, callback, user);
+            } else if (i == a->entry_count ||
+                    entries_b[j].tag < entries_a[i].tag) {
+                diffs += diff_entries(a, -1, b, j++, callback, user);
+            } else {
+                diffs += diff_entries(a, i++, b, j++, callback, user);
+            }
+        }
+        return diffs;
+    }
+
+    // Not both sorted, look up the entries of each buffer in the other one
+    camera_metadata_ro_entry_t entry;
+    for (i = 0; i < a->entry_count; i++) {
+        if (is_tombstone(&entries_a[i])) continue;
+        int index_b = -1;
+        if (find_camera_metadata_ro_entry(b, entries_a[i].tag, &entry) == OK) {
+            index_b = entry.index;
+        }
+        diffs += diff_entries(a, i, b, index_b, callback, user);
+    }
+    for (j = 0; j < b->entry_count; j++) {
+        if (is_tombstone(&entries_b[j])) continue;
+        if (find_camera_metadata_ro_entry(a, entries_b[j].tag, &entry) != OK) {
+            diffs += diff_entries(a, -1, b, j, callback, user);
+        }
+    }
+    return diffs;
+}
+
 int delete_camera_metadata_entry(camera_metadata_t *dst,
         size_t index) {
     if (dst == NULL) return ERROR;
@@ -669,6 +1144,9 @@ int delete_camera_metadata_entry(camera_metadata_t *dst,
     camera_metadata_buffer_entry_t *entry = get_entries(dst) + index;
     size_t data_bytes = calculate_camera_metadata_entry_data_size(entry->type,
             entry->count);
+    if (is_tombstone(entry)) {
+        dst->tombstone_count--;
+    }
 
     if (data_bytes > 0) {
         // Shift data buffer to overwrite deleted data
@@ -695,11 +1173,83 @@ int delete_camera_metadata_entry(camera_metadata_t *dst,
             sizeof(camera_metadata_buffer_entry_t) *
             (dst->entry_count - index - 1) );
     dst->entry_count -= 1;
+    build_index(dst);
+
+    assert(validate_camera_metadata_structure(dst, NULL) == OK);
+    return OK;
+}
+
+int erase_camera_metadata_entry(camera_metadata_t *dst,
+        size_t index) {
+    if (dst == NULL) return ERROR;
+    if (index >= dst->entry_count) return ERROR;
+
+    camera_metadata_buffer_entry_t *entry = get_entries(dst) + index;
+    if (is_tombstone(entry)) return ERROR;
+
+    // the tag stays, so that sorted entries remain sorted
+    entry->type = TYPE_TOMBSTONE;
+    entry->count = 0;
+    entry->data.offset = 0;
+    dst->tombstone_count++;
+
+    // compacting once tombstones outnumber the live entries keeps the cost
+    // of erasing constant on average
+    if (dst->tombstone_count * 2 > dst->entry_count) {
+        compact_camera_metadata(dst);
+    }
+
+    assert(validate_camera_metadata_structure(dst, NULL) == OK);
+    return OK;
+}
+
+int compact_camera_metadata(camera_metadata_t *dst) {
+    if (dst == NULL) return ERROR;
+    if (dst->tombstone_count == 0) return OK;
+
+    // the live data is gathered in a scratch buffer, since the data of
+    // sorted entries is not in the order of the entries
+    uint8_t *data = get_data(dst);
+    uint8_t *scratch = NULL;
+    if (dst->data_count > 0) {
+        scratch = malloc(dst->data_count);
+        if (scratch == NULL) return ERROR;
+    }
+
+    camera_metadata_buffer_entry_t *entries = get_entries(dst);
+    size_t live = 0;
+    size_t data_count = 0;
+    for (size_t i = 0; i < dst->entry_count; i++) {
+        if (is_tombstone(&entries[i])) continue;
+
+        camera_metadata_buffer_entry_t *entry = &entries[live++];
+        *entry = entries[i];
+        size_t data_bytes = calculate_camera_metadata_entry_data_size(
+                entry->type, entry->count);
+        if (data_bytes > 0) {
+            memcpy(scratch + data_count, data + entry->data.offset, data_bytes);
+            entry->data.offset = data_count;
+            data_count += data_bytes;
+        }
+    }
+    if (data_count > 0) {
+        memcpy(data, scratch, data_count);
+    }
+    free(scratch);
+
+    dst->entry_count = live;
+    dst->data_count = data_count;
+    dst->tombstone_count = 0;
+    build_index(dst);
 
     assert(validate_camera_metadata_structure(dst, NULL) == OK);
     return OK;
 }
 
+size_t get_camera_metadata_tombstone_count(const camera_metadata_t *metadata) {
+    return metadata->tombstone_count;
+}
+
 int update_camera_metadata_entry(camera_metadata_t *dst,
         size_t index,
         const void *data,
@@ -709,6 +1259,7 @@ int update_camera_metadata_entry(camera_metadata_t *dst,
     if (index >= dst->entry_count) return ERROR;
 
     camera_metadata_buffer_entry_t *entry = get_entries(dst) + index;
+    if (is_tombstone(entry)) return ERROR;
 
     size_t data_bytes =
             calculate_camera_metadata_entry_data_size(entry->type,
@@ -821,6 +1372,242 @@ int get_camera_metadata_tag_type(uint32_t tag) {
     return tag_info[tag_section][tag_index].tag_type;
 }
 
+/**
+ * Perfect hashes from the full names of tags, "<section name>.<tag name>", to
+ * the tags: one of the android tags, built from the tag info tables when the
+ * library is loaded, and one of the vendor tags, built from the vendor tag
+ * ops when they are set.
+ *
+ * A name is hashed once. Its bucket holds the displacement which puts the
+ * tags of the bucket into distinct slots, and its slot holds the only tag the
+ * name can be, which is then compared with the name. Buckets are placed
+ * biggest first, and there are 5 slots per 4 tags, so that small
+ * displacements are found quickly.
+ */
+typedef struct tag_name_hash {
+    uint32_t  bucket_count;
+    uint32_t  slot_count;
+    uint16_t *displacements;    // per bucket
+    uint32_t *slot_tags;        // per slot
+    uint8_t  *slot_used;        // per slot
+} tag_name_hash_t;
+
+#define TAG_NAME_HASH_MAX_DISPLACEMENT 0xFFFF
+#define TAG_NAME_HASH_BASIS 0xcbf29ce484222325ULL
+
+static tag_name_hash_t android_tag_names;
+static tag_name_hash_t vendor_tag_names;
+
+static uint64_t hash_tag_name(uint64_t hash, const char *name) {
+    for (; *name != '\0'; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_full_tag_name(uint32_t tag) {
+    uint64_t hash = hash_tag_name(TAG_NAME_HASH_BASIS,
+            get_camera_metadata_section_name(tag));
+    hash = hash_tag_name(hash, ".");
+    return hash_tag_name(hash, get_camera_metadata_tag_name(tag));
+}
+
+static int full_tag_name_equals(uint32_t tag, const char *name) {
+    const char *section_name = get_camera_metadata_section_name(tag);
+    const char *tag_name = get_camera_metadata_tag_name(tag);
+    if (section_name == NULL || tag_name == NULL) return 0;
+
+    size_t section_length = strlen(section_name);
+    return strncmp(name, section_name, section_length) == 0 &&
+            name[section_length] == '.' &&
+            strcmp(name + section_length + 1, tag_name) == 0;
+}
+
+static uint32_t get_tag_name_slot(const tag_name_hash_t *hash,
+        uint64_t name_hash, uint32_t displacement) {
+    uint64_t mixed = name_hash ^ (displacement * 0x9e3779b97f4a7c15ULL);
+    mixed ^= mixed >> 33;
+    mixed *= 0xff51afd7ed558ccdULL;
+    mixed ^= mixed >> 33;
+    return (uint32_t)(mixed % hash->slot_count);
+}
+
+static void free_tag_name_hash(tag_name_hash_t *hash) {
+    free(hash->displacements);
+    free(hash->slot_tags);
+    free(hash->slot_used);
+    memset(hash, 0, sizeof(*hash));
+}
+
+/**
+ * Build the hash of tags, whose names must be known. Tags with the name of
+ * an earlier tag are left out.
+ */
+static int build_tag_name_hash(tag_name_hash_t *hash, const uint32_t *tags,
+        size_t tag_count) {
+    free_tag_name_hash(hash);
+    if (tag_count == 0) return OK;
+
+    hash->bucket_count = tag_count / 2 + 1;
+    hash->slot_count = tag_count + tag_count / 4 + 1;
+    hash->displacements = calloc(hash->bucket_count, sizeof(uint16_t));
+    hash->slot_tags = calloc(hash->slot_count, sizeof(uint32_t));
+    hash->slot_used = calloc(hash->slot_count, sizeof(uint8_t));
+    uint64_t *name_hashes = calloc(tag_count, sizeof(uint64_t));
+    uint32_t *bucket_starts = calloc(hash->bucket_count + 1, sizeof(uint32_t));
+    uint32_t *bucket_sizes = calloc(hash->bucket_count, sizeof(uint32_t));
+    uint32_t *bucket_tags = calloc(tag_count, sizeof(uint32_t));
+    uint32_t *slots = calloc(tag_count, sizeof(uint32_t));
+    int res = OK;
+    if (hash->displacements == NULL || hash->slot_tags == NULL ||
+            hash->slot_used == NULL || name_hashes == NULL ||
+            bucket_starts == NULL || bucket_sizes == NULL ||
+            bucket_tags == NULL || slots == NULL) {
+        res = ERROR;
+        goto done;
+    }
+
+    // group the tags by bucket, without the duplicate names
+    uint32_t max_bucket_size = 0;
+    for (size_t i = 0; i < tag_count; i++) {
+        name_hashes[i] = hash_full_tag_name(tags[i]);
+        bucket_starts[name_hashes[i] % hash->bucket_count + 1]++;
+    }
+    for (size_t b = 0; b < hash->bucket_count; b++) {
+        bucket_starts[b + 1] += bucket_starts[b];
+    }
+    for (size_t i = 0; i < tag_count; i++) {
+        uint32_t b = name_hashes[i] % hash->bucket_count;
+        int duplicate = 0;
+        for (size_t j = 0; j < bucket_sizes[b]; j++) {
+            uint32_t other = bucket_tags[bucket_starts[b] + j];
+            duplicate |= name_hashes[other] == name_hashes[i];
+        }
+        if (duplicate) {
+            ALOGW("%s: Tag %#x has the name of another tag, leaving it out",
+                    __FUNCTION__, tags[i]);
+            continue;
+        }
+        bucket_tags[bucket_starts[b] + bucket_sizes[b]++] = i;
+        if (bucket_sizes[b] > max_bucket_size) {
+            max_bucket_size = bucket_sizes[b];
+        }
+    }
+
+    // find the displacement of each bucket, biggest buckets first
+    for (uint32_t size = max_bucket_size; size > 0; size--) {
+        for (size_t b = 0; b < hash->bucket_count; b++) {
+            if (bucket_sizes[b] != size) continue;
+
+            const uint32_t *bucket = bucket_tags + bucket_starts[b];
+            uint32_t d;
+            for (d = 0; d <= TAG_NAME_HASH_MAX_DISPLACEMENT; d++) {
+                size_t placed;
+                for (placed = 0; placed < size; placed++) {
+                    slots[placed] = get_tag_name_slot(hash,
+                            name_hashes[bucket[placed]], d);
+                    int taken = hash->slot_used[slots[placed]];
+                    for (size_t j = 0; j < placed; j++) {
+                        taken |= slots[j] == slots[placed];
+                    }
+                    if (taken) break;
+                }
+                if (placed == size) break;
+            }
+            if (d > TAG_NAME_HASH_MAX_DISPLACEMENT) {
+                ALOGE("%s: No displacement for a bucket of %" PRIu32 " tags",
+                        __FUNCTION__, size);
+                res = ERROR;
+                goto done;
+            }
+            hash->displacements[b] = d;
+            for (size_t j = 0; j < size; j++) {
+                hash->slot_tags[slots[j]] = tags[bucket[j]];
+                hash->slot_used[slots[j]] = 1;
+            }
+        }
+    }
+
+done:
+    free(name_hashes);
+    free(bucket_starts);
+    free(bucket_sizes);
+    free(bucket_tags);
+    free(slots);
+    if (res != OK) {
+        free_tag_name_hash(hash);
+    }
+    return res;
+}
+
+static int find_tag_in_hash(const tag_name_hash_t *hash, const char *name,
+        uint64_t name_hash, uint32_t *tag) {
+    if (hash->slot_count == 0) return NOT_FOUND;
+
+    uint32_t slot = get_tag_name_slot(hash, name_hash,
+            hash->displacements[name_hash % hash->bucket_count]);
+    if (!hash->slot_used[slot] ||
+            !full_tag_name_equals(hash->slot_tags[slot], name)) {
+        return NOT_FOUND;
+    }
+    *tag = hash->slot_tags[slot];
+    return OK;
+}
+
+__attribute__((constructor))
+static void init_android_tag_names() {
+    size_t tag_count = 0;
+    for (size_t i = 0; i < ANDROID_SECTION_COUNT; i++) {
+        tag_count += camera_metadata_section_bounds[i][1] -
+                camera_metadata_section_bounds[i][0];
+    }
+    uint32_t *tags = calloc(tag_count, sizeof(uint32_t));
+    if (tags == NULL) return;
+
+    tag_count = 0;
+    for (size_t i = 0; i < ANDROID_SECTION_COUNT; i++) {
+        for (uint32_t tag = camera_metadata_section_bounds[i][0];
+                tag < camera_metadata_section_bounds[i][1]; tag++) {
+            tags[tag_count++] = tag;
+        }
+    }
+    build_tag_name_hash(&android_tag_names, tags, tag_count);
+    free(tags);
+}
+
+static void init_vendor_tag_names() {
+    free_tag_name_hash(&vendor_tag_names);
+    if (vendor_tag_ops == NULL) return;
+
+    int count = vendor_tag_ops->get_tag_count(vendor_tag_ops);
+    if (count <= 0) return;
+    uint32_t *tags = calloc(count, sizeof(uint32_t));
+    if (tags == NULL) return;
+    vendor_tag_ops->get_all_tags(vendor_tag_ops, tags);
+
+    // only the tags with names can be found
+    size_t tag_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (get_camera_metadata_section_name(tags[i]) != NULL &&
+                get_camera_metadata_tag_name(tags[i]) != NULL) {
+            tags[tag_count++] = tags[i];
+        }
+    }
+    build_tag_name_hash(&vendor_tag_names, tags, tag_count);
+    free(tags);
+}
+
+int find_camera_metadata_tag(const char *name, uint32_t *tag) {
+    if (name == NULL || tag == NULL) return ERROR;
+
+    uint64_t name_hash = hash_tag_name(TAG_NAME_HASH_BASIS, name);
+    if (find_tag_in_hash(&android_tag_names, name, name_hash, tag) == OK) {
+        return OK;
+    }
+    return find_tag_in_hash(&vendor_tag_names, name, name_hash, tag);
+}
+
 int set_camera_metadata_vendor_tag_ops(const vendor_tag_query_ops_t* ops) {
     // **DEPRECATED**
     ALOGE("%s: This function has been deprecated", __FUNCTION__);
@@ -830,6 +1617,7 @@ int set_camera_metadata_vendor_tag_ops(const vendor_tag_query_ops_t* ops) {
 // Declared in system/media/private/camera/include/camera_metadata_hidden.h
 int set_camera_metadata_vendor_ops(const vendor_tag_ops_t* ops) {
     vendor_tag_ops = ops;
+    init_vendor_tag_names();
     return OK;
 }
 
@@ -863,6 +1651,7 @@ void dump_indented_camera_metadata(const camera_metadata_t *metadata,
             metadata->version, metadata->flags);
     camera_metadata_buffer_entry_t *entry = get_entries(metadata);
     for (i=0; i < metadata->entry_count; i++, entry++) {
+        if (is_tombstone(entry)) continue;
 
         const char *tag_name, *tag_section;
         tag_section = get_camera_metadata_section_name(entry->tag);
@@ -17,6 +17,11 @@
 /*
  * Implementation of the user-space ashmem API for the simulator, which lacks
  * an ashmem-enabled kernel. See ashmem-dev.c for the real ashmem-based version.
+ *
+ * Regions are memfds where the kernel has them, so that they never touch a
+ * filesystem, and unlinked temporary files otherwise. Setting
+ * ANDROID_ASHMEM_HUGETLB=1 in the environment backs regions of at least one
+ * huge page with 2 MB pages, when the kernel has huge pages reserved for it.
  */
 
 #include <errno.h>
@@ -26,7 +31,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -38,7 +45,101 @@
 #define __unused __attribute__((__unused__))
 #endif
 
-int ashmem_create_region(const char *ignored __unused, size_t size)
+/* not in older libc headers */
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+#ifndef MFD_HUGE_2MB
+#define MFD_HUGE_2MB (21U << 26)
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* the seals memfd_create_region puts on a region, besides F_SEAL_WRITE */
+#define REGION_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+
+/* cleared once the kernel turns out not to have memfd_create */
+static bool memfd_supported = true;
+
+static int memfd_create_region(const char *name, size_t size, unsigned int flags)
+{
+#ifdef __NR_memfd_create
+    int fd = syscall(__NR_memfd_create, name, flags);
+    if (fd == -1) {
+        if (errno == ENOSYS)
+            memfd_supported = false;
+        return -1;
+    }
+
+    if (TEMP_FAILURE_RETRY(ftruncate(fd, size)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (flags & MFD_HUGETLB) {
+        /*
+         * huge pages are reserved at mmap time, so fail here rather than in
+         * the first user of the region when the pool is exhausted. A shared
+         * reservation stays with the file after the munmap.
+         */
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        munmap(addr, size);
+    }
+
+    /*
+     * the size of a region is fixed, so importers can map it without the
+     * risk of SIGBUS. Writes can still be sealed by ashmem_set_prot_region.
+     */
+    if (flags & MFD_ALLOW_SEALING)
+        fcntl(fd, F_ADD_SEALS, REGION_SEALS);
+
+    return fd;
+#else
+    (void)name;
+    (void)size;
+    (void)flags;
+    memfd_supported = false;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * whether fd is a sealed region of memfd_create_region. Any shmem file
+ * answers F_GET_SEALS, so the seals themselves tell our regions apart.
+ */
+static bool is_sealed_region(int fd)
+{
+    int seals = fcntl(fd, F_GET_SEALS);
+    return seals != -1 && (seals & ~F_SEAL_WRITE) == REGION_SEALS;
+}
+
+static bool use_hugetlb(size_t size)
+{
+    static int enabled = -1;
+    if (enabled < 0) {
+        const char *env = getenv("ANDROID_ASHMEM_HUGETLB");
+        enabled = env != NULL && atoi(env) != 0;
+    }
+    return enabled && size >= HUGE_PAGE_SIZE;
+}
+
+static int tmpfile_create_region(size_t size)
 {
     char template[PATH_MAX];
     snprintf(template, sizeof(template), "/tmp/android-ashmem-%d-XXXXXXXXX", getpid());
@@ -50,8 +151,36 @@ int ashmem_create_region(const char *ignored __unused, size_t size)
     return -1;
 }
 
-int ashmem_set_prot_region(int fd __unused, int prot __unused)
+int ashmem_create_region(const char *name, size_t size)
+{
+    if (name == NULL)
+        name = "ashmem";
+
+    if (memfd_supported && use_hugetlb(size)) {
+        /* sealing of hugetlb memfds needs linux 4.16, try without too */
+        size_t hugeSize = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+        int fd = memfd_create_region(name, hugeSize,
+                                     MFD_HUGETLB | MFD_HUGE_2MB | MFD_ALLOW_SEALING);
+        if (fd == -1 && memfd_supported)
+            fd = memfd_create_region(name, hugeSize, MFD_HUGETLB | MFD_HUGE_2MB);
+        if (fd != -1)
+            return fd;
+    }
+
+    if (memfd_supported) {
+        int fd = memfd_create_region(name, size, MFD_ALLOW_SEALING);
+        if (fd != -1)
+            return fd;
+    }
+
+    return tmpfile_create_region(size);
+}
+
+int ashmem_set_prot_region(int fd, int prot)
 {
+    /* only sealed regions can enforce this, and only if nobody has it mapped writable */
+    if (!(prot & PROT_WRITE) && is_sealed_region(fd))
+        return fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE) == -1 ? -1 : 0;
     return 0;
 }
 
@@ -73,8 +202,13 @@ int ashmem_get_size_region(int fd)
         return -1;
     }
 
-    // Check if this is an "ashmem" region.
-    // TODO: This is very hacky, and can easily break. We need some reliable indicator.
+    if (is_sealed_region(fd))
+        return buf.st_size;
+
+    // the unsealed regions are unlinked temporary files, and hugetlb memfds
+    // where the kernel cannot seal them (before linux 4.16). Both have no
+    // links, which is the best we can check: other unlinked files and
+    // memfds pass too.
     if (!(buf.st_nlink == 0 && S_ISREG(buf.st_mode))) {
         errno = ENOTTY;
         return -1;
@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <framecopy/framecopy.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FRAMECOPY_X86
+#include <immintrin.h>
+#endif
+
+// copies of at least this size would evict the caches, so they are streamed
+static const size_t STREAM_THRESHOLD = 1024 * 1024;
+// each thread copies at least this much, so that handing a stripe to
+// another thread costs a few percent of the copy at most
+static const size_t MIN_STRIPE_SIZE = 4 * 1024 * 1024;
+// more threads do not get more out of the memory bus
+static const size_t MAX_THREADS = 4;
+
+enum {
+    COPY_C,
+    COPY_SSE2,
+    COPY_AVX2,
+};
+
+static int copy_level()
+{
+    static const int level = [] {
+#ifdef FRAMECOPY_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return COPY_AVX2;
+        if (__builtin_cpu_supports("sse2"))
+            return COPY_SSE2;
+#endif
+        return COPY_C;
+    }();
+    return level;
+}
+
+static size_t max_threads()
+{
+    static const size_t threads = [] {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        return std::min(MAX_THREADS, cpus > 0 ? (size_t)cpus : (size_t)1);
+    }();
+    return threads;
+}
+
+#ifdef FRAMECOPY_X86
+/*
+ * The destination is aligned with a short memcpy first, the streaming
+ * stores need aligned addresses. The caller fences once all rows are done.
+ */
+__attribute__((target("sse2")))
+static void stream_row_sse2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    size_t head = std::min(size, (size_t)(-(uintptr_t)dst & 15));
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)(dst), a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    memcpy(dst, src, size);
+}
+
+__attribute__((target("avx2")))
+static void stream_row_avx2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    size_t head = std::min(size, (size_t)(-(uintptr_t)dst & 31));
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 128; size -= 128, dst += 128, src += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(src + 96));
+        _mm256_stream_si256((__m256i *)(dst), a);
+        _mm256_stream_si256((__m256i *)(dst + 32), b);
+        _mm256_stream_si256((__m256i *)(dst + 64), c);
+        _mm256_stream_si256((__m256i *)(dst + 96), d);
+    }
+    memcpy(dst, src, size);
+}
+#endif // FRAMECOPY_X86
+
+/* copies a stripe of rows, streaming them if stream is set */
+static void copy_rows(uint8_t *dst, size_t dstStride,
+                      const uint8_t *src, size_t srcStride,
+                      size_t width, size_t height, bool stream)
+{
+#ifdef FRAMECOPY_X86
+    int level = stream ? copy_level() : COPY_C;
+    if (level != COPY_C) {
+        for (size_t y = 0; y < height; y++) {
+            if (level == COPY_AVX2)
+                stream_row_avx2(dst + y * dstStride, src + y * srcStride, width);
+            else
+                stream_row_sse2(dst + y * dstStride, src + y * srcStride, width);
+        }
+        // the streaming stores are weakly ordered
+        _mm_sfence();
+        return;
+    }
+#else
+    (void)stream;
+#endif
+    for (size_t y = 0; y < height; y++)
+        memcpy(dst + y * dstStride, src + y * srcStride, width);
+}
+
+/*
+ * The threads which copy the stripes of all copies besides the calling
+ * threads. They are started with the first copy of more than one stripe,
+ * and live as long as the process.
+ */
+class StripeWorkers {
+public:
+    static StripeWorkers &get()
+    {
+        // never destroyed, the threads may still wait at exit
+        static StripeWorkers *workers = new StripeWorkers(max_threads() - 1);
+        return *workers;
+    }
+
+    /* runs job(0) .. job(count - 1), all but the first on the workers */
+    void run(size_t count, const std::function<void(size_t)> &job)
+    {
+        Batch batch = { &job, count - 1 };
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            for (size_t i = 1; i < count; i++)
+                mStripes.push_back(Stripe{ &batch, i });
+        }
+        mWork.notify_all();
+
+        job(0);
+
+        std::unique_lock<std::mutex> lock(mLock);
+        mDone.wait(lock, [&] { return batch.pending == 0; });
+    }
+
+private:
+    struct Batch {
+        const std::function<void(size_t)> *job;
+        size_t pending;     // stripes not copied yet
+    };
+    struct Stripe {
+        Batch *batch;
+        size_t index;
+    };
+
+    explicit StripeWorkers(size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+            std::thread(&StripeWorkers::loop, this).detach();
+    }
+
+    void loop()
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        for (;;) {
+            mWork.wait(lock, [this] { return !mStripes.empty(); });
+            Stripe stripe = mStripes.front();
+            mStripes.pop_front();
+
+            lock.unlock();
+            (*stripe.batch->job)(stripe.index);
+            lock.lock();
+
+            if (--stripe.batch->pending == 0)
+                mDone.notify_all();
+        }
+    }
+
+    std::mutex mLock;
+    std::condition_variable mWork;
+    std::condition_variable mDone;
+    std::deque<Stripe> mStripes;
+};
+
+/* runs job(0) .. job(count - 1), all but the first on the stripe workers */
+static void run_stripes(size_t count, const std::function<void(size_t)> &job)
+{
+    if (count == 1) {
+        job(0);
+        return;
+    }
+    StripeWorkers::get().run(count, job);
+}
+
+static size_t stripe_count(size_t size)
+{
+    return std::max((size_t)1, std::min(max_threads(), size / MIN_STRIPE_SIZE));
+}
+
+void frame_copy(void *dst, const void *src, size_t size)
+{
+    if (size < STREAM_THRESHOLD) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    uint8_t *d = static_cast<uint8_t *>(dst);
+    const uint8_t *s = static_cast<const uint8_t *>(src);
+    size_t stripes = stripe_count(size);
+    // whole pages per stripe, the last one takes the rest
+    size_t stripeSize = (size / stripes) & ~(size_t)4095;
+    run_stripes(stripes, [=](size_t i) {
+        size_t offset = i * stripeSize;
+        size_t length = i == stripes - 1 ? size - offset : stripeSize;
+        copy_rows(d + offset, 0, s + offset, 0, length, 1, true);
+    });
+}
+
+void frame_copy_2d(void *dst, size_t dstStride,
+                   const void *src, size_t srcStride,
+                   size_t width, size_t height)
+{
+    if (dstStride == width && srcStride == width) {
+        frame_copy(dst, src, width * height);
+        return;
+    }
+
+    uint8_t *d = static_cast<uint8_t *>(dst);
+    const uint8_t *s = static_cast<const uint8_t *>(src);
+    size_t size = width * height;
+    bool stream = size >= STREAM_THRESHOLD;
+    size_t stripes = stream ? std::min(stripe_count(size), height) : 1;
+    size_t stripeHeight = (height + stripes - 1) / stripes;
+    stripes = (height + stripeHeight - 1) / stripeHeight;
+    run_stripes(stripes, [=](size_t i) {
+        size_t first = i * stripeHeight;
+        size_t rows = std::min(stripeHeight, height - first);
+        copy_rows(d + first * dstStride, dstStride,
+                  s + first * srcStride, srcStride, width, rows, stream);
+    });
+}
@@ -12,6 +12,9 @@
  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
  * See the License for the specific language governing permissions and
  * limitations under the License.
+ *
+ * Modified by Intel Corporation.
+ * - posted buffers are copied with frame_copy_2d
  */
 
 #include <sys/mman.h>
@@ -33,6 +36,8 @@
 #include <cutils/log.h>
 #include <cutils/atomic.h>
 
+#include <framecopy/framecopy.h>
+
 #if HAVE_ANDROID_OS
 #include <linux/fb.h>
 #endif
@@ -112,8 +117,9 @@ static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
         m->currentBuffer = buffer;
         
     } else {
-        // If we can't do the page_flip, just copy the buffer to the front 
-        // FIXME: use copybit HAL instead of memcpy
+        // If we can't do the page_flip, just copy the buffer to the front.
+        // The buffer rows may be padded differently from the framebuffer
+        // lines, and the copy bypasses the caches.
         
         void* fb_vaddr;
         void* buffer_vaddr;
@@ -128,7 +134,11 @@ static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
                 0, 0, m->info.xres, m->info.yres,
                 &buffer_vaddr);
 
-        memcpy(fb_vaddr, buffer_vaddr, m->finfo.line_length * m->info.yres);
+        const size_t bytesPerPixel = m->info.bits_per_pixel >> 3;
+        frame_copy_2d(fb_vaddr, m->finfo.line_length,
+                buffer_vaddr, hnd->stride ? hnd->stride * bytesPerPixel :
+                        m->finfo.line_length,
+                m->info.xres * bytesPerPixel, m->info.yres);
         
         m->base.unlock(&m->base, buffer); 
         m->base.unlock(&m->base, m->framebuffer); 
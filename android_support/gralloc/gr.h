@@ -39,6 +39,11 @@ inline size_t roundUpToPageSize(size_t x) {
 int mapFrameBufferLocked(struct private_module_t* module);
 int terminateBuffer(gralloc_module_t const* module, private_handle_t* hnd);
 int mapBuffer(gralloc_module_t const* module, private_handle_t* hnd);
+size_t getPinnedSize();
+
+private_handle_t* alloc_handle(int fd, int size, int flags);
+int free_handle(private_handle_t* hnd);
+void reserve_handles(size_t count);
 
 /*****************************************************************************/
 
@@ -20,6 +20,11 @@
  * - added a manual load function
  * - added setting private handle integers
  * - added gralloc_perform for mapping and unmapping existing fds
+ * - added a pool recycling freed buffers
+ * - added a query for the pinned memory size
+ * - added lock_ycbcr and a configurable row alignment
+ * - added ashmem, memfd and dma-heap allocation backends
+ * - allocated handles from the handle slab
  */
 
 #define LOG_TAG "gralloc"
@@ -28,18 +33,32 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 
+#ifdef HAVE_LINUX_DMA_HEAP_H
+#include <linux/dma-heap.h>
+#endif
+#include <linux/memfd.h>
+#ifdef HAVE_LINUX_UDMABUF_H
+#include <linux/udmabuf.h>
+#endif
+
 #include <cutils/ashmem.h>
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 
 #include <hardware/hardware.h>
 #include <hardware/gralloc.h>
@@ -47,6 +66,8 @@
 #include "gralloc_priv.h"
 #include "gr.h"
 
+#include <vector>
+
 /*****************************************************************************/
 
 struct gralloc_context_t {
@@ -73,6 +94,11 @@ extern int gralloc_lock(gralloc_module_t const* module,
 extern int gralloc_unlock(gralloc_module_t const* module, 
         buffer_handle_t handle);
 
+extern int gralloc_lock_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr *ycbcr);
+
 extern int gralloc_register_buffer(gralloc_module_t const* module,
         buffer_handle_t handle);
 
@@ -92,8 +118,8 @@ struct private_module_t GRALLOC_HAL_MODULE_INFO_SYM = {
     .base = {
         .common = {
             .tag = HARDWARE_MODULE_TAG,
-            .version_major = 1,
-            .version_minor = 0,
+            .module_api_version = GRALLOC_MODULE_API_VERSION_0_2,
+            .hal_api_version = 0,
             .id = GRALLOC_HARDWARE_MODULE_ID,
             .name = "Graphics Memory Allocator Module",
             .author = "The Android Open Source Project",
@@ -104,6 +130,7 @@ struct private_module_t GRALLOC_HAL_MODULE_INFO_SYM = {
         .lock = gralloc_lock,
         .unlock = gralloc_unlock,
         .perform = gralloc_perform,
+        .lock_ycbcr = gralloc_lock_ycbcr,
     },
     .framebuffer = 0,
     .flags = 0,
@@ -124,6 +151,287 @@ hw_module_t* load_fake_gralloc() {
 
 /*****************************************************************************/
 
+/*
+ * Rows of allocated buffers start at multiples of gralloc.stride.align
+ * bytes (a power of two, 64 by default), so that row-wise SIMD kernels and
+ * DMA engines can use aligned accesses. Mapped buffers start on a page.
+ */
+static size_t stride_align()
+{
+    static const size_t align = [] {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("gralloc.stride.align", value, "64");
+        long align = atol(value);
+        if (align <= 0 || align > 4096 || (align & (align - 1))) {
+            ALOGW("invalid gralloc.stride.align %s, using 64", value);
+            align = 64;
+        }
+        return (size_t)align;
+    }();
+    return align;
+}
+
+/*
+ * Buffer memory comes from one of these backends, chosen with the
+ * gralloc.backend property or the GRALLOC_SET_BACKEND perform operation:
+ *   ashmem   ashmem regions, which are memfds on linux hosts (default)
+ *   memfd    plain memfds with a sealed size
+ *   dmaheap  dma-bufs from /dev/dma_heap/system, or memfds wrapped into
+ *            dma-bufs by /dev/udmabuf, which V4L2 devices and other
+ *            importers take without a bounce copy. Falls back to memfd
+ *            where neither device, or neither kernel header at build
+ *            time, is available.
+ * alloc returns an fd of at least *size bytes and stores its real size
+ * in *size, or returns -errno.
+ */
+struct alloc_backend_t {
+    const char* name;
+    int (*alloc)(size_t* size);
+};
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+static int sDmaHeapFd = -1;
+static int sUdmabufFd = -1;
+
+static int ashmem_backend_alloc(size_t* size)
+{
+    int fd = ashmem_create_region("gralloc-buffer", *size);
+    if (fd < 0)
+        return -errno;
+
+    // huge page backed regions are rounded up to whole huge pages,
+    // which is also what they must be mapped and unmapped with
+    int regionSize = ashmem_get_size_region(fd);
+    if (regionSize > 0 && (size_t)regionSize > *size)
+        *size = regionSize;
+    return fd;
+}
+
+static int memfd_backend_alloc(size_t* size)
+{
+    int fd = syscall(__NR_memfd_create, "gralloc-buffer",
+                     MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return -errno;
+
+    if (ftruncate(fd, *size) < 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    // importers can map the whole size without the risk of SIGBUS
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+    return fd;
+}
+
+static int dmaheap_backend_alloc(size_t* size)
+{
+#ifdef HAVE_LINUX_DMA_HEAP_H
+    if (sDmaHeapFd >= 0) {
+        struct dma_heap_allocation_data data;
+        memset(&data, 0, sizeof(data));
+        data.len = *size;
+        data.fd_flags = O_RDWR | O_CLOEXEC;
+        if (ioctl(sDmaHeapFd, DMA_HEAP_IOCTL_ALLOC, &data) < 0)
+            return -errno;
+        return data.fd;
+    }
+#endif
+
+#ifdef HAVE_LINUX_UDMABUF_H
+    // udmabuf needs a memfd which cannot shrink
+    int memfd = memfd_backend_alloc(size);
+    if (memfd < 0)
+        return memfd;
+
+    struct udmabuf_create create;
+    memset(&create, 0, sizeof(create));
+    create.memfd = memfd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size = *size;
+    int fd = ioctl(sUdmabufFd, UDMABUF_CREATE, &create);
+    int err = -errno;
+    // the dma-buf holds the pages
+    close(memfd);
+    return fd < 0 ? err : fd;
+#else
+    // only selected with a dma heap, see select_backend_locked()
+    return memfd_backend_alloc(size);
+#endif
+}
+
+static const alloc_backend_t sBackends[] = {
+    { "ashmem", ashmem_backend_alloc },
+    { "memfd", memfd_backend_alloc },
+    { "dmaheap", dmaheap_backend_alloc },
+};
+
+static Locker sBackendLock;
+static const alloc_backend_t* sBackend = NULL;
+
+/* this function must be called with sBackendLock held */
+static int select_backend_locked(const char* name)
+{
+    const alloc_backend_t* backend = NULL;
+    for (size_t i = 0; i < sizeof(sBackends) / sizeof(sBackends[0]); i++) {
+        if (strcmp(name, sBackends[i].name) == 0)
+            backend = &sBackends[i];
+    }
+    if (backend == NULL)
+        return -EINVAL;
+
+    if (backend->alloc == dmaheap_backend_alloc &&
+        sDmaHeapFd < 0 && sUdmabufFd < 0) {
+#ifdef HAVE_LINUX_DMA_HEAP_H
+        sDmaHeapFd = open("/dev/dma_heap/system", O_RDONLY | O_CLOEXEC);
+#endif
+#ifdef HAVE_LINUX_UDMABUF_H
+        if (sDmaHeapFd < 0)
+            sUdmabufFd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+#endif
+        if (sDmaHeapFd < 0 && sUdmabufFd < 0) {
+            ALOGW("no dma heap or udmabuf device, using memfd buffers");
+            backend = &sBackends[1];
+        }
+    }
+    sBackend = backend;
+    return 0;
+}
+
+static const alloc_backend_t* current_backend()
+{
+    Locker::Autolock _l(sBackendLock);
+    if (sBackend == NULL) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("gralloc.backend", value, "ashmem");
+        if (select_backend_locked(value) < 0) {
+            ALOGW("unknown gralloc.backend %s, using ashmem", value);
+            select_backend_locked("ashmem");
+        }
+    }
+    return sBackend;
+}
+
+/*
+ * Freed buffers are parked here, still mapped, and handed out again to
+ * allocations of the same size class and usage. Pipelines are restarted
+ * with identical buffers, which then costs no region creation, mmap or
+ * munmap. The pool is bounded by the gralloc.pool.max_buffers and
+ * gralloc.pool.max_mb properties, oldest buffers going first, and set
+ * gralloc.pool.zero_fill=1 clears recycled buffers before reuse.
+ */
+struct buffer_pool_t {
+    pthread_mutex_t lock;
+    bool configured;
+    size_t maxBuffers;  // high-water marks, 0 buffers disables the pool
+    size_t maxBytes;
+    bool zeroFill;
+    size_t bytes;
+    std::vector<private_handle_t*> buffers; // oldest first
+};
+
+static buffer_pool_t sPool = {
+    PTHREAD_MUTEX_INITIALIZER, false, 0, 0, false, 0, std::vector<private_handle_t*>()
+};
+
+/* this function must be called with the pool lock held */
+static void pool_configure_locked()
+{
+    if (sPool.configured)
+        return;
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get("gralloc.pool.max_buffers", value, "32");
+    sPool.maxBuffers = atoi(value);
+    property_get("gralloc.pool.max_mb", value, "256");
+    sPool.maxBytes = (size_t)atoi(value) * 1024 * 1024;
+    property_get("gralloc.pool.zero_fill", value, "0");
+    sPool.zeroFill = atoi(value) != 0;
+    sPool.configured = true;
+}
+
+/* this function must be called with the pool lock held */
+static void pool_trim_locked(size_t maxBuffers, size_t maxBytes)
+{
+    gralloc_module_t* module = &GRALLOC_HAL_MODULE_INFO_SYM.base;
+    size_t count = 0;
+    while (count < sPool.buffers.size() &&
+           (sPool.buffers.size() - count > maxBuffers || sPool.bytes > maxBytes)) {
+        private_handle_t* hnd = sPool.buffers[count++];
+        sPool.bytes -= hnd->size;
+        terminateBuffer(module, hnd);
+        close(hnd->fd);
+        free_handle(hnd);
+    }
+    sPool.buffers.erase(sPool.buffers.begin(), sPool.buffers.begin() + count);
+}
+
+static void pool_trim(size_t maxBytes)
+{
+    pthread_mutex_lock(&sPool.lock);
+    pool_trim_locked(maxBytes == 0 ? 0 : sPool.buffers.size(), maxBytes);
+    pthread_mutex_unlock(&sPool.lock);
+}
+
+/*
+ * A parked buffer serves requests up to an eighth smaller than it, which
+ * also covers regions rounded up to whole huge pages. The closest fit wins.
+ */
+static private_handle_t* pool_take(size_t size, int usage)
+{
+    private_handle_t* hnd = NULL;
+
+    pthread_mutex_lock(&sPool.lock);
+    int best = -1;
+    for (size_t i = 0; i < sPool.buffers.size(); i++) {
+        private_handle_t* candidate = sPool.buffers[i];
+        size_t candidateSize = candidate->size;
+        if (candidate->usage != usage || candidateSize < size ||
+            candidateSize - size > size / 8)
+            continue;
+        if (best < 0 || candidateSize <= (size_t)sPool.buffers[best]->size)
+            best = i;
+    }
+    if (best >= 0) {
+        hnd = sPool.buffers[best];
+        sPool.buffers.erase(sPool.buffers.begin() + best);
+        sPool.bytes -= hnd->size;
+    }
+    bool zeroFill = sPool.zeroFill;
+    pthread_mutex_unlock(&sPool.lock);
+
+    if (hnd != NULL && zeroFill)
+        memset((void*)hnd->base, 0, hnd->size);
+    return hnd;
+}
+
+/* \return true if the pool took the buffer */
+static bool pool_park(private_handle_t* hnd)
+{
+    if (hnd->base == 0 || hnd->pid != getpid())
+        return false;
+
+    pthread_mutex_lock(&sPool.lock);
+    pool_configure_locked();
+    bool parked = false;
+    if (sPool.maxBuffers > 0 && (size_t)hnd->size <= sPool.maxBytes) {
+        sPool.buffers.push_back(hnd);
+        sPool.bytes += hnd->size;
+        pool_trim_locked(sPool.maxBuffers, sPool.maxBytes);
+        parked = true;
+    }
+    pthread_mutex_unlock(&sPool.lock);
+    return parked;
+}
+
+/*****************************************************************************/
+
 static int gralloc_alloc_framebuffer_locked(alloc_device_t* dev,
         size_t size, int usage, buffer_handle_t* pHandle)
 {
@@ -147,8 +455,11 @@ static int gralloc_alloc_framebuffer_locked(alloc_device_t* dev,
         // If we have only one buffer, we never use page-flipping. Instead,
         // we return a regular buffer which will be memcpy'ed to the main
         // screen when post is called.
+        // Its rows have the aligned stride of gralloc_alloc(), which may
+        // be longer than the lines of the framebuffer.
         int newUsage = (usage & ~GRALLOC_USAGE_HW_FB) | GRALLOC_USAGE_HW_2D;
-        return gralloc_alloc_buffer(dev, bufferSize, newUsage, pHandle);
+        return gralloc_alloc_buffer(dev, size > bufferSize ? size : bufferSize,
+                newUsage, pHandle);
     }
 
     if (bufferMask >= ((1LU<<numBuffers)-1)) {
@@ -158,8 +469,10 @@ static int gralloc_alloc_framebuffer_locked(alloc_device_t* dev,
 
     // create a "fake" handles for it
     intptr_t vaddr = intptr_t(m->framebuffer->base);
-    private_handle_t* hnd = new private_handle_t(dup(m->framebuffer->fd), size,
+    private_handle_t* hnd = alloc_handle(dup(m->framebuffer->fd), size,
             private_handle_t::PRIV_FLAGS_FRAMEBUFFER);
+    if (hnd == NULL)
+        return -ENOMEM;
 
     // find a free slot
     for (uint32_t i=0 ; i<numBuffers ; i++) {
@@ -189,26 +502,49 @@ static int gralloc_alloc_framebuffer(alloc_device_t* dev,
 }
 
 static int gralloc_alloc_buffer(alloc_device_t* dev,
-        size_t size, int /*usage*/, buffer_handle_t* pHandle)
+        size_t size, int usage, buffer_handle_t* pHandle)
 {
     int err = 0;
     int fd = -1;
 
     size = roundUpToPageSize(size);
+
+    private_handle_t* recycled = pool_take(size, usage);
+    if (recycled != NULL) {
+        *pHandle = recycled;
+        return 0;
+    }
     
-    fd = ashmem_create_region("gralloc-buffer", size);
+    const alloc_backend_t* backend = current_backend();
+    size_t allocSize = size;
+    fd = backend->alloc(&allocSize);
     if (fd < 0) {
-        ALOGE("couldn't create ashmem (%s)", strerror(-errno));
-        err = -errno;
+        // out of memory maybe, give the parked buffers back and retry
+        pool_trim(0);
+        allocSize = size;
+        fd = backend->alloc(&allocSize);
+    }
+    if (fd < 0) {
+        ALOGE("couldn't create %s buffer (%s)", backend->name, strerror(-fd));
+        err = fd;
     }
 
     if (err == 0) {
-        private_handle_t* hnd = new private_handle_t(fd, size, 0);
+        size = allocSize;
+        private_handle_t* hnd = alloc_handle(fd, size, 0);
+        if (hnd == NULL) {
+            close(fd);
+            return -ENOMEM;
+        }
+        hnd->usage = usage;
         gralloc_module_t* module = reinterpret_cast<gralloc_module_t*>(
                 dev->common.module);
         err = mapBuffer(module, hnd);
         if (err == 0) {
             *pHandle = hnd;
+        } else {
+            close(fd);
+            free_handle(hnd);
         }
     }
     
@@ -228,47 +564,58 @@ static int gralloc_alloc(alloc_device_t* dev,
 
     size_t size, stride;
 
-    int align = 4;
-    int bitsPerPixel = 0;
+    size_t align = stride_align();
+    size_t bytesPerPixel = 0;
     switch (format) {
         case HAL_PIXEL_FORMAT_RGBA_8888:
         case HAL_PIXEL_FORMAT_RGBX_8888:
         case HAL_PIXEL_FORMAT_BGRA_8888:
-            bitsPerPixel = 32;
+            bytesPerPixel = 4;
             break;
         case HAL_PIXEL_FORMAT_RGB_888:
-            bitsPerPixel = 24;
+            bytesPerPixel = 3;
             break;
         case HAL_PIXEL_FORMAT_RGB_565:
         case HAL_PIXEL_FORMAT_RAW16:
-            bitsPerPixel = 16;
+            bytesPerPixel = 2;
             break;
         case HAL_PIXEL_FORMAT_YCrCb_420_SP:
             /* nv21, pass through */
         case HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED:
         case HAL_PIXEL_FORMAT_YCbCr_420_888:
             /* fixed to be nv12, in our case */
-            bitsPerPixel = 12;
-            break;
         case HAL_PIXEL_FORMAT_BLOB:
-            bitsPerPixel = 8;
+            bytesPerPixel = 1;
             break;
         default:
             return -EINVAL;
     }
-    size_t bitsPerRow = (w * bitsPerPixel + (align - 1)) & ~(align - 1);
-    size = bitsPerRow * h / 8;
 
-    // handle (semi-)planar format strides separately
     switch (format) {
         case HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED:
         case HAL_PIXEL_FORMAT_YCrCb_420_SP:
         case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            // luma rows followed by the interleaved chroma rows, both
+            // with the same stride, see gralloc_lock_ycbcr()
+            stride = (w + align - 1) & ~(align - 1);
+            size = stride * (h + (h + 1) / 2);
+            break;
+        case HAL_PIXEL_FORMAT_BLOB:
+            // not made of rows
             stride = w;
+            size = (size_t)w * h;
             break;
-        default:
-            stride = bitsPerRow / bitsPerPixel;
+        default: {
+            // rows hold whole pixels, so align to a multiple of both
+            size_t rowAlign = align;
+            while (rowAlign % bytesPerPixel)
+                rowAlign += align;
+            size_t bytesPerRow = (w * bytesPerPixel + rowAlign - 1) /
+                    rowAlign * rowAlign;
+            stride = bytesPerRow / bytesPerPixel;
+            size = bytesPerRow * h;
             break;
+        }
     }
 
     int err;
@@ -284,6 +631,12 @@ static int gralloc_alloc(alloc_device_t* dev,
 
     // populate private handle ints:
     private_handle_t *privHandle = (private_handle_t *) *pHandle;
+    if (privHandle->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) {
+        // the handle points into the framebuffer, which has its own lines
+        private_module_t* m = reinterpret_cast<private_module_t*>(
+                dev->common.module);
+        stride = m->finfo.line_length / bytesPerPixel;
+    }
     privHandle->width = w;
     privHandle->height = h;
     privHandle->stride = stride;
@@ -309,14 +662,17 @@ static int gralloc_free(alloc_device_t* dev,
         int index = (hnd->base - m->framebuffer->base) / bufferSize;
         m->bufferMask &= ~(1<<index); 
     } else { 
+        // parked buffers stay mapped and open for the next allocation
+        if (pool_park(const_cast<private_handle_t*>(hnd)))
+            return 0;
+
         gralloc_module_t* module = reinterpret_cast<gralloc_module_t*>(
                 dev->common.module);
         terminateBuffer(module, const_cast<private_handle_t*>(hnd));
     }
 
     close(hnd->fd);
-    delete hnd;
-    return 0;
+    return free_handle(const_cast<private_handle_t*>(hnd));
 }
 
 /*****************************************************************************/
@@ -389,7 +745,7 @@ static int gralloc_perform(struct gralloc_module_t const* module,
         }
 
         /* create private handle and assign it to the caller */
-        hnd = new private_handle_t(fd, size, private_handle_t::PRIV_FLAGS_MAP_READ_ONLY);
+        hnd = alloc_handle(fd, size, private_handle_t::PRIV_FLAGS_MAP_READ_ONLY);
         if (hnd != NULL) {
             hnd->width     = va_arg(valist, int);
             hnd->height    = va_arg(valist, int);
@@ -401,19 +757,71 @@ static int gralloc_perform(struct gralloc_module_t const* module,
                 *pHandle = hnd;
                 *vaddr = (void*) hnd->base;
             } else {
-                delete(hnd);
+                free_handle(hnd);
                 status = -EINVAL;
             }
         } else {
             status = -ENOMEM;
         }
         break;
+    case GRALLOC_TRIM_POOL:
+        size = va_arg(valist, size_t);
+        pool_trim(size);
+        break;
+    case GRALLOC_SET_BACKEND: {
+        const char* name = va_arg(valist, const char*);
+        const char** pSelected = va_arg(valist, const char**);
+        if (name == NULL) {
+            status = -EINVAL;
+            break;
+        }
+        const alloc_backend_t* previous;
+        {
+            Locker::Autolock _l(sBackendLock);
+            previous = sBackend;
+            status = select_backend_locked(name);
+            if (status == 0 && pSelected != NULL)
+                *pSelected = sBackend->name;
+        }
+        // parked buffers belong to the previous backend, don't hand
+        // them out as buffers of the new one
+        if (status == 0 && sBackend != previous)
+            pool_trim(0);
+        break;
+    }
+    case GRALLOC_RESERVE_HANDLES:
+        size = va_arg(valist, size_t);
+        reserve_handles(size);
+        break;
+    case GRALLOC_GET_GENERATION: {
+        pHandle = va_arg(valist, buffer_handle_t *);
+        int* pGeneration = va_arg(valist, int*);
+        if (pHandle == NULL || pGeneration == NULL ||
+            private_handle_t::validate(*pHandle) < 0) {
+            status = -EINVAL;
+            break;
+        }
+        *pGeneration = ((const private_handle_t*)*pHandle)->generation;
+        break;
+    }
+    case GRALLOC_GET_PINNED_SIZE: {
+        size_t* pSize = va_arg(valist, size_t*);
+        if (pSize != NULL)
+            *pSize = getPinnedSize();
+        else
+            status = -EINVAL;
+        break;
+    }
     case GRALLOC_UNMAP_FD:
         pHandle = va_arg(valist, buffer_handle_t *);
         if (pHandle != NULL) {
-            status = terminateBuffer(module, (private_handle_t*) *pHandle);
             private_handle_t *hnd = (private_handle_t *) *pHandle;
-            delete(hnd);
+            if (private_handle_t::validate(hnd) < 0) {
+                status = -EINVAL;
+                break;
+            }
+            status = terminateBuffer(module, hnd);
+            free_handle(hnd);
         } else {
             status = -EINVAL;
         }
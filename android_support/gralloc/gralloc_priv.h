@@ -16,6 +16,7 @@
  * Modified by Intel Corporation.
  * - added more ints to private handle
  * - added PRIV_FLAGS_MAP_READ_ONLY to allow read-only mmapping
+ * - added a generation int and the freed handle magic of the handle slab
  *
  */
 
@@ -39,6 +40,12 @@
 struct private_module_t;
 struct private_handle_t;
 
+/* private usage flags, see gralloc_map() */
+enum {
+    GRALLOC_USAGE_PREFAULT = GRALLOC_USAGE_PRIVATE_0, /* populate pages when mapping */
+    GRALLOC_USAGE_PIN      = GRALLOC_USAGE_PRIVATE_1, /* populate and mlock pages */
+};
+
 struct private_module_t {
     gralloc_module_t base;
 
@@ -84,6 +91,7 @@ struct private_handle_t {
     int     stride;    // index sNumFds + 6
     int     halFormat; // index sNumFds + 7
     int     usage;     // index sNumFds + 8
+    int     generation; // index sNumFds + 9
     /* ADD NEW INTS HERE */
 
     // FIXME: the attributes below should be out-of-line
@@ -96,11 +104,12 @@ struct private_handle_t {
     }
     static const int sNumFds = 1;
     static const int sMagic = 0x3141592;
+    static const int sFreedMagic = 0x2718281; // see free_handle()
 
     private_handle_t(int fd, int size, int flags) :
         fd(fd), magic(sMagic), flags(flags), size(size), offset(0),
         width(0), height(0), stride(0), halFormat(0), usage(0),
-        base(0), pid(getpid())
+        generation(0), base(0), pid(getpid())
     {
         version = sizeof(native_handle);
         numInts = sNumInts();
@@ -112,6 +121,14 @@ struct private_handle_t {
 
     static int validate(const native_handle* h) {
         const private_handle_t* hnd = (const private_handle_t*)h;
+        if (h && h->version == sizeof(native_handle) &&
+                h->numInts == sNumInts() && h->numFds == sNumFds &&
+                hnd->magic == sFreedMagic)
+        {
+            ALOGE("use of freed gralloc handle (at %p, generation %d)",
+                  h, hnd->generation);
+            return -EINVAL;
+        }
         if (!h || h->version != sizeof(native_handle) ||
                 h->numInts != sNumInts() || h->numFds != sNumFds ||
                 hnd->magic != sMagic)
@@ -121,6 +138,20 @@ struct private_handle_t {
         }
         return 0;
     }
+
+    // also rejects a handle whose slot was freed and reused since the
+    // caller got it at the given generation
+    static int validate(const native_handle* h, int generation) {
+        if (validate(h) < 0)
+            return -EINVAL;
+        const private_handle_t* hnd = (const private_handle_t*)h;
+        if (hnd->generation != generation) {
+            ALOGE("stale gralloc handle (at %p, generation %d, now %d)",
+                  h, generation, hnd->generation);
+            return -EINVAL;
+        }
+        return 0;
+    }
 #endif
 };
 
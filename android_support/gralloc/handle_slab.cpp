@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "gralloc"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <cutils/log.h>
+
+#include <deque>
+#include <new>
+#include <vector>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*
+ * Handles of allocated and imported buffers come from slabs of slots,
+ * which are never given back to the heap. Importing and freeing buffers
+ * on the frame path then costs no malloc or free.
+ *
+ * Freed handles keep their memory with sFreedMagic in place of the magic,
+ * so private_handle_t::validate() reports any later use of them, and slots
+ * are reused oldest first, which keeps a freed handle detectable for as
+ * long as possible. Each use of a slot gets a new generation, which tells
+ * a recycled handle apart from the one that was freed at the same address.
+ */
+
+// slots per slab
+static const size_t SLAB_SLOTS = 32;
+
+union handle_slot_t {
+    char storage[sizeof(private_handle_t)];
+    uint64_t align;
+};
+
+static Locker sSlabLock;
+static std::vector<handle_slot_t*> sSlabs;
+static std::deque<handle_slot_t*> sFreeSlots;
+static int sGeneration = 0;
+
+/* this function must be called with sSlabLock held */
+static bool grow_locked(size_t slots)
+{
+    while (sFreeSlots.size() < slots) {
+        handle_slot_t* slab = static_cast<handle_slot_t*>(
+                calloc(SLAB_SLOTS, sizeof(handle_slot_t)));
+        if (slab == NULL)
+            return false;
+        sSlabs.push_back(slab);
+        for (size_t i = 0; i < SLAB_SLOTS; i++)
+            sFreeSlots.push_back(&slab[i]);
+    }
+    return true;
+}
+
+/* this function must be called with sSlabLock held */
+static bool owns_locked(const handle_slot_t* slot)
+{
+    for (handle_slot_t* slab : sSlabs) {
+        if (slot >= slab && slot < slab + SLAB_SLOTS)
+            return true;
+    }
+    return false;
+}
+
+private_handle_t* alloc_handle(int fd, int size, int flags)
+{
+    Locker::Autolock _l(sSlabLock);
+    if (!grow_locked(1))
+        return NULL;
+
+    handle_slot_t* slot = sFreeSlots.front();
+    sFreeSlots.pop_front();
+    private_handle_t* hnd = new (slot->storage) private_handle_t(fd, size, flags);
+    // never 0, which marks handles that are not from the slab
+    if (++sGeneration <= 0)
+        sGeneration = 1;
+    hnd->generation = sGeneration;
+    return hnd;
+}
+
+int free_handle(private_handle_t* hnd)
+{
+    handle_slot_t* slot = reinterpret_cast<handle_slot_t*>(hnd);
+
+    Locker::Autolock _l(sSlabLock);
+    if (!owns_locked(slot)) {
+        ALOGE("free of a gralloc handle not from the slab (at %p)", hnd);
+        return -EINVAL;
+    }
+    if (hnd->magic != private_handle_t::sMagic) {
+        ALOGE("double free of gralloc handle (at %p, generation %d)",
+              hnd, hnd->generation);
+        return -EINVAL;
+    }
+
+    hnd->~private_handle_t();
+    hnd->magic = private_handle_t::sFreedMagic;
+    sFreeSlots.push_back(slot);
+    return 0;
+}
+
+void reserve_handles(size_t count)
+{
+    Locker::Autolock _l(sSlabLock);
+    if (!grow_locked(count))
+        ALOGW("could not reserve %zu gralloc handles", count);
+}
@@ -16,6 +16,12 @@
  * Modified by Intel Corporation.
  * - added missing LOG_TAG
  * - added support for read-only mmapping
+ * - added a registry sharing one refcounted mapping per buffer
+ * - added prefaulting and pinning of mappings
+ * - added gralloc_lock_ycbcr
+ * - added DMA_BUF_IOCTL_SYNC bracketing of locks on dma-bufs
+ * - added generation checks of the references of recycled handles
+ * - rejected lock, unlock and unregister of handles of another generation
  *
  */
 
@@ -24,43 +30,341 @@
 #include <limits.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
+
+#include <linux/dma-buf.h>
+#include <linux/magic.h>
 
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 
 #include <hardware/hardware.h>
 #include <hardware/gralloc.h>
 
 #include "gralloc_priv.h"
+#include "gr.h"
 
+#include <map>
+#include <tuple>
 
 /*****************************************************************************/
 
-static int gralloc_map(gralloc_module_t const* /*module*/,
-        buffer_handle_t handle,
-        void** vaddr)
+/*
+ * All handles of the same buffer in this process share one mapping, found by
+ * the backing object of their fd (device, inode and offset), so that handles
+ * imported from fds, registered or locked again do not map the buffer twice.
+ * Mappings are refcounted: each handle holds one reference from mapping or
+ * registering, plus one per outstanding lock.
+ */
+struct mapping_t {
+    uintptr_t addr;
+    size_t size;
+    int prot;
+    int refs;
+    bool shared;    // listed in sMappings, reusable by other handles
+    bool pinned;    // mlocked, counted in sPinnedBytes
+    bool dmabuf;    // cpu access is bracketed with DMA_BUF_IOCTL_SYNC
+    std::tuple<dev_t, ino_t, off_t> object;
+};
+
+struct handle_refs_t {
+    int own;        // from gralloc_map
+    int locks;      // from gralloc_lock
+    uint64_t syncFlags; // DMA_BUF_SYNC_READ/WRITE of the outstanding locks
+    int generation; // of the handle that took the references
+};
+
+static Locker sMappingLock;
+static std::map<std::tuple<dev_t, ino_t, off_t>, mapping_t*> sMappings;
+static std::map<uintptr_t, mapping_t*> sMappingsByAddress;
+static std::map<const private_handle_t*, handle_refs_t> sHandleRefs;
+
+/*
+ * New mappings can be prefaulted, so that the first frame written into a
+ * buffer does not take a fault on every page, and pinned, so that buffers
+ * are not swapped out. Either comes from the usage of the handle or, for all
+ * buffers, from these properties:
+ *   gralloc.map.populate=1    MAP_POPULATE and MADV_WILLNEED
+ *   gralloc.map.hugepage=1    MADV_HUGEPAGE, if shmem allows it
+ *   gralloc.map.mlock=1       mlock, implies populate
+ *   gralloc.map.mlock_max_mb  limit of pinned memory, 0 for none
+ */
+struct map_options_t {
+    bool configured;
+    bool populate;
+    bool hugepage;
+    bool mlock;
+    size_t mlockMax;
+};
+
+static map_options_t sMapOptions;
+static size_t sPinnedBytes;
+
+/* this function must be called with sMappingLock held */
+static const map_options_t& map_options_locked()
 {
-    private_handle_t* hnd = (private_handle_t*)handle;
-    if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
-        size_t size = hnd->size;
-        int protect = PROT_READ | PROT_WRITE;
-        if (hnd->flags & private_handle_t::PRIV_FLAGS_MAP_READ_ONLY)
-            protect = PROT_READ;
+    if (!sMapOptions.configured) {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("gralloc.map.populate", value, "0");
+        sMapOptions.populate = atoi(value) != 0;
+        property_get("gralloc.map.hugepage", value, "0");
+        sMapOptions.hugepage = atoi(value) != 0;
+        property_get("gralloc.map.mlock", value, "0");
+        sMapOptions.mlock = atoi(value) != 0;
+        property_get("gralloc.map.mlock_max_mb", value, "0");
+        sMapOptions.mlockMax = (size_t)atoi(value) * 1024 * 1024;
+        sMapOptions.configured = true;
+    }
+    return sMapOptions;
+}
+
+/* this function must be called with sMappingLock held */
+static bool pin_mapping_locked(mapping_t* mapping)
+{
+    const map_options_t& options = map_options_locked();
+    if (options.mlockMax > 0 && sPinnedBytes + mapping->size > options.mlockMax) {
+        ALOGW("Not pinning %zu bytes, %zu of %zu pinned already",
+              mapping->size, sPinnedBytes, options.mlockMax);
+        return false;
+    }
+    if (mlock((void*)mapping->addr, mapping->size) < 0) {
+        ALOGW("Could not pin %zu bytes: %s", mapping->size, strerror(errno));
+        return false;
+    }
+    sPinnedBytes += mapping->size;
+    return true;
+}
+
+/* this function must be called with sMappingLock held */
+static int acquire_mapping_locked(private_handle_t* hnd)
+{
+    mapping_t* mapping = NULL;
+
+    if (hnd->base && sHandleRefs.find(hnd) != sHandleRefs.end()) {
+        // the handle is mapped already, take another reference. The base of
+        // a handle from another process is not ours, hence the lookup.
+        std::map<uintptr_t, mapping_t*>::iterator it =
+                sMappingsByAddress.find(hnd->base - hnd->offset);
+        if (it == sMappingsByAddress.end())
+            return -EINVAL;
+        mapping = it->second;
+        mapping->refs++;
+        return 0;
+    }
+
+    size_t size = hnd->size;
+    int protect = PROT_READ | PROT_WRITE;
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_MAP_READ_ONLY)
+        protect = PROT_READ;
+
+    const map_options_t& options = map_options_locked();
+    bool pin = options.mlock || (hnd->usage & GRALLOC_USAGE_PIN);
+    bool prefault = pin || options.populate || (hnd->usage & GRALLOC_USAGE_PREFAULT);
+
+    struct stat st;
+    bool known = fstat(hnd->fd, &st) == 0;
+    std::tuple<dev_t, ino_t, off_t> object(known ? st.st_dev : 0,
+                                           known ? st.st_ino : 0, 0);
+    if (known) {
+        std::map<std::tuple<dev_t, ino_t, off_t>, mapping_t*>::iterator it =
+                sMappings.find(object);
+        if (it != sMappings.end() && it->second->size >= size &&
+            (it->second->prot & protect) == protect) {
+            mapping = it->second;
+            mapping->refs++;
+            if (pin && !mapping->pinned)
+                mapping->pinned = pin_mapping_locked(mapping);
+        }
+    }
 
-        void* mappedAddress = mmap(0, size, protect, MAP_SHARED, hnd->fd, 0);
+    if (mapping == NULL) {
+        void* mappedAddress = mmap(0, size, protect,
+                                   MAP_SHARED | (prefault ? MAP_POPULATE : 0),
+                                   hnd->fd, 0);
         if (mappedAddress == MAP_FAILED) {
             ALOGE("Could not mmap %s", strerror(errno));
             return -errno;
         }
-        hnd->base = uintptr_t(mappedAddress) + hnd->offset;
+        if (options.hugepage)
+            madvise(mappedAddress, size, MADV_HUGEPAGE);
+        if (prefault)
+            madvise(mappedAddress, size, MADV_WILLNEED);
+
+        mapping = new mapping_t;
+        mapping->addr = uintptr_t(mappedAddress);
+        mapping->size = size;
+        mapping->prot = protect;
+        mapping->refs = 1;
+        mapping->pinned = false;
+        struct statfs fs;
+        mapping->dmabuf = fstatfs(hnd->fd, &fs) == 0 && fs.f_type == DMA_BUF_MAGIC;
+        // a smaller or read-only mapping of the object stays the shared one
+        mapping->shared = known && sMappings.find(object) == sMappings.end();
+        mapping->object = object;
+        if (mapping->shared)
+            sMappings[object] = mapping;
+        sMappingsByAddress[mapping->addr] = mapping;
+        if (pin)
+            mapping->pinned = pin_mapping_locked(mapping);
+    }
+
+    hnd->base = mapping->addr + hnd->offset;
+    return 0;
+}
+
+/* this function must be called with sMappingLock held */
+static mapping_t* find_mapping_locked(const private_handle_t* hnd)
+{
+    std::map<uintptr_t, mapping_t*>::iterator it =
+            sMappingsByAddress.find(hnd->base - hnd->offset);
+    return it == sMappingsByAddress.end() ? NULL : it->second;
+}
+
+/*
+ * dma-bufs may be written by devices behind non-coherent caches, so cpu
+ * access is bracketed with DMA_BUF_IOCTL_SYNC, which does the cache
+ * maintenance of the exporter. Other buffers need nothing.
+ *
+ * this function must be called with sMappingLock held
+ */
+static void sync_dmabuf_locked(const private_handle_t* hnd, uint64_t flags)
+{
+    mapping_t* mapping = find_mapping_locked(hnd);
+    if (mapping == NULL || !mapping->dmabuf)
+        return;
+
+    struct dma_buf_sync sync;
+    sync.flags = flags;
+    if (ioctl(hnd->fd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+        ALOGE("DMA_BUF_IOCTL_SYNC(%llx) failed %s",
+              (unsigned long long)flags, strerror(errno));
+}
+
+/* this function must be called with sMappingLock held */
+static void release_mapping_locked(private_handle_t* hnd)
+{
+    std::map<uintptr_t, mapping_t*>::iterator it =
+            sMappingsByAddress.find(hnd->base - hnd->offset);
+    if (it == sMappingsByAddress.end()) {
+        ALOGE("No mapping at %p", (void*)hnd->base);
+        return;
+    }
+
+    mapping_t* mapping = it->second;
+    if (--mapping->refs > 0)
+        return;
+
+    //ALOGD("unmapping from %p, size=%d", (void*)mapping->addr, mapping->size);
+    if (munmap((void*)mapping->addr, mapping->size) < 0) {
+        ALOGE("Could not unmap %s", strerror(errno));
+    }
+    if (mapping->pinned)
+        sPinnedBytes -= mapping->size;
+    if (mapping->shared)
+        sMappings.erase(mapping->object);
+    sMappingsByAddress.erase(it);
+    delete mapping;
+}
+
+/*
+ * \return true if the references of the handle were taken by an older
+ * generation, whose handle was freed without giving them back. The caller
+ * holds a pointer to that freed handle rather than to the one now in its
+ * slot. this function must be called with sMappingLock held
+ */
+static bool stale_refs_locked(const private_handle_t* hnd)
+{
+    std::map<const private_handle_t*, handle_refs_t>::const_iterator it =
+            sHandleRefs.find(hnd);
+    if (it == sHandleRefs.end() || it->second.generation == hnd->generation)
+        return false;
+    ALOGE("references of handle %p taken at generation %d, now %d",
+          hnd, it->second.generation, hnd->generation);
+    return true;
+}
+
+/*
+ * drops one reference of the handle from gralloc_map, its locks keep their
+ * references until gralloc_unlock. this function must be called with
+ * sMappingLock held
+ */
+static int release_handle_locked(private_handle_t* hnd)
+{
+    if (stale_refs_locked(hnd))
+        return -EINVAL;
+    std::map<const private_handle_t*, handle_refs_t>::iterator it = sHandleRefs.find(hnd);
+    if (it == sHandleRefs.end() || it->second.own == 0)
+        return 0;
+
+    release_mapping_locked(hnd);
+    if (--it->second.own == 0 && it->second.locks == 0) {
+        sHandleRefs.erase(it);
+        hnd->base = 0;
+    }
+    return 0;
+}
+
+/*
+ * drops all the references of a handle which is freed, including the ones
+ * of locks it was freed with. this function must be called with
+ * sMappingLock held
+ */
+static void forget_handle_locked(private_handle_t* hnd)
+{
+    std::map<const private_handle_t*, handle_refs_t>::iterator it = sHandleRefs.find(hnd);
+    if (it == sHandleRefs.end())
+        return;
+
+    ALOGE_IF(it->second.locks, "freeing handle %p with %d locks", hnd, it->second.locks);
+    for (int i = it->second.own + it->second.locks; i > 0; i--)
+        release_mapping_locked(hnd);
+    sHandleRefs.erase(it);
+}
+
+/*
+ * Handles come from the handle slab and a slot is reused once its handle
+ * is freed. References left behind by a freed handle, which was not
+ * unmapped or unlocked, belong to an older generation. Mapping the new
+ * handle at the same address drops them rather than crediting them to it,
+ * while its lock, unlock and unregister are rejected until then.
+ *
+ * this function must be called with sMappingLock held
+ */
+static handle_refs_t& refs_for_locked(const private_handle_t* hnd)
+{
+    handle_refs_t& refs = sHandleRefs[hnd];
+    if (refs.generation != hnd->generation) {
+        ALOGE_IF(refs.own || refs.locks,
+                 "dropping %d references of freed handle %p (generation %d)",
+                 refs.own + refs.locks, hnd, refs.generation);
+        refs = handle_refs_t();
+        refs.generation = hnd->generation;
+    }
+    return refs;
+}
+
+static int gralloc_map(gralloc_module_t const* /*module*/,
+        buffer_handle_t handle,
+        void** vaddr)
+{
+    private_handle_t* hnd = (private_handle_t*)handle;
+    if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
+        Locker::Autolock _l(sMappingLock);
+        int err = acquire_mapping_locked(hnd);
+        if (err < 0)
+            return err;
+        refs_for_locked(hnd).own++;
         //ALOGD("gralloc_map() succeeded fd=%d, off=%d, size=%d, vaddr=%p",
-        //        hnd->fd, hnd->offset, hnd->size, mappedAddress);
+        //        hnd->fd, hnd->offset, hnd->size, (void*)hnd->base);
     }
     *vaddr = (void*)hnd->base;
     return 0;
@@ -71,12 +375,8 @@ static int gralloc_unmap(gralloc_module_t const* /*module*/,
 {
     private_handle_t* hnd = (private_handle_t*)handle;
     if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
-        void* base = (void*)hnd->base;
-        size_t size = hnd->size;
-        //ALOGD("unmapping from %p, size=%d", base, size);
-        if (munmap(base, size) < 0) {
-            ALOGE("Could not unmap %s", strerror(errno));
-        }
+        Locker::Autolock _l(sMappingLock);
+        return release_handle_locked(hnd);
     }
     hnd->base = 0;
     return 0;
@@ -90,45 +390,11 @@ int gralloc_register_buffer(gralloc_module_t const* module,
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
 
-    // *** WARNING WARNING WARNING ***
-    //
-    // If a buffer handle is passed from the process that allocated it to a
-    // different process, and then back to the allocator process, we will
-    // create a second mapping of the buffer. If the process reads and writes
-    // through both mappings, normal memory ordering guarantees may be
-    // violated, depending on the processor cache implementation*.
-    //
-    // If you are deriving a new gralloc implementation from this code, don't
-    // do this. A "real" gralloc should provide a single reference-counted
-    // mapping for each buffer in a process.
-    //
-    // In the current system, there is one case that needs a buffer to be
-    // registered in the same process that allocated it. The SurfaceFlinger
-    // process acts as the IGraphicBufferAlloc Binder provider, so all gralloc
-    // allocations happen in its process. After returning the buffer handle to
-    // the IGraphicBufferAlloc client, SurfaceFlinger free's its handle to the
-    // buffer (unmapping it from the SurfaceFlinger process). If
-    // SurfaceFlinger later acts as the producer end of the buffer queue the
-    // buffer belongs to, it will get a new handle to the buffer in response
-    // to IGraphicBufferProducer::requestBuffer(). Like any buffer handle
-    // received through Binder, the SurfaceFlinger process will register it.
-    // Since it already freed its original handle, it will only end up with
-    // one mapping to the buffer and there will be no problem.
-    //
-    // Currently SurfaceFlinger only acts as a buffer producer for a remote
-    // consumer when taking screenshots and when using virtual displays.
-    //
-    // Eventually, each application should be allowed to make its own gralloc
-    // allocations, solving the problem. Also, this ashmem-based gralloc
-    // should go away, replaced with a real ion-based gralloc.
-    //
-    // * Specifically, associative virtually-indexed caches are likely to have
-    //   problems. Most modern L1 caches fit that description.
-
-    private_handle_t* hnd = (private_handle_t*)handle;
-    ALOGD_IF(hnd->pid == getpid(),
-            "Registering a buffer in the process that created it. "
-            "This may cause memory ordering problems.");
+    // A buffer handle passed from the process that allocated it to a
+    // different process, and then back to the allocator process, used to
+    // get a second mapping of the buffer, and reading and writing through
+    // both could violate memory ordering on virtually-indexed caches. The
+    // handle now gets the single refcounted mapping of its buffer instead.
 
     void *vaddr;
     return gralloc_map(module, handle, &vaddr);
@@ -142,7 +408,7 @@ int gralloc_unregister_buffer(gralloc_module_t const* module,
 
     private_handle_t* hnd = (private_handle_t*)handle;
     if (hnd->base)
-        gralloc_unmap(module, handle);
+        return gralloc_unmap(module, handle);
 
     return 0;
 }
@@ -154,25 +420,31 @@ int mapBuffer(gralloc_module_t const* module,
     return gralloc_map(module, hnd, &vaddr);
 }
 
-int terminateBuffer(gralloc_module_t const* module,
+int terminateBuffer(gralloc_module_t const* /*module*/,
         private_handle_t* hnd)
 {
     if (hnd->base) {
-        // this buffer was mapped, unmap it now
-        gralloc_unmap(module, hnd);
+        // this buffer was mapped, unmap it now. The handle goes away, so
+        // nothing is left to unlock it later
+        if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
+            Locker::Autolock _l(sMappingLock);
+            forget_handle_locked(hnd);
+        }
+        hnd->base = 0;
     }
 
     return 0;
 }
 
 int gralloc_lock(gralloc_module_t const* /*module*/,
-        buffer_handle_t handle, int /*usage*/,
+        buffer_handle_t handle, int usage,
         int /*l*/, int /*t*/, int /*w*/, int /*h*/,
         void** vaddr)
 {
     // this is called when a buffer is being locked for software
-    // access. in thin implementation we have nothing to do since
-    // not synchronization with the h/w is needed.
+    // access. in thin implementation we only need to keep the
+    // buffer mapped until it is unlocked, since no synchronization
+    // with the h/w is needed.
     // typically this is used to wait for the h/w to finish with
     // this buffer if relevant. the data cache may need to be
     // flushed or invalidated depending on the usage bits and the
@@ -182,6 +454,27 @@ int gralloc_lock(gralloc_module_t const* /*module*/,
         return -EINVAL;
 
     private_handle_t* hnd = (private_handle_t*)handle;
+    if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
+        Locker::Autolock _l(sMappingLock);
+        if (stale_refs_locked(hnd))
+            return -EINVAL;
+        int err = acquire_mapping_locked(hnd);
+        if (err < 0)
+            return err;
+
+        uint64_t syncFlags = 0;
+        if (usage & GRALLOC_USAGE_SW_READ_MASK)
+            syncFlags |= DMA_BUF_SYNC_READ;
+        if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
+            syncFlags |= DMA_BUF_SYNC_WRITE;
+        if (syncFlags == 0)
+            syncFlags = DMA_BUF_SYNC_RW;
+        sync_dmabuf_locked(hnd, DMA_BUF_SYNC_START | syncFlags);
+
+        handle_refs_t& refs = refs_for_locked(hnd);
+        refs.locks++;
+        refs.syncFlags |= syncFlags;
+    }
     *vaddr = (void*)hnd->base;
     return 0;
 }
@@ -190,9 +483,79 @@ int gralloc_unlock(gralloc_module_t const* /*module*/,
         buffer_handle_t handle)
 {
     // we're done with a software buffer. nothing to do in this
-    // implementation. typically this is used to flush the data cache.
+    // implementation but dropping the lock reference. typically
+    // this is used to flush the data cache.
 
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
+
+    private_handle_t* hnd = (private_handle_t*)handle;
+    if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
+        Locker::Autolock _l(sMappingLock);
+        if (stale_refs_locked(hnd))
+            return -EINVAL;
+        std::map<const private_handle_t*, handle_refs_t>::iterator it =
+                sHandleRefs.find(hnd);
+        // unbalanced unlocks have always been harmless, keep them so
+        if (it == sHandleRefs.end() || it->second.locks == 0)
+            return 0;
+
+        sync_dmabuf_locked(hnd, DMA_BUF_SYNC_END | it->second.syncFlags);
+        release_mapping_locked(hnd);
+        if (--it->second.locks == 0) {
+            it->second.syncFlags = 0;
+            if (it->second.own == 0) {
+                sHandleRefs.erase(it);
+                hnd->base = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+int gralloc_lock_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr *ycbcr)
+{
+    if (private_handle_t::validate(handle) < 0 || ycbcr == NULL)
+        return -EINVAL;
+
+    private_handle_t* hnd = (private_handle_t*)handle;
+    bool crFirst;
+    switch (hnd->halFormat) {
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+            crFirst = true;
+            break;
+        case HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED:
+        case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            crFirst = false;
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    void* vaddr;
+    int err = gralloc_lock(module, handle, usage, l, t, w, h, &vaddr);
+    if (err < 0)
+        return err;
+
+    // semi-planar: the interleaved chroma rows follow the luma rows and
+    // have the same stride, see gralloc_alloc()
+    uint8_t* y = static_cast<uint8_t*>(vaddr);
+    uint8_t* c = y + (size_t)hnd->stride * hnd->height;
+    memset(ycbcr, 0, sizeof(*ycbcr));
+    ycbcr->y = y;
+    ycbcr->cb = crFirst ? c + 1 : c;
+    ycbcr->cr = crFirst ? c : c + 1;
+    ycbcr->ystride = hnd->stride;
+    ycbcr->cstride = hnd->stride;
+    ycbcr->chroma_step = 2;
     return 0;
 }
+
+size_t getPinnedSize()
+{
+    Locker::Autolock _l(sMappingLock);
+    return sPinnedBytes;
+}
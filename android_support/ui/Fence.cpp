@@ -15,12 +15,232 @@
  *
  * Modified by Intel Corporation.
  * - reduced Fence into a stub to allow compiling in linux
+ * - replaced the stub and libsync with fences on eventfds, using the
+ *   sync_file ioctls for fences that come from a kernel sync driver
+ * - added the create and signal functions
+ * - merged eventfd fences are signaled by one shared thread
  *
  */
 
+#define LOG_TAG "Fence"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/sync_file.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
 #include <ui/Fence.h>
+#include <utils/Log.h>
+#include <utils/Mutex.h>
+
 namespace android {
 
+const sp<Fence> Fence::NO_FENCE = sp<Fence>(new Fence);
+
+// waitForever logs an error when the fence has not signaled by then
+static const int WARNING_TIMEOUT_MS = 3000;
+
+/*
+ * Fences either come from a kernel sync driver as sync_file fds, or are
+ * made by Fence::create() as eventfds. Both poll readable once signaled.
+ * An eventfd fence is never read, its counter stays at the monotonic time
+ * it was signaled at and is queried through fdinfo, so the signal time
+ * travels with the fd to other processes.
+ */
+static bool isSyncFile(int fd)
+{
+    struct sync_file_info info;
+    memset(&info, 0, sizeof(info));
+    return ioctl(fd, SYNC_IOC_FILE_INFO, &info) == 0;
+}
+
+// returns the eventfd counter, or -1 when fd is not an eventfd
+static int64_t eventfdCount(int fd)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+    FILE *file = fopen(path, "re");
+    if (file == NULL)
+        return -1;
+
+    int64_t count = -1;
+    char line[128];
+    unsigned long long value;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "eventfd-count: %llx", &value) == 1) {
+            count = value;
+            break;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+static nsecs_t syncFileSignalTime(int fd)
+{
+    struct sync_file_info info;
+    memset(&info, 0, sizeof(info));
+    if (ioctl(fd, SYNC_IOC_FILE_INFO, &info) < 0 || info.num_fences == 0)
+        return -1;
+    if (info.status == 0)
+        return INT64_MAX;
+    if (info.status < 0)
+        return -1;
+
+    std::vector<struct sync_fence_info> fences(info.num_fences);
+    info.sync_fence_info = reinterpret_cast<uintptr_t>(fences.data());
+    if (ioctl(fd, SYNC_IOC_FILE_INFO, &info) < 0)
+        return -1;
+
+    nsecs_t signalTime = 0;
+    for (uint32_t i = 0; i < info.num_fences; i++)
+        signalTime = std::max(signalTime, (nsecs_t)fences[i].timestamp_ns);
+    return signalTime;
+}
+
+// serializes the signaling of eventfd fences, see signalEventfd()
+static Mutex sSignalLock;
+
+/*
+ * Writes the signal time into an unsignaled eventfd. Writes add up, so two
+ * threads signaling dups of one fence must not both find it unsignaled and
+ * write; the second one leaves the time of the first in place.
+ */
+static status_t signalEventfd(int fd, nsecs_t when)
+{
+    Mutex::Autolock l(sSignalLock);
+    int64_t count = eventfdCount(fd);
+    if (count < 0)
+        return INVALID_OPERATION;
+    if (count > 0)
+        return NO_ERROR;
+
+    uint64_t value = when > 0 ? when : 1;
+    if (write(fd, &value, sizeof(value)) != sizeof(value))
+        return -errno;
+    return NO_ERROR;
+}
+
+/*
+ * Signals the fences merged from unsignaled eventfd fences. A single thread
+ * polls the source fences of all pending merges, so that a merge does not
+ * cost a thread of its own. The sources are referenced until they signal.
+ */
+class MergeSignaler {
+public:
+    static MergeSignaler& get() {
+        // never destroyed, the thread may still run at exit
+        static MergeSignaler* signaler = new MergeSignaler;
+        return *signaler;
+    }
+
+    void add(const sp<Fence>& f1, int fd1, const sp<Fence>& f2, int fd2,
+            const sp<Fence>& merged, int mergedFd) {
+        Mutex::Autolock l(mLock);
+        Merge merge;
+        merge.sources[0] = f1;
+        merge.sources[1] = f2;
+        merge.fds[0] = fd1;
+        merge.fds[1] = fd2;
+        merge.merged = merged;
+        merge.mergedFd = mergedFd;
+        mMerges.push_back(merge);
+        uint64_t one = 1;
+        if (write(mWakeFd, &one, sizeof(one)) != sizeof(one)) {
+            ALOGE("merge: waking the signaler failed: %s (%d)",
+                    strerror(errno), errno);
+        }
+        if (!mStarted) {
+            mStarted = true;
+            std::thread(&MergeSignaler::loop, this).detach();
+        }
+    }
+
+private:
+    struct Merge {
+        sp<Fence> sources[2];   // cleared once signaled
+        int fds[2];
+        sp<Fence> merged;
+        int mergedFd;
+    };
+
+    MergeSignaler() :
+        mWakeFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+        mStarted(false) {
+    }
+
+    void loop() {
+        std::vector<struct pollfd> pfds;
+        Mutex::Autolock l(mLock);
+        for (;;) {
+            pfds.clear();
+            struct pollfd wake = { mWakeFd, POLLIN, 0 };
+            pfds.push_back(wake);
+            for (size_t i = 0; i < mMerges.size(); i++) {
+                for (int j = 0; j < 2; j++) {
+                    struct pollfd pfd = { mMerges[i].fds[j], POLLIN, 0 };
+                    pfds.push_back(pfd);
+                }
+            }
+
+            // merges are only added meanwhile, which wakes the poll
+            mLock.unlock();
+            int ret = poll(pfds.data(), pfds.size(), -1);
+            mLock.lock();
+            if (ret < 0) {
+                if (errno != EINTR) {
+                    ALOGE("merge: poll failed: %s (%d)", strerror(errno), errno);
+                }
+                continue;
+            }
+
+            if (pfds[0].revents & POLLIN) {
+                uint64_t count;
+                if (read(mWakeFd, &count, sizeof(count)) < 0) {
+                    ALOGE("merge: reset failed: %s (%d)", strerror(errno), errno);
+                }
+            }
+            size_t polled = (pfds.size() - 1) / 2;
+            for (size_t i = polled; i-- > 0;) {
+                Merge& merge = mMerges[i];
+                for (int j = 0; j < 2; j++) {
+                    if (pfds[1 + 2 * i + j].revents != 0) {
+                        // a signaled fence stays readable, poll it no more
+                        merge.fds[j] = -1;
+                    }
+                }
+                if (merge.fds[0] == -1 && merge.fds[1] == -1) {
+                    signalMerged(merge);
+                    mMerges.erase(mMerges.begin() + i);
+                }
+            }
+        }
+    }
+
+    static void signalMerged(const Merge& merge) {
+        nsecs_t when = std::max(merge.sources[0]->getSignalTime(),
+                merge.sources[1]->getSignalTime());
+        if (when <= 0 || when == INT64_MAX) {
+            when = systemTime(SYSTEM_TIME_MONOTONIC);
+        }
+        signalEventfd(merge.mergedFd, when);
+    }
+
+    Mutex mLock;
+    std::vector<Merge> mMerges; // pending merges, in the order of the poll
+    int mWakeFd;                // readable when a merge was added
+    bool mStarted;
+};
+
 Fence::Fence() :
     mFenceFd(-1) {
 }
@@ -30,32 +250,135 @@ Fence::Fence(int fenceFd) :
 }
 
 Fence::~Fence() {
+    if (mFenceFd != -1) {
+        close(mFenceFd);
+    }
+}
+
+sp<Fence> Fence::create() {
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd == -1) {
+        ALOGE("create: eventfd failed: %s (%d)", strerror(errno), errno);
+        return NO_FENCE;
+    }
+    return new Fence(fd);
+}
+
+status_t Fence::signal() {
+    if (mFenceFd == -1 || isSyncFile(mFenceFd)) {
+        return INVALID_OPERATION;
+    }
+    return signalEventfd(mFenceFd, systemTime(SYSTEM_TIME_MONOTONIC));
 }
 
 status_t Fence::wait(int timeout) {
-    (void) timeout;
-    return OK;
+    if (mFenceFd == -1) {
+        return NO_ERROR;
+    }
+
+    nsecs_t deadline = systemTime(SYSTEM_TIME_MONOTONIC) + milliseconds(timeout);
+    struct pollfd pfd;
+    pfd.fd = mFenceFd;
+    pfd.events = POLLIN;
+    for (;;) {
+        int ret = poll(&pfd, 1, timeout);
+        if (ret > 0) {
+            return (pfd.revents & POLLNVAL) ? -EINVAL : NO_ERROR;
+        }
+        if (ret == 0) {
+            return -ETIME;
+        }
+        if (errno != EINTR) {
+            return -errno;
+        }
+        if (timeout != TIMEOUT_NEVER) {
+            timeout = toMillisecondTimeoutDelay(
+                    systemTime(SYSTEM_TIME_MONOTONIC), deadline);
+        }
+    }
 }
 
 status_t Fence::waitForever(const char* logname) {
-    (void) logname;
-    return OK;
+    if (mFenceFd == -1) {
+        return NO_ERROR;
+    }
+    status_t err = wait(WARNING_TIMEOUT_MS);
+    if (err == -ETIME) {
+        ALOGE("%s: fence %d didn't signal in %d ms", logname, mFenceFd,
+                WARNING_TIMEOUT_MS);
+        err = wait(TIMEOUT_NEVER);
+    }
+    return err;
 }
 
 sp<Fence> Fence::merge(const String8& name, const sp<Fence>& f1,
         const sp<Fence>& f2) {
-    (void) name;
-    (void) f1;
-    (void) f2;
-    return NULL;
+    if (!f1->isValid() && !f2->isValid()) {
+        return NO_FENCE;
+    }
+    if (!f1->isValid() || !f2->isValid()) {
+        int fd = f1->isValid() ? f1->dup() : f2->dup();
+        if (fd == -1) {
+            ALOGE("merge: dup failed: %s (%d)", strerror(errno), errno);
+            return NO_FENCE;
+        }
+        return new Fence(fd);
+    }
+
+    if (isSyncFile(f1->mFenceFd) && isSyncFile(f2->mFenceFd)) {
+        struct sync_merge_data data;
+        memset(&data, 0, sizeof(data));
+        strncpy(data.name, name.string(), sizeof(data.name) - 1);
+        data.fd2 = f2->mFenceFd;
+        if (ioctl(f1->mFenceFd, SYNC_IOC_MERGE, &data) < 0) {
+            ALOGE("merge: SYNC_IOC_MERGE(%d, %d) failed: %s (%d)",
+                    f1->mFenceFd, f2->mFenceFd, strerror(errno), errno);
+            return NO_FENCE;
+        }
+        return new Fence(data.fence);
+    }
+
+    // an eventfd takes part: when one fence has signaled already the
+    // merged fence is the other one, else it is signaled once both have
+    nsecs_t t1 = f1->getSignalTime();
+    nsecs_t t2 = f2->getSignalTime();
+    if (t1 != INT64_MAX && t2 == INT64_MAX) {
+        return merge(name, NO_FENCE, f2);
+    }
+    if (t2 != INT64_MAX && t1 == INT64_MAX) {
+        return merge(name, f1, NO_FENCE);
+    }
+
+    sp<Fence> merged = create();
+    if (!merged->isValid()) {
+        return NO_FENCE;
+    }
+    if (t1 != INT64_MAX && t2 != INT64_MAX) {
+        signalEventfd(merged->mFenceFd, std::max(t1, t2));
+        return merged;
+    }
+
+    MergeSignaler::get().add(f1, f1->mFenceFd, f2, f2->mFenceFd,
+            merged, merged->mFenceFd);
+    return merged;
 }
 
 int Fence::dup() const {
-    return 0;
+    return ::fcntl(mFenceFd, F_DUPFD_CLOEXEC, 0);
 }
 
 nsecs_t Fence::getSignalTime() const {
-    return 0;
+    if (mFenceFd == -1) {
+        return -1;
+    }
+    if (isSyncFile(mFenceFd)) {
+        return syncFileSignalTime(mFenceFd);
+    }
+    int64_t count = eventfdCount(mFenceFd);
+    if (count < 0) {
+        return -1;
+    }
+    return count == 0 ? INT64_MAX : count;
 }
 
 size_t Fence::getFlattenedSize() const {
@@ -63,23 +386,50 @@ size_t Fence::getFlattenedSize() const {
 }
 
 size_t Fence::getFdCount() const {
-    return 0;
+    return isValid() ? 1 : 0;
 }
 
 status_t Fence::flatten(void*& buffer, size_t& size, int*& fds, size_t& count) const {
-    (void) buffer;
-    (void) size;
-    (void) fds;
-    (void) count;
-    return OK;
+    if (size < getFlattenedSize() || count < getFdCount()) {
+        return NO_MEMORY;
+    }
+    // Cast to uint32_t since the size of a size_t can vary between 32- and
+    // 64-bit processes.
+    FlattenableUtils::write(buffer, size, static_cast<uint32_t>(getFdCount()));
+    if (isValid()) {
+        *fds++ = mFenceFd;
+        count--;
+    }
+    return NO_ERROR;
 }
 
 status_t Fence::unflatten(void const*& buffer, size_t& size, int const*& fds, size_t& count) {
-    (void) buffer;
-    (void) size;
-    (void) fds;
-    (void) count;
-    return OK;
+    if (mFenceFd != -1) {
+        // Don't unflatten if we already have a valid fd.
+        return INVALID_OPERATION;
+    }
+
+    if (size < getFlattenedSize()) {
+        return NO_MEMORY;
+    }
+
+    uint32_t numFds;
+    FlattenableUtils::read(buffer, size, numFds);
+
+    if (numFds > 1) {
+        return BAD_VALUE;
+    }
+
+    if (count < numFds) {
+        return NO_MEMORY;
+    }
+
+    if (numFds) {
+        mFenceFd = *fds++;
+        count--;
+    }
+
+    return NO_ERROR;
 }
 
 } // namespace android
@@ -16,6 +16,7 @@
 *
 * Modified by Intel Corporation.
 * - added module loading via the load_fake_gralloc function
+* - replaced the allocation list with sharded records and added getStats
 *
 */
 
@@ -24,6 +25,11 @@
 
 #include <cutils/log.h>
 
+#include <string.h>
+
+#include <atomic>
+#include <unordered_map>
+
 #include <utils/Singleton.h>
 #include <utils/String8.h>
 #include <utils/Trace.h>
@@ -39,9 +45,77 @@ namespace android {
 
 ANDROID_SINGLETON_STATIC_INSTANCE( GraphicBufferAllocator )
 
-Mutex GraphicBufferAllocator::sLock;
-KeyedVector<buffer_handle_t,
-    GraphicBufferAllocator::alloc_rec_t> GraphicBufferAllocator::sAllocList;
+struct GraphicBufferAllocator::alloc_shard_t {
+    Mutex lock;
+    std::unordered_map<buffer_handle_t, alloc_rec_t> records;
+    std::atomic<size_t> count;
+    std::atomic<size_t> bytes;
+} __attribute__((aligned(64)));
+
+/*
+ * Counters of one format and usage. Slots are claimed with a compare and
+ * swap of their key and never released. The last slot has no key and takes
+ * whatever does not fit in the table, it is reported with format 0.
+ */
+struct GraphicBufferAllocator::stats_slot_t {
+    std::atomic<uint64_t> key;      // 0 while free
+    std::atomic<size_t> count;
+    std::atomic<size_t> bytes;
+    std::atomic<size_t> maxBytes;
+};
+
+GraphicBufferAllocator::alloc_shard_t
+    GraphicBufferAllocator::sShards[GraphicBufferAllocator::SHARD_COUNT];
+GraphicBufferAllocator::stats_slot_t
+    GraphicBufferAllocator::sStatsSlots[GraphicBufferAllocator::STATS_SLOT_COUNT];
+static std::atomic<size_t> sMaxBytes(0);
+
+static void updateMax(std::atomic<size_t>& max, size_t value)
+{
+    size_t current = max.load(std::memory_order_relaxed);
+    while (value > current &&
+           !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        ;
+}
+
+GraphicBufferAllocator::alloc_shard_t& GraphicBufferAllocator::shardFor(
+        buffer_handle_t handle)
+{
+    uintptr_t h = reinterpret_cast<uintptr_t>(handle);
+    return sShards[((h >> 4) ^ (h >> 12)) % SHARD_COUNT];
+}
+
+GraphicBufferAllocator::stats_slot_t* GraphicBufferAllocator::statsSlotFor(
+        PixelFormat format, uint32_t usage)
+{
+    // offset by one, as key 0 marks free slots
+    uint64_t key = (uint64_t(uint32_t(format)) << 32 | usage) + 1;
+    size_t first = (key * 0x9e3779b97f4a7c15ull) >> 58;
+    for (size_t i = 0; i < STATS_SLOT_COUNT - 1; i++) {
+        stats_slot_t& slot = sStatsSlots[(first + i) % (STATS_SLOT_COUNT - 1)];
+        uint64_t current = slot.key.load(std::memory_order_acquire);
+        if (current == 0 && slot.key.compare_exchange_strong(current, key,
+                std::memory_order_acq_rel))
+            return &slot;
+        if (current == key)
+            return &slot;
+    }
+    return &sStatsSlots[STATS_SLOT_COUNT - 1];
+}
+
+void GraphicBufferAllocator::account(const alloc_rec_t& rec, bool add)
+{
+    stats_slot_t* slot = statsSlotFor(rec.format, rec.usage);
+    if (add) {
+        slot->count.fetch_add(1, std::memory_order_relaxed);
+        size_t bytes = slot->bytes.fetch_add(rec.size,
+                std::memory_order_relaxed) + rec.size;
+        updateMax(slot->maxBytes, bytes);
+    } else {
+        slot->count.fetch_sub(1, std::memory_order_relaxed);
+        slot->bytes.fetch_sub(rec.size, std::memory_order_relaxed);
+    }
+}
 
 GraphicBufferAllocator::GraphicBufferAllocator()
     : mAllocDev(0)
@@ -67,27 +141,27 @@ GraphicBufferAllocator::~GraphicBufferAllocator()
 
 void GraphicBufferAllocator::dump(String8& result) const
 {
-    Mutex::Autolock _l(sLock);
-    KeyedVector<buffer_handle_t, alloc_rec_t>& list(sAllocList);
     size_t total = 0;
     const size_t SIZE = 4096;
     char buffer[SIZE];
     snprintf(buffer, SIZE, "Allocated buffers:\n");
     result.append(buffer);
-    const size_t c = list.size();
-    for (size_t i=0 ; i<c ; i++) {
-        const alloc_rec_t& rec(list.valueAt(i));
-        if (rec.size) {
-            snprintf(buffer, SIZE, "%10p: %7.2f KiB | %4u (%4u) x %4u | %8X | 0x%08x\n",
-                    list.keyAt(i), rec.size/1024.0f,
-                    rec.width, rec.stride, rec.height, rec.format, rec.usage);
-        } else {
-            snprintf(buffer, SIZE, "%10p: unknown     | %4u (%4u) x %4u | %8X | 0x%08x\n",
-                    list.keyAt(i),
-                    rec.width, rec.stride, rec.height, rec.format, rec.usage);
+    for (size_t s=0 ; s<SHARD_COUNT ; s++) {
+        Mutex::Autolock _l(sShards[s].lock);
+        for (const auto& entry : sShards[s].records) {
+            const alloc_rec_t& rec(entry.second);
+            if (rec.size) {
+                snprintf(buffer, SIZE, "%10p: %7.2f KiB | %4u (%4u) x %4u | %8X | 0x%08x\n",
+                        entry.first, rec.size/1024.0f,
+                        rec.width, rec.stride, rec.height, rec.format, rec.usage);
+            } else {
+                snprintf(buffer, SIZE, "%10p: unknown     | %4u (%4u) x %4u | %8X | 0x%08x\n",
+                        entry.first,
+                        rec.width, rec.stride, rec.height, rec.format, rec.usage);
+            }
+            result.append(buffer);
+            total += rec.size;
         }
-        result.append(buffer);
-        total += rec.size;
     }
     snprintf(buffer, SIZE, "Total allocated (estimate): %.2f KB\n", total/1024.0f);
     result.append(buffer);
@@ -97,6 +171,40 @@ void GraphicBufferAllocator::dump(String8& result) const
     }
 }
 
+GraphicBufferAllocator::alloc_stats_t GraphicBufferAllocator::getStats(
+        Vector<alloc_stats_t>* perFormat) const
+{
+    alloc_stats_t total;
+    memset(&total, 0, sizeof(total));
+    for (size_t s=0 ; s<SHARD_COUNT ; s++) {
+        total.count += sShards[s].count.load(std::memory_order_relaxed);
+        total.bytes += sShards[s].bytes.load(std::memory_order_relaxed);
+    }
+    total.maxBytes = sMaxBytes.load(std::memory_order_relaxed);
+
+    if (perFormat) {
+        perFormat->clear();
+        for (size_t i=0 ; i<STATS_SLOT_COUNT ; i++) {
+            const stats_slot_t& slot(sStatsSlots[i]);
+            uint64_t key = slot.key.load(std::memory_order_acquire);
+            if (i == STATS_SLOT_COUNT - 1) {
+                if (slot.maxBytes.load(std::memory_order_relaxed) == 0)
+                    continue;
+            } else if (key == 0) {
+                continue;
+            }
+            alloc_stats_t stats;
+            stats.format = key ? static_cast<PixelFormat>((key - 1) >> 32) : 0;
+            stats.usage = key ? static_cast<uint32_t>(key - 1) : 0;
+            stats.count = slot.count.load(std::memory_order_relaxed);
+            stats.bytes = slot.bytes.load(std::memory_order_relaxed);
+            stats.maxBytes = slot.maxBytes.load(std::memory_order_relaxed);
+            perFormat->add(stats);
+        }
+    }
+    return total;
+}
+
 void GraphicBufferAllocator::dumpToSystemLog()
 {
     String8 s;
@@ -131,8 +239,6 @@ status_t GraphicBufferAllocator::alloc(uint32_t width, uint32_t height,
             width, height, format, usage, err, strerror(-err));
 
     if (err == NO_ERROR) {
-        Mutex::Autolock _l(sLock);
-        KeyedVector<buffer_handle_t, alloc_rec_t>& list(sAllocList);
         uint32_t bpp = bytesPerPixel(format);
         alloc_rec_t rec;
         rec.width = width;
@@ -141,7 +247,20 @@ status_t GraphicBufferAllocator::alloc(uint32_t width, uint32_t height,
         rec.format = format;
         rec.usage = usage;
         rec.size = static_cast<size_t>(height * (*stride) * bpp);
-        list.add(*handle, rec);
+
+        alloc_shard_t& shard(shardFor(*handle));
+        {
+            Mutex::Autolock _l(shard.lock);
+            shard.records[*handle] = rec;
+        }
+        shard.count.fetch_add(1, std::memory_order_relaxed);
+        shard.bytes.fetch_add(rec.size, std::memory_order_relaxed);
+        account(rec, true);
+
+        size_t bytes = 0;
+        for (size_t s=0 ; s<SHARD_COUNT ; s++)
+            bytes += sShards[s].bytes.load(std::memory_order_relaxed);
+        updateMax(sMaxBytes, bytes);
     }
 
     return err;
@@ -152,13 +271,33 @@ status_t GraphicBufferAllocator::free(buffer_handle_t handle)
     ATRACE_CALL();
     status_t err;
 
+    // drop the record first, the module may hand the same handle out again
+    // to another thread as soon as it is freed
+    alloc_shard_t& shard(shardFor(handle));
+    alloc_rec_t rec;
+    bool known = false;
+    {
+        Mutex::Autolock _l(shard.lock);
+        auto it = shard.records.find(handle);
+        if (it != shard.records.end()) {
+            rec = it->second;
+            shard.records.erase(it);
+            known = true;
+        }
+    }
+
     err = mAllocDev->free(mAllocDev, handle);
 
     ALOGW_IF(err, "free(...) failed %d (%s)", err, strerror(-err));
-    if (err == NO_ERROR) {
-        Mutex::Autolock _l(sLock);
-        KeyedVector<buffer_handle_t, alloc_rec_t>& list(sAllocList);
-        list.removeItem(handle);
+    if (known) {
+        if (err == NO_ERROR) {
+            shard.count.fetch_sub(1, std::memory_order_relaxed);
+            shard.bytes.fetch_sub(rec.size, std::memory_order_relaxed);
+            account(rec, false);
+        } else {
+            Mutex::Autolock _l(shard.lock);
+            shard.records[handle] = rec;
+        }
     }
 
     return err;
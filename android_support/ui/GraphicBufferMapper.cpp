@@ -17,6 +17,7 @@
  * - added module loading via the load_fake_gralloc function
  * - removed dependency to sync/sync.h and made stubs of the
  *   lockAsync and lockAsyncYCbCr functions
+ * - lockAsync and lockAsyncYCbCr wait on their fence through ui/Fence
  *
  */
 
@@ -37,6 +38,7 @@
 #include <utils/Log.h>
 #include <utils/Trace.h>
 
+#include <ui/Fence.h>
 #include <ui/GraphicBufferMapper.h>
 #include <ui/Rect.h>
 
@@ -134,17 +136,35 @@ status_t GraphicBufferMapper::unlock(buffer_handle_t handle)
     return err;
 }
 
+// the module has no lockAsync, so wait for the fence before locking
+static void waitForFence(int fenceFd, const char* logname)
+{
+    if (fenceFd >= 0) {
+        sp<Fence> fence = new Fence(fenceFd);
+        status_t err = fence->waitForever(logname);
+        ALOGW_IF(err, "%s: fence wait failed %d (%s)", logname, err,
+                strerror(-err));
+    }
+}
+
 status_t GraphicBufferMapper::lockAsync(buffer_handle_t handle,
         uint32_t usage, const Rect& bounds, void** vaddr, int fenceFd)
 {
     ATRACE_CALL();
-    status_t err = OK;
-    (void) handle;
-    (void) usage;
-    (void) vaddr;
-    (void) bounds;
-    (void) fenceFd;
-    
+    status_t err;
+
+    if (mAllocMod->common.module_api_version >= GRALLOC_MODULE_API_VERSION_0_3) {
+        err = mAllocMod->lockAsync(mAllocMod, handle, static_cast<int>(usage),
+                bounds.left, bounds.top, bounds.width(), bounds.height(),
+                vaddr, fenceFd);
+    } else {
+        waitForFence(fenceFd, "GraphicBufferMapper::lockAsync");
+        err = mAllocMod->lock(mAllocMod, handle, static_cast<int>(usage),
+                bounds.left, bounds.top, bounds.width(), bounds.height(),
+                vaddr);
+    }
+
+    ALOGW_IF(err, "lockAsync(...) failed %d (%s)", err, strerror(-err));
     return err;
 }
 
@@ -152,13 +172,24 @@ status_t GraphicBufferMapper::lockAsyncYCbCr(buffer_handle_t handle,
         uint32_t usage, const Rect& bounds, android_ycbcr *ycbcr, int fenceFd)
 {
     ATRACE_CALL();
-    status_t err = OK;
+    status_t err;
+
+    if (mAllocMod->common.module_api_version >= GRALLOC_MODULE_API_VERSION_0_3
+            && mAllocMod->lockAsync_ycbcr != NULL) {
+        err = mAllocMod->lockAsync_ycbcr(mAllocMod, handle,
+                static_cast<int>(usage), bounds.left, bounds.top,
+                bounds.width(), bounds.height(), ycbcr, fenceFd);
+    } else {
+        waitForFence(fenceFd, "GraphicBufferMapper::lockAsyncYCbCr");
+        if (mAllocMod->lock_ycbcr == NULL) {
+            return -EINVAL; // do not log failure
+        }
+        err = mAllocMod->lock_ycbcr(mAllocMod, handle, static_cast<int>(usage),
+                bounds.left, bounds.top, bounds.width(), bounds.height(),
+                ycbcr);
+    }
 
-    (void) handle;
-    (void) usage;
-    (void) ycbcr;
-    (void) bounds;
-    (void) fenceFd;
+    ALOGW_IF(err, "lockAsyncYCbCr(...) failed %d (%s)", err, strerror(-err));
     return err;
 }
 
@@ -0,0 +1,536 @@
+/*
+ * Copyright (C) 2016 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "gtest/gtest.h"
+#define LOG_TAG "camera-metadata-test"
+
+#include <utils/Log.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <set>
+#include <thread>
+#include "camera/CameraMetadata.h"
+#include "camera/CameraMetadataView.h"
+#include "camera/CameraMetadataSnapshot.h"
+#include "system/camera_metadata.h"
+#include "camera_metadata_hidden.h"
+
+using namespace android;
+
+TEST(CameraMetadataTest, tagIndex) {
+
+    camera_metadata_t *meta = allocate_camera_metadata(32, 256);
+    ASSERT_TRUE(meta != NULL);
+
+    const uint32_t tags[] = {
+        ANDROID_SENSOR_EXPOSURE_TIME,
+        ANDROID_CONTROL_AE_MODE,
+        ANDROID_JPEG_QUALITY,
+        ANDROID_CONTROL_AF_MODE,
+        ANDROID_SENSOR_SENSITIVITY,
+    };
+    int64_t exposure = 10000000;
+    uint8_t mode = 1;
+    int32_t sensitivity = 400;
+    ASSERT_EQ(add_camera_metadata_entry(meta, tags[0], &exposure, 1), 0);
+    ASSERT_EQ(add_camera_metadata_entry(meta, tags[1], &mode, 1), 0);
+    ASSERT_EQ(add_camera_metadata_entry(meta, tags[2], &mode, 1), 0);
+
+    // entries added after a lookup are found through the index as well
+    camera_metadata_entry_t entry;
+    ASSERT_EQ(find_camera_metadata_entry(meta, tags[1], &entry), 0);
+    ASSERT_EQ(entry.index, 1u);
+    ASSERT_EQ(add_camera_metadata_entry(meta, tags[3], &mode, 1), 0);
+    ASSERT_EQ(add_camera_metadata_entry(meta, tags[4], &sensitivity, 1), 0);
+    for (size_t i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        ASSERT_EQ(find_camera_metadata_entry(meta, tags[i], &entry), 0);
+        ASSERT_EQ(entry.index, i);
+        ASSERT_EQ(entry.tag, tags[i]);
+    }
+    ASSERT_EQ(entry.data.i32[0], sensitivity);
+    ASSERT_EQ(find_camera_metadata_entry(meta, ANDROID_FLASH_MODE, &entry),
+              -ENOENT);
+
+    // deleting and sorting move the entries
+    ASSERT_EQ(delete_camera_metadata_entry(meta, 0), 0);
+    ASSERT_EQ(find_camera_metadata_entry(meta, tags[0], &entry), -ENOENT);
+    ASSERT_EQ(find_camera_metadata_entry(meta, tags[4], &entry), 0);
+    ASSERT_EQ(entry.index, 3u);
+    ASSERT_EQ(sort_camera_metadata(meta), 0);
+    for (size_t i = 1; i < sizeof(tags) / sizeof(tags[0]); i++) {
+        ASSERT_EQ(find_camera_metadata_entry(meta, tags[i], &entry), 0);
+        ASSERT_EQ(entry.tag, tags[i]);
+    }
+
+    // clones get their own index
+    camera_metadata_t *clone = clone_camera_metadata(meta);
+    ASSERT_TRUE(clone != NULL);
+    ASSERT_EQ(find_camera_metadata_entry(clone, tags[3], &entry), 0);
+    ASSERT_EQ(entry.tag, tags[3]);
+    ASSERT_EQ(validate_camera_metadata_structure(clone, NULL), 0);
+
+    free_camera_metadata(clone);
+    free_camera_metadata(meta);
+}
+
+TEST(CameraMetadataTest, pooledBuffers) {
+
+    camera_metadata_pool_t *pool = create_camera_metadata_pool(2);
+    ASSERT_TRUE(pool != NULL);
+
+    // capacities are rounded up, so buffers of the same class are reused
+    camera_metadata_t *meta = allocate_pooled_camera_metadata(pool, 20, 300);
+    ASSERT_TRUE(meta != NULL);
+    ASSERT_EQ(get_camera_metadata_entry_capacity(meta), 32u);
+    ASSERT_EQ(get_camera_metadata_data_capacity(meta), 512u);
+    free_pooled_camera_metadata(pool, meta);
+    camera_metadata_t *reused = allocate_pooled_camera_metadata(pool, 30, 500);
+    ASSERT_EQ(reused, meta);
+    ASSERT_EQ(get_camera_metadata_entry_count(reused), 0u);
+    ASSERT_EQ(validate_camera_metadata_structure(reused, NULL), 0);
+    free_pooled_camera_metadata(pool, reused);
+
+    // copies and resizes of pooled objects take their buffers from the pool
+    // and give them back
+    const camera_metadata_t *copyBuffer;
+    {
+        CameraMetadata settings(pool, 16, 256);
+        int32_t value = 0;
+        for (uint32_t tag = ANDROID_CONTROL_START; tag < ANDROID_CONTROL_END;
+                tag++) {
+            if (get_camera_metadata_tag_type(tag) == TYPE_INT32) {
+                ASSERT_EQ(settings.update(tag, &value, 1), OK);
+            }
+        }
+        CameraMetadata copy(settings);
+        ASSERT_EQ(copy.entryCount(), settings.entryCount());
+        ASSERT_EQ(copy.find(ANDROID_CONTROL_AE_EXPOSURE_COMPENSATION).count, 1u);
+        copyBuffer = copy.getAndLock();
+        copy.unlock(copyBuffer);
+    }
+    size_t entries = get_camera_metadata_entry_capacity(copyBuffer);
+    size_t data = get_camera_metadata_data_capacity(copyBuffer);
+    camera_metadata_t *first = allocate_pooled_camera_metadata(pool, entries, data);
+    camera_metadata_t *second = allocate_pooled_camera_metadata(pool, entries, data);
+    ASSERT_TRUE(first == copyBuffer || second == copyBuffer);
+    free_pooled_camera_metadata(pool, first);
+    free_pooled_camera_metadata(pool, second);
+
+    destroy_camera_metadata_pool(pool);
+}
+
+TEST(CameraMetadataTest, updateBatch) {
+
+    CameraMetadata settings;
+    uint8_t aeMode = ANDROID_CONTROL_AE_MODE_ON;
+    ASSERT_EQ(settings.update(ANDROID_CONTROL_AE_MODE, &aeMode, 1), OK);
+
+    int64_t exposure = 33000000;
+    int32_t fpsRange[2] = { 15, 30 };
+    uint8_t offMode = ANDROID_CONTROL_AE_MODE_OFF;
+    CameraMetadata::Update updates[] = {
+        { ANDROID_SENSOR_EXPOSURE_TIME, TYPE_INT64, &exposure, 1 },
+        { ANDROID_CONTROL_AE_TARGET_FPS_RANGE, TYPE_INT32, fpsRange, 2 },
+        { ANDROID_CONTROL_AE_MODE, TYPE_BYTE, &offMode, 1 },
+    };
+    ASSERT_EQ(settings.updateBatch(updates, 3), OK);
+    ASSERT_EQ(settings.entryCount(), 3u);
+    ASSERT_EQ(settings.find(ANDROID_SENSOR_EXPOSURE_TIME).data.i64[0], exposure);
+    ASSERT_EQ(settings.find(ANDROID_CONTROL_AE_TARGET_FPS_RANGE).data.i32[1], 30);
+    ASSERT_EQ(settings.find(ANDROID_CONTROL_AE_MODE).data.u8[0], offMode);
+
+    // a type mismatch fails the whole batch
+    int32_t jpegQuality = 90;
+    CameraMetadata::Update bad[] = {
+        { ANDROID_SENSOR_EXPOSURE_TIME, TYPE_INT64, &exposure, 1 },
+        { ANDROID_JPEG_QUALITY, TYPE_INT32, &jpegQuality, 1 },
+    };
+    ASSERT_NE(settings.updateBatch(bad, 2), OK);
+    ASSERT_EQ(settings.entryCount(), 3u);
+
+    // entries of another buffer
+    CameraMetadata other;
+    fpsRange[0] = 30;
+    ASSERT_EQ(other.update(ANDROID_CONTROL_AE_TARGET_FPS_RANGE, fpsRange, 2), OK);
+    const camera_metadata_t *buffer = other.getAndLock();
+    ASSERT_EQ(settings.updateBatch(buffer), OK);
+    other.unlock(buffer);
+    ASSERT_EQ(settings.find(ANDROID_CONTROL_AE_TARGET_FPS_RANGE).data.i32[0], 30);
+}
+
+TEST(CameraMetadataTest, metadataView) {
+
+    CameraMetadata result;
+    uint8_t aeState = ANDROID_CONTROL_AE_STATE_CONVERGED;
+    int64_t timestamp = 123456789;
+    ASSERT_EQ(result.update(ANDROID_CONTROL_AE_STATE, &aeState, 1), OK);
+    ASSERT_EQ(result.update(ANDROID_SENSOR_TIMESTAMP, &timestamp, 1), OK);
+    const camera_metadata_t *buffer = result.getAndLock();
+
+    CameraMetadataView view(buffer);
+    ASSERT_EQ(view.entryCount(), 2u);
+    int64_t value = 0;
+    ASSERT_TRUE(view.get(ANDROID_SENSOR_TIMESTAMP, &value));
+    ASSERT_EQ(value, timestamp);
+    // the wrong type or a missing tag do not give a value
+    int32_t wrongType;
+    ASSERT_FALSE(view.get(ANDROID_SENSOR_TIMESTAMP, &wrongType));
+    ASSERT_FALSE(view.get(ANDROID_SENSOR_EXPOSURE_TIME, &value));
+
+    // prefetched entries point into the buffer, missing ones are remembered
+    const uint32_t tags[] = { ANDROID_CONTROL_AE_STATE, ANDROID_CONTROL_AF_STATE };
+    view.prefetch(tags, 2);
+    size_t count;
+    const uint8_t *state = view.find<uint8_t>(ANDROID_CONTROL_AE_STATE, &count);
+    ASSERT_EQ(count, 1u);
+    ASSERT_EQ(*state, aeState);
+    ASSERT_EQ(view.find(ANDROID_CONTROL_AF_STATE).count, 0u);
+    ASSERT_EQ(view.find(ANDROID_SENSOR_TIMESTAMP).count, 1u);
+
+    result.unlock(buffer);
+}
+
+TEST(CameraMetadataTest, tagTraits) {
+
+    // the traits agree with the tag info tables
+    std::set<uint32_t> listed;
+#define CHECK_TAG_TYPE(tag, T) \
+    ASSERT_EQ(get_camera_metadata_tag_type(tag), (int)TagTraits<tag>::typeId); \
+    listed.insert(tag);
+    CAMERA_METADATA_TAG_TYPES(CHECK_TAG_TYPE)
+#undef CHECK_TAG_TYPE
+
+    // and the hand kept list has every tag of the tables
+    for (uint32_t section = 0; section < ANDROID_SECTION_COUNT; section++) {
+        for (uint32_t tag = camera_metadata_section_bounds[section][0];
+                tag < camera_metadata_section_bounds[section][1]; tag++) {
+            EXPECT_TRUE(listed.count(tag) != 0)
+                    << "tag " << get_camera_metadata_tag_name(tag)
+                    << " is missing from CAMERA_METADATA_TAG_TYPES";
+        }
+    }
+
+    CameraMetadata settings;
+    int64_t exposure = 33000000;
+    int32_t fpsRange[2] = { 15, 30 };
+    ASSERT_EQ(settings.update<ANDROID_SENSOR_EXPOSURE_TIME>(&exposure, 1), OK);
+    ASSERT_EQ(settings.update<ANDROID_CONTROL_AE_TARGET_FPS_RANGE>(fpsRange, 2), OK);
+    fpsRange[0] = 30;
+    ASSERT_EQ(settings.update<ANDROID_CONTROL_AE_TARGET_FPS_RANGE>(fpsRange, 2), OK);
+
+    size_t count;
+    const int64_t *exposures = settings.get<ANDROID_SENSOR_EXPOSURE_TIME>(&count);
+    ASSERT_EQ(count, 1u);
+    ASSERT_EQ(exposures[0], exposure);
+    const int32_t *range = settings.get<ANDROID_CONTROL_AE_TARGET_FPS_RANGE>(&count);
+    ASSERT_EQ(count, 2u);
+    ASSERT_EQ(range[0], 30);
+    ASSERT_TRUE(settings.get<ANDROID_CONTROL_AE_MODE>(&count) == NULL);
+    ASSERT_EQ(count, 0u);
+}
+
+static void countChange(void *user, int change,
+        const camera_metadata_ro_entry_t *a,
+        const camera_metadata_ro_entry_t *b) {
+    int *changes = static_cast<int*>(user);
+    changes[change]++;
+    // the entries of a tag are given where they exist
+    ASSERT_EQ(a == NULL, change == CAMERA_METADATA_ENTRY_ADDED);
+    ASSERT_EQ(b == NULL, change == CAMERA_METADATA_ENTRY_REMOVED);
+}
+
+TEST(CameraMetadataTest, diffAndDirtyTags) {
+
+    CameraMetadata before;
+    uint8_t aeMode = ANDROID_CONTROL_AE_MODE_ON;
+    int32_t fpsRange[2] = { 15, 30 };
+    int64_t exposure = 33000000;
+    ASSERT_EQ(before.update(ANDROID_CONTROL_AE_MODE, &aeMode, 1), OK);
+    ASSERT_EQ(before.update(ANDROID_CONTROL_AE_TARGET_FPS_RANGE, fpsRange, 2), OK);
+    ASSERT_EQ(before.update(ANDROID_SENSOR_EXPOSURE_TIME, &exposure, 1), OK);
+    ASSERT_TRUE(before.isDirty(ANDROID_CONTROL_AE_MODE));
+
+    // updates to the values an entry already has change nothing
+    CameraMetadata after(before);
+    ASSERT_FALSE(after.isDirty());
+    ASSERT_EQ(after.update(ANDROID_CONTROL_AE_MODE, &aeMode, 1), OK);
+    ASSERT_FALSE(after.isDirty());
+
+    fpsRange[0] = 30;
+    uint8_t quality = 90;
+    ASSERT_EQ(after.update(ANDROID_CONTROL_AE_TARGET_FPS_RANGE, fpsRange, 2), OK);
+    ASSERT_EQ(after.erase(ANDROID_SENSOR_EXPOSURE_TIME), OK);
+    ASSERT_EQ(after.update(ANDROID_JPEG_QUALITY, &quality, 1), OK);
+    ASSERT_TRUE(after.isDirty());
+    ASSERT_TRUE(after.isDirty(ANDROID_CONTROL_AE_TARGET_FPS_RANGE));
+    ASSERT_TRUE(after.isDirty(ANDROID_SENSOR_EXPOSURE_TIME));
+    ASSERT_FALSE(after.isDirty(ANDROID_CONTROL_AE_MODE));
+    after.clearDirty();
+    ASSERT_FALSE(after.isDirty());
+
+    // unsorted and sorted buffers give the same differences
+    for (int sorted = 0; sorted < 2; sorted++) {
+        if (sorted) {
+            ASSERT_EQ(before.sort(), OK);
+            ASSERT_EQ(after.sort(), OK);
+        }
+        const camera_metadata_t *a = before.getAndLock();
+        const camera_metadata_t *b = after.getAndLock();
+        int changes[3] = { 0, 0, 0 };
+        ASSERT_EQ(diff_camera_metadata(a, b, countChange, changes), 3);
+        ASSERT_EQ(changes[CAMERA_METADATA_ENTRY_ADDED], 1);
+        ASSERT_EQ(changes[CAMERA_METADATA_ENTRY_REMOVED], 1);
+        ASSERT_EQ(changes[CAMERA_METADATA_ENTRY_CHANGED], 1);
+        ASSERT_EQ(diff_camera_metadata(a, a, NULL, NULL), 0);
+        before.unlock(a);
+        after.unlock(b);
+    }
+}
+
+TEST(CameraMetadataTest, erasedEntries) {
+
+    camera_metadata_t *meta = allocate_camera_metadata(32, 256);
+    ASSERT_TRUE(meta != NULL);
+    int64_t values[2] = { 1, 2 };
+    const uint32_t int64Tags[] = {
+        ANDROID_SENSOR_EXPOSURE_TIME,
+        ANDROID_SENSOR_FRAME_DURATION,
+        ANDROID_SENSOR_ROLLING_SHUTTER_SKEW,
+        ANDROID_SENSOR_TIMESTAMP,
+    };
+    for (size_t i = 0; i < 4; i++) {
+        ASSERT_EQ(add_camera_metadata_entry(meta, int64Tags[i], values, 2), 0);
+    }
+    ASSERT_EQ(sort_camera_metadata(meta), 0);
+    camera_metadata_entry_t entry;
+    ASSERT_EQ(find_camera_metadata_entry(meta, int64Tags[3], &entry), 0);
+
+    // erased entries stay as tombstones, which lookups and iterations skip
+    ASSERT_EQ(find_camera_metadata_entry(meta, int64Tags[1], &entry), 0);
+    ASSERT_EQ(erase_camera_metadata_entry(meta, entry.index), 0);
+    ASSERT_EQ(get_camera_metadata_entry_count(meta), 4u);
+    ASSERT_EQ(get_camera_metadata_tombstone_count(meta), 1u);
+    ASSERT_EQ(find_camera_metadata_entry(meta, int64Tags[1], &entry), -ENOENT);
+    size_t live = 0;
+    for (size_t i = 0; i < get_camera_metadata_entry_count(meta); i++) {
+        if (get_camera_metadata_entry(meta, i, &entry) == 0) {
+            ASSERT_NE(entry.tag, int64Tags[1]);
+            live++;
+        }
+    }
+    ASSERT_EQ(live, 3u);
+    ASSERT_EQ(validate_camera_metadata_structure(meta, NULL), 0);
+    ASSERT_EQ(find_camera_metadata_entry(meta, int64Tags[3], &entry), 0);
+    ASSERT_EQ(entry.data.i64[1], values[1]);
+
+    // compacting reclaims the entry and its data, and keeps the sorting
+    size_t dataCount = get_camera_metadata_data_count(meta);
+    ASSERT_EQ(compact_camera_metadata(meta), 0);
+    ASSERT_EQ(get_camera_metadata_entry_count(meta), 3u);
+    ASSERT_EQ(get_camera_metadata_tombstone_count(meta), 0u);
+    ASSERT_LT(get_camera_metadata_data_count(meta), dataCount);
+    for (size_t i = 0; i < 3; i++) {
+        ASSERT_EQ(get_camera_metadata_entry(meta, i, &entry), 0);
+        ASSERT_EQ(entry.data.i64[0], values[0]);
+        if (i > 0) {
+            camera_metadata_entry_t previous;
+            get_camera_metadata_entry(meta, i - 1, &previous);
+            ASSERT_LT(previous.tag, entry.tag);
+        }
+    }
+    ASSERT_EQ(validate_camera_metadata_structure(meta, NULL), 0);
+
+    // tombstones outnumbering the live entries compact the packet
+    ASSERT_EQ(erase_camera_metadata_entry(meta, 0), 0);
+    ASSERT_EQ(get_camera_metadata_tombstone_count(meta), 1u);
+    ASSERT_EQ(erase_camera_metadata_entry(meta, 1), 0);
+    ASSERT_EQ(get_camera_metadata_tombstone_count(meta), 0u);
+    ASSERT_EQ(get_camera_metadata_entry_count(meta), 1u);
+    free_camera_metadata(meta);
+
+    // CameraMetadata hands out compacted buffers
+    CameraMetadata settings;
+    for (size_t i = 0; i < 4; i++) {
+        ASSERT_EQ(settings.update(int64Tags[i], values, 2), OK);
+    }
+    ASSERT_EQ(settings.erase(int64Tags[0]), OK);
+    ASSERT_EQ(settings.entryCount(), 3u);
+    ASSERT_FALSE(settings.exists(int64Tags[0]));
+    const camera_metadata_t *buffer = settings.getAndLock();
+    ASSERT_EQ(get_camera_metadata_tombstone_count(buffer), 0u);
+    ASSERT_EQ(get_camera_metadata_entry_count(buffer), 3u);
+    settings.unlock(buffer);
+}
+
+TEST(CameraMetadataTest, readOnlyLookups) {
+
+    camera_metadata_t *meta = allocate_camera_metadata(32, 256);
+    ASSERT_TRUE(meta != NULL);
+    int32_t values[2] = { 1, 2 };
+    const uint32_t int32Tags[] = {
+        ANDROID_CONTROL_AE_REGIONS,
+        ANDROID_CONTROL_AE_TARGET_FPS_RANGE,
+        ANDROID_CONTROL_AF_REGIONS,
+        ANDROID_JPEG_ORIENTATION,
+    };
+    for (size_t i = 0; i < 4; i++) {
+        ASSERT_EQ(add_camera_metadata_entry(meta, int32Tags[i], values, 2), 0);
+    }
+    ASSERT_EQ(sort_camera_metadata(meta), 0);
+
+    // a copy in read-only memory, as if mapped from a cache file
+    size_t size = get_camera_metadata_size(meta);
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(map, MAP_FAILED);
+    memcpy(map, meta, size);
+    ASSERT_EQ(mprotect(map, size, PROT_READ), 0);
+    free_camera_metadata(meta);
+
+    const camera_metadata_t *mapped = static_cast<const camera_metadata_t *>(map);
+    size_t mappedSize = size;
+    ASSERT_EQ(validate_camera_metadata_structure(mapped, &mappedSize), 0);
+    camera_metadata_ro_entry_t entry;
+    for (size_t i = 0; i < 4; i++) {
+        ASSERT_EQ(find_camera_metadata_ro_entry(mapped, int32Tags[i], &entry), 0);
+        ASSERT_EQ(entry.count, 2u);
+        ASSERT_EQ(entry.data.i32[1], values[1]);
+    }
+    ASSERT_NE(find_camera_metadata_ro_entry(mapped, ANDROID_JPEG_QUALITY, &entry), 0);
+    size_t count;
+    ASSERT_TRUE(CameraMetadataView(mapped).find<int32_t>(int32Tags[2], &count) != NULL);
+    ASSERT_EQ(count, 2u);
+    munmap(map, size);
+}
+
+TEST(CameraMetadataTest, sharedSnapshots) {
+
+    CameraMetadata metadata;
+    int32_t fps[2] = { 30, 30 };
+    ASSERT_EQ(metadata.update(ANDROID_CONTROL_AE_TARGET_FPS_RANGE, fps, 2), OK);
+
+    // snapshots take the buffer without copying, and copies share it
+    const camera_metadata_t *buffer = metadata.getAndLock();
+    metadata.unlock(buffer);
+    sp<CameraMetadataSnapshot> snapshot = CameraMetadataSnapshot::acquire(metadata);
+    ASSERT_TRUE(metadata.isEmpty());
+    ASSERT_EQ(snapshot->buffer(), buffer);
+    sp<CameraMetadataSnapshot> copy = snapshot;
+    ASSERT_EQ(copy->buffer(), buffer);
+    ASSERT_EQ(snapshot->entryCount(), 1u);
+
+    CameraMetadataPublisher publisher;
+    ASSERT_TRUE(publisher.current() != NULL);
+    ASSERT_TRUE(publisher.current()->isEmpty());
+    publisher.publish(snapshot);
+    ASSERT_EQ(publisher.current()->buffer(), buffer);
+
+    // readers see one of the published versions, never a freed one
+    bool stop = false;
+    std::thread writer([&publisher, &stop] {
+        for (int32_t i = 0; i < 1000; i++) {
+            CameraMetadata next;
+            int32_t range[2] = { i, i };
+            next.update(ANDROID_CONTROL_AE_TARGET_FPS_RANGE, range, 2);
+            publisher.publish(CameraMetadataSnapshot::acquire(next));
+        }
+        __atomic_store_n(&stop, true, __ATOMIC_SEQ_CST);
+    });
+    size_t torn = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_SEQ_CST)) {
+        sp<CameraMetadataSnapshot> current = publisher.current();
+        size_t count;
+        const int32_t *range = CameraMetadataView(current->buffer()).find<int32_t>(
+                ANDROID_CONTROL_AE_TARGET_FPS_RANGE, &count);
+        if (range == NULL || count != 2 || range[0] != range[1]) {
+            torn++;
+        }
+    }
+    writer.join();
+    ASSERT_EQ(torn, 0u);
+    ASSERT_EQ(snapshot->buffer(), buffer);
+    ASSERT_EQ(snapshot->getStrongCount(), 2);
+}
+
+static const uint32_t sVendorTags[] = {
+    (uint32_t)VENDOR_SECTION_START,
+    (uint32_t)VENDOR_SECTION_START + 1
+};
+
+static int getVendorTagCount(const vendor_tag_ops_t *) {
+    return 2;
+}
+
+static void getAllVendorTags(const vendor_tag_ops_t *, uint32_t *tags) {
+    memcpy(tags, sVendorTags, sizeof(sVendorTags));
+}
+
+static const char *getVendorSectionName(const vendor_tag_ops_t *, uint32_t) {
+    return "com.intel.test";
+}
+
+static const char *getVendorTagName(const vendor_tag_ops_t *, uint32_t tag) {
+    return (tag == sVendorTags[0]) ? "first" : "second";
+}
+
+static int getVendorTagType(const vendor_tag_ops_t *, uint32_t) {
+    return TYPE_INT32;
+}
+
+TEST(CameraMetadataTest, tagsByName) {
+
+    // every android tag is found by its full name
+    char name[128];
+    uint32_t tag;
+    size_t tagCount = 0;
+    for (uint32_t section = 0; section < ANDROID_SECTION_COUNT; section++) {
+        for (uint32_t t = section << 16; get_camera_metadata_tag_name(t) != NULL; t++) {
+            snprintf(name, sizeof(name), "%s.%s",
+                    get_camera_metadata_section_name(t),
+                    get_camera_metadata_tag_name(t));
+            ASSERT_EQ(find_camera_metadata_tag(name, &tag), 0) << name;
+            ASSERT_EQ(tag, t);
+            tagCount++;
+        }
+    }
+    ASSERT_GT(tagCount, 200u);
+    ASSERT_EQ(find_camera_metadata_tag("android.control.aeMode", &tag), 0);
+    ASSERT_EQ(tag, (uint32_t)ANDROID_CONTROL_AE_MODE);
+
+    // partial, unknown and misspelled names are not
+    ASSERT_EQ(find_camera_metadata_tag("android.control", &tag), -ENOENT);
+    ASSERT_EQ(find_camera_metadata_tag("android.control.aeMod", &tag), -ENOENT);
+    ASSERT_EQ(find_camera_metadata_tag("android.control.aeModes", &tag), -ENOENT);
+    ASSERT_EQ(find_camera_metadata_tag("", &tag), -ENOENT);
+    ASSERT_EQ(find_camera_metadata_tag("com.intel.test.first", &tag), -ENOENT);
+
+    // vendor tags are found through the vendor tag ops
+    vendor_tag_ops_t ops;
+    memset(&ops, 0, sizeof(ops));
+    ops.get_tag_count = getVendorTagCount;
+    ops.get_all_tags = getAllVendorTags;
+    ops.get_section_name = getVendorSectionName;
+    ops.get_tag_name = getVendorTagName;
+    ops.get_tag_type = getVendorTagType;
+    ASSERT_EQ(set_camera_metadata_vendor_ops(&ops), 0);
+    ASSERT_EQ(find_camera_metadata_tag("com.intel.test.second", &tag), 0);
+    ASSERT_EQ(tag, sVendorTags[1]);
+    ASSERT_EQ(find_camera_metadata_tag("com.intel.test.first", &tag), 0);
+    ASSERT_EQ(tag, sVendorTags[0]);
+    ASSERT_EQ(find_camera_metadata_tag("android.control.aeMode", &tag), 0);
+    ASSERT_EQ(set_camera_metadata_vendor_ops(NULL), 0);
+    ASSERT_EQ(find_camera_metadata_tag("com.intel.test.first", &tag), -ENOENT);
+}
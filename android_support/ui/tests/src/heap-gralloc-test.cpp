@@ -18,13 +18,26 @@
 #define LOG_TAG "libui-test"
 
 #include <utils/Log.h>
+#include <cutils/ashmem.h>
+#include <framecopy/framecopy.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "ui/Fence.h"
 #include "ui/GraphicBufferAllocator.h"
 #include "ui/GraphicBufferMapper.h"
 #include "ui/GraphicBuffer.h"
 #include "ui/Rect.h"
+#include "gralloc_priv.h"
 
 using namespace android;
 
+extern gralloc_module_t GRALLOC_HAL_MODULE_INFO_SYM;
+
 TEST(HeapGrallocTest, allocateGraphicBuffer) {
 
     GraphicBufferAllocator &gba = GraphicBufferAllocator::get();
@@ -113,3 +126,429 @@ TEST(HeapGrallocTest, GraphicBufferTest) {
     ALOGD("test GraphicBufferTest  END-----");
 }
 
+TEST(HeapGrallocTest, recycleBuffer) {
+
+    GraphicBufferAllocator &gba = GraphicBufferAllocator::get();
+    GraphicBufferMapper &gbm = GraphicBufferMapper::get();
+    buffer_handle_t handle;
+    Rect bounds(64,64);
+    uint32_t stride;
+    void* first;
+    void* second;
+
+    status_t status = gba.alloc(64,64,PIXEL_FORMAT_RGBA_8888,0,&handle, &stride);
+    ASSERT_EQ(status, OK);
+    ASSERT_EQ(gbm.lock(handle,0,bounds,&first), OK);
+    gbm.unlock(handle);
+    ASSERT_EQ(gba.free(handle), OK);
+
+    // the same size and usage gets the parked buffer back
+    status = gba.alloc(64,64,PIXEL_FORMAT_RGBA_8888,0,&handle, &stride);
+    ASSERT_EQ(status, OK);
+    ASSERT_EQ(gbm.lock(handle,0,bounds,&second), OK);
+    gbm.unlock(handle);
+    ASSERT_EQ(first, second);
+    ASSERT_EQ(gba.free(handle), OK);
+}
+
+TEST(HeapGrallocTest, sharedMapping) {
+
+    GraphicBufferAllocator &gba = GraphicBufferAllocator::get();
+    GraphicBufferMapper &gbm = GraphicBufferMapper::get();
+    buffer_handle_t handle;
+    Rect bounds(64,64);
+    uint32_t stride;
+    void* address;
+
+    status_t status = gba.alloc(64,64,PIXEL_FORMAT_RGBA_8888,0,&handle, &stride);
+    ASSERT_EQ(status, OK);
+    ASSERT_EQ(gbm.lock(handle,0,bounds,&address), OK);
+
+    // an import of the same fd gets the existing mapping
+    int fd = dup(handle->data[0]);
+    buffer_handle_t imported;
+    void* importedAddress;
+    status = GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_MAP_FD, &imported, &importedAddress, fd, (size_t)64 * 64 * 4,
+            64, 64, 64, PIXEL_FORMAT_RGBA_8888, 0);
+    ASSERT_EQ(status, 0);
+    ASSERT_EQ(importedAddress, address);
+
+    // and the mapping outlives the import
+    GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_UNMAP_FD, &imported);
+    close(fd);
+    ((uint8_t*)address)[0] = 0x5a;
+    ASSERT_EQ(((uint8_t*)address)[0], 0x5a);
+
+    gbm.unlock(handle);
+    ASSERT_EQ(gba.free(handle), OK);
+}
+
+TEST(HeapGrallocTest, unregisterLockedBuffer) {
+
+    GraphicBufferAllocator &gba = GraphicBufferAllocator::get();
+    GraphicBufferMapper &gbm = GraphicBufferMapper::get();
+    buffer_handle_t handle;
+    Rect bounds(64,64);
+    uint32_t stride;
+    void* address;
+
+    ASSERT_EQ(gba.alloc(64,64,PIXEL_FORMAT_RGBA_8888,0,&handle, &stride), OK);
+    ASSERT_EQ(gbm.lock(handle,0,bounds,&address), OK);
+
+    // dropping the mapping of the allocation leaves the lock mapped
+    ASSERT_EQ(gbm.unregisterBuffer(handle), OK);
+    const private_handle_t* hnd = static_cast<const private_handle_t*>(handle);
+    ASSERT_EQ((void*)hnd->base, address);
+    ((uint8_t*)address)[0] = 0x5a;
+    ASSERT_EQ(((uint8_t*)address)[0], 0x5a);
+
+    // until it is unlocked
+    ASSERT_EQ(gbm.unlock(handle), OK);
+    ASSERT_EQ(hnd->base, 0u);
+    ASSERT_EQ(gba.free(handle), OK);
+}
+
+TEST(HeapGrallocTest, pinnedBuffer) {
+
+    GraphicBufferAllocator &gba = GraphicBufferAllocator::get();
+    buffer_handle_t handle;
+    uint32_t stride;
+    size_t before, pinned, after;
+
+    ASSERT_EQ(GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_GET_PINNED_SIZE, &before), 0);
+
+    status_t status = gba.alloc(64,64,PIXEL_FORMAT_RGBA_8888,GRALLOC_USAGE_PIN,
+                                &handle, &stride);
+    ASSERT_EQ(status, OK);
+    GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_GET_PINNED_SIZE, &pinned);
+    ASSERT_GE(pinned, before + 64 * 64 * 4);
+
+    // parked buffers stay pinned until the pool lets them go
+    ASSERT_EQ(gba.free(handle), OK);
+    GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_TRIM_POOL, (size_t)0);
+    GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_GET_PINNED_SIZE, &after);
+    ASSERT_EQ(after, before);
+}
+
+TEST(HeapGrallocTest, ashmemRegionSize) {
+
+    const size_t size = 3 * 4096;
+    int fd = ashmem_create_region("test-region", size);
+    ASSERT_GE(fd, 0);
+
+    // the size must be known without any hints from the creator
+    ASSERT_GE(ashmem_get_size_region(fd), (int)size);
+
+    uint8_t *address = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED, fd, 0);
+    ASSERT_NE(address, MAP_FAILED);
+    address[size - 1] = 0xa5;
+    ASSERT_EQ(address[size - 1], 0xa5);
+    munmap(address, size);
+
+    // regions have a fixed size
+    ASSERT_NE(ftruncate(fd, 2 * size), 0);
+    close(fd);
+}
+
+TEST(HeapGrallocTest, fenceSignal) {
+
+    sp<Fence> f1 = Fence::create();
+    sp<Fence> f2 = Fence::create();
+    ASSERT_TRUE(f1->isValid());
+    ASSERT_TRUE(f2->isValid());
+    ASSERT_EQ(f1->wait(0), -ETIME);
+    ASSERT_EQ(f1->getSignalTime(), INT64_MAX);
+
+    sp<Fence> merged = Fence::merge(String8("test-merge"), f1, f2);
+    ASSERT_TRUE(merged->isValid());
+
+    ASSERT_EQ(f1->signal(), OK);
+    ASSERT_EQ(f1->wait(0), OK);
+    nsecs_t signalTime = f1->getSignalTime();
+    ASSERT_GT(signalTime, 0);
+    ASSERT_NE(signalTime, INT64_MAX);
+    ASSERT_EQ(merged->wait(10), -ETIME);
+
+    // the signal time is carried by the fd
+    sp<Fence> copy = new Fence(f1->dup());
+    ASSERT_EQ(copy->getSignalTime(), signalTime);
+
+    ASSERT_EQ(f2->signal(), OK);
+    ASSERT_EQ(merged->wait(1000), OK);
+    ASSERT_EQ(merged->getSignalTime(), f2->getSignalTime());
+
+    // dups signaled at once keep a single signal time, not the sum of them
+    for (int round = 0; round < 100; round++) {
+        sp<Fence> fence = Fence::create();
+        std::vector<sp<Fence> > dups;
+        for (int i = 0; i < 4; i++)
+            dups.push_back(new Fence(fence->dup()));
+        std::atomic<int> ready(0);
+        nsecs_t before = systemTime(SYSTEM_TIME_MONOTONIC);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < dups.size(); i++) {
+            threads.push_back(std::thread([&dups, &ready, i] {
+                // start the signals together
+                ready++;
+                while (ready < (int)dups.size())
+                    std::this_thread::yield();
+                dups[i]->signal();
+            }));
+        }
+        for (size_t i = 0; i < threads.size(); i++)
+            threads[i].join();
+        nsecs_t after = systemTime(SYSTEM_TIME_MONOTONIC);
+        ASSERT_GE(fence->getSignalTime(), before);
+        ASSERT_LE(fence->getSignalTime(), after);
+    }
+}
+
+TEST(HeapGrallocTest, lockAsync) {
+
+    GraphicBufferAllocator &gba = GraphicBufferAllocator::get();
+    GraphicBufferMapper &gbm = GraphicBufferMapper::get();
+    buffer_handle_t handle;
+    Rect bounds(32,32);
+    uint32_t stride;
+    void* address;
+
+    status_t status = gba.alloc(32,32,PIXEL_FORMAT_RGBA_8888,0,&handle, &stride);
+    ASSERT_EQ(status, OK);
+
+    // lockAsync takes the fence and returns once it has signaled
+    sp<Fence> fence = Fence::create();
+    fence->signal();
+    status = gbm.lockAsync(handle, GRALLOC_USAGE_SW_WRITE_OFTEN, bounds,
+                           &address, fence->dup());
+    ASSERT_EQ(status, OK);
+    ASSERT_NE(address, (void*)NULL);
+
+    int releaseFence = 0;
+    ASSERT_EQ(gbm.unlockAsync(handle, &releaseFence), OK);
+    ASSERT_EQ(releaseFence, -1);
+
+    ASSERT_EQ(gba.free(handle), OK);
+}
+
+TEST(HeapGrallocTest, lockYCbCr) {
+
+    GraphicBufferAllocator &gba = GraphicBufferAllocator::get();
+    GraphicBufferMapper &gbm = GraphicBufferMapper::get();
+    buffer_handle_t handle;
+    Rect bounds(100,50);
+    uint32_t stride;
+    android_ycbcr ycbcr;
+
+    status_t status = gba.alloc(100,50,HAL_PIXEL_FORMAT_YCbCr_420_888,0,
+                                &handle, &stride);
+    ASSERT_EQ(status, OK);
+    // rows are aligned to 64 bytes by default
+    ASSERT_EQ(stride, 128u);
+
+    ASSERT_EQ(gbm.lockYCbCr(handle, GRALLOC_USAGE_SW_WRITE_OFTEN, bounds,
+                            &ycbcr), OK);
+    ASSERT_EQ(ycbcr.ystride, stride);
+    ASSERT_EQ(ycbcr.cstride, stride);
+    ASSERT_EQ(ycbcr.chroma_step, 2u);
+    ASSERT_EQ((uint8_t*)ycbcr.cb, (uint8_t*)ycbcr.y + stride * 50);
+    ASSERT_EQ((uint8_t*)ycbcr.cr, (uint8_t*)ycbcr.cb + 1);
+    ASSERT_EQ((uintptr_t)ycbcr.cb % 64, 0u);
+
+    // the last chroma byte is backed by memory
+    ((uint8_t*)ycbcr.cr)[stride * 24 + 98] = 0x5a;
+    ASSERT_EQ(gbm.unlock(handle), OK);
+
+    // rgb rows hold whole pixels
+    buffer_handle_t rgbHandle;
+    ASSERT_EQ(gba.alloc(30,2,PIXEL_FORMAT_RGB_888,0,&rgbHandle, &stride), OK);
+    ASSERT_EQ(stride * 3 % 64, 0u);
+    ASSERT_EQ(gbm.lockYCbCr(rgbHandle, 0, bounds, &ycbcr), -EINVAL);
+
+    ASSERT_EQ(gba.free(rgbHandle), OK);
+    ASSERT_EQ(gba.free(handle), OK);
+}
+
+TEST(HeapGrallocTest, dmaHeapBackend) {
+
+    GraphicBufferAllocator &gba = GraphicBufferAllocator::get();
+    GraphicBufferMapper &gbm = GraphicBufferMapper::get();
+    buffer_handle_t handle;
+    Rect bounds(64,64);
+    uint32_t stride;
+    void* address;
+    const char* selected = NULL;
+
+    // park an ashmem buffer
+    ASSERT_EQ(GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_SET_BACKEND, "ashmem", &selected), 0);
+    status_t status = gba.alloc(64,64,PIXEL_FORMAT_RGBA_8888,0,&handle, &stride);
+    ASSERT_EQ(status, OK);
+    const private_handle_t* parked = (const private_handle_t*)handle;
+    int parkedGeneration = parked->generation;
+    ASSERT_EQ(gba.free(handle), OK);
+
+    // machines without a dma heap or udmabuf get memfd buffers
+    ASSERT_EQ(GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_SET_BACKEND, "dmaheap", &selected), 0);
+    ASSERT_TRUE(strcmp(selected, "dmaheap") == 0 ||
+                strcmp(selected, "memfd") == 0);
+    ALOGD(" using %s buffers", selected);
+
+    // the same request must not get the parked ashmem buffer back
+    status = gba.alloc(64,64,PIXEL_FORMAT_RGBA_8888,0,&handle, &stride);
+    ASSERT_EQ(status, OK);
+    ASSERT_FALSE((const private_handle_t*)handle == parked &&
+                 parked->generation == parkedGeneration);
+
+    status = gbm.lock(handle, GRALLOC_USAGE_SW_WRITE_OFTEN, bounds, &address);
+    ASSERT_EQ(status, OK);
+    memset(address, 0xa5, stride * 64 * 4);
+    ASSERT_EQ(gbm.unlock(handle), OK);
+
+    status = gbm.lock(handle, GRALLOC_USAGE_SW_READ_OFTEN, bounds, &address);
+    ASSERT_EQ(status, OK);
+    ASSERT_EQ(((uint8_t*)address)[stride * 64 * 4 - 1], 0xa5);
+    ASSERT_EQ(gbm.unlock(handle), OK);
+
+    ASSERT_EQ(gba.free(handle), OK);
+    ASSERT_EQ(GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_SET_BACKEND, "nosuchbackend", &selected), -EINVAL);
+    ASSERT_EQ(GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_SET_BACKEND, "ashmem", &selected), 0);
+}
+
+TEST(HeapGrallocTest, handleSlab) {
+
+    GraphicBufferAllocator &gba = GraphicBufferAllocator::get();
+    GraphicBufferMapper &gbm = GraphicBufferMapper::get();
+    buffer_handle_t handle, handle2;
+    Rect bounds(64,64);
+    uint32_t stride;
+    void* address;
+
+    ASSERT_EQ(GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_RESERVE_HANDLES, (size_t)8), 0);
+
+    status_t status = gba.alloc(64,64,PIXEL_FORMAT_RGBA_8888,0,&handle, &stride);
+    ASSERT_EQ(status, OK);
+    int generation = ((const private_handle_t*)handle)->generation;
+    ASSERT_GT(generation, 0);
+
+    // the trim frees the parked handle into the slab
+    ASSERT_EQ(gba.free(handle), OK);
+    GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_TRIM_POOL, (size_t)0);
+    ASSERT_EQ(private_handle_t::validate(handle), -EINVAL);
+    ASSERT_NE(gbm.lock(handle, GRALLOC_USAGE_SW_READ_OFTEN, bounds, &address), OK);
+
+    // slots are reused oldest first, allocate until the freed one comes up
+    std::vector<buffer_handle_t> handles;
+    handle2 = NULL;
+    while (handle2 != handle && handles.size() < 1024) {
+        status = gba.alloc(16,16,PIXEL_FORMAT_RGBA_8888,0,&handle2, &stride);
+        ASSERT_EQ(status, OK);
+        handles.push_back(handle2);
+    }
+    ASSERT_EQ(handle2, handle);
+    int generation2 = ((const private_handle_t*)handle2)->generation;
+    ASSERT_GT(generation2, generation);
+
+    // the old pointer is a valid handle again, but not of its generation
+    ASSERT_EQ(private_handle_t::validate(handle), 0);
+    ASSERT_EQ(private_handle_t::validate(handle, generation), -EINVAL);
+    ASSERT_EQ(private_handle_t::validate(handle2, generation2), 0);
+    int current = 0;
+    ASSERT_EQ(GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_GET_GENERATION, &handle2, &current), 0);
+    ASSERT_EQ(current, generation2);
+
+    // references taken by an older generation of the slot are not the
+    // ones of the handle in it now
+    ASSERT_EQ(gbm.registerBuffer(handle2), OK);
+    ((private_handle_t*)handle2)->generation = generation2 + 1;
+    ASSERT_NE(gbm.lock(handle2, GRALLOC_USAGE_SW_READ_OFTEN, bounds, &address), OK);
+    ASSERT_NE(gbm.unlock(handle2), OK);
+    ASSERT_NE(gbm.unregisterBuffer(handle2), OK);
+    ((private_handle_t*)handle2)->generation = generation2;
+    ASSERT_EQ(gbm.unregisterBuffer(handle2), OK);
+
+    for (size_t i = 0; i < handles.size(); i++)
+        ASSERT_EQ(gba.free(handles[i]), OK);
+}
+
+TEST(HeapGrallocTest, allocatorStats) {
+
+    GraphicBufferAllocator &gba = GraphicBufferAllocator::get();
+    const uint32_t usage = GRALLOC_USAGE_SW_READ_RARELY;
+    buffer_handle_t handles[4];
+    uint32_t stride;
+
+    GraphicBufferAllocator::alloc_stats_t before = gba.getStats();
+    for (int i = 0; i < 4; i++) {
+        ASSERT_EQ(gba.alloc(64,64,PIXEL_FORMAT_RGBA_8888,usage,&handles[i],
+                            &stride), OK);
+    }
+
+    Vector<GraphicBufferAllocator::alloc_stats_t> perFormat;
+    GraphicBufferAllocator::alloc_stats_t stats = gba.getStats(&perFormat);
+    ASSERT_EQ(stats.count, before.count + 4);
+    ASSERT_EQ(stats.bytes, before.bytes + 4 * 64 * stride * 4);
+    ASSERT_GE(stats.maxBytes, stats.bytes);
+
+    bool found = false;
+    for (size_t i = 0; i < perFormat.size(); i++) {
+        if (perFormat[i].format == PIXEL_FORMAT_RGBA_8888 &&
+            perFormat[i].usage == usage) {
+            ASSERT_EQ(perFormat[i].count, 4u);
+            ASSERT_EQ(perFormat[i].maxBytes, 4 * 64 * stride * 4);
+            found = true;
+        }
+    }
+    ASSERT_TRUE(found);
+
+    for (int i = 0; i < 4; i++)
+        ASSERT_EQ(gba.free(handles[i]), OK);
+    stats = gba.getStats();
+    ASSERT_EQ(stats.count, before.count);
+    ASSERT_EQ(stats.bytes, before.bytes);
+}
+
+TEST(HeapGrallocTest, frameCopy) {
+
+    // large enough to be streamed, with an odd size and unaligned ends
+    const size_t size = 3 * 1024 * 1024 + 77;
+    std::vector<uint8_t> src(size + 1), dst(size + 2, 0);
+    for (size_t i = 0; i < src.size(); i++)
+        src[i] = i * 7 + (i >> 12);
+    frame_copy(&dst[1], &src[1], size);
+    ASSERT_EQ(dst[0], 0);
+    ASSERT_EQ(dst[size + 1], 0);
+    ASSERT_EQ(memcmp(&dst[1], &src[1], size), 0);
+
+    // padded source rows into tightly packed rows
+    const size_t width = 1921, height = 1080, srcStride = 1984;
+    std::vector<uint8_t> frame(srcStride * height), packed(width * height);
+    for (size_t i = 0; i < frame.size(); i++)
+        frame[i] = i * 13;
+    frame_copy_2d(&packed[0], width, &frame[0], srcStride, width, height);
+    for (size_t y = 0; y < height; y++)
+        ASSERT_EQ(memcmp(&packed[y * width], &frame[y * srcStride], width), 0);
+
+    // large enough for several stripes, twice to reuse the stripe threads
+    const size_t bigSize = 17 * 1024 * 1024 + 5;
+    std::vector<uint8_t> bigSrc(bigSize), bigDst(bigSize);
+    for (size_t i = 0; i < bigSize; i++)
+        bigSrc[i] = i * 3 + (i >> 16);
+    for (int pass = 0; pass < 2; pass++) {
+        std::fill(bigDst.begin(), bigDst.end(), 0);
+        frame_copy(&bigDst[0], &bigSrc[0], bigSize);
+        ASSERT_EQ(memcmp(&bigDst[0], &bigSrc[0], bigSize), 0);
+    }
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "Downscaler"
+
+#include "Downscaler.h"
+#include "SimdLevel.h"
+#include "LogHelper.h"
+#include <string.h>
+#include <algorithm>
+
+namespace icamera {
+
+// source bytes summed per column block, keeps the accumulators in L1
+static const int BLOCK_BYTES = 2048;
+// minimum number of output lines per stripe
+static const int MIN_STRIPE_HEIGHT = 16;
+// 16-bit accumulators overflow beyond this many source lines per output line,
+// and wider source spans would not fit in a column block
+static const int MAX_SCALE_RATIO = 257;
+
+/*****************************************************************************
+ * Vertical pass: acc[i] += src[i]
+ */
+static void accumulateLineC(uint16_t *acc, const uint8_t *src, int i, int count)
+{
+    for (; i < count; i++)
+        acc[i] += src[i];
+}
+
+#ifdef ICAMERA_SIMD_X86
+__attribute__((target("sse4.1")))
+static void accumulateLineSse41(uint16_t *acc, const uint8_t *src, int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i s = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(src + i)));
+        __m128i a = _mm_loadu_si128((const __m128i *)(acc + i));
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi16(a, s));
+    }
+    accumulateLineC(acc, src, i, count);
+}
+
+__attribute__((target("avx2")))
+static void accumulateLineAvx2(uint16_t *acc, const uint8_t *src, int count)
+{
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + i)));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi16(a, s));
+    }
+    accumulateLineC(acc, src, i, count);
+}
+#endif // ICAMERA_SIMD_X86
+
+static void accumulateLine(int simd, uint16_t *acc, const uint8_t *src, int count)
+{
+#ifdef ICAMERA_SIMD_X86
+    if (simd == SIMD_AVX2)
+        return accumulateLineAvx2(acc, src, count);
+    if (simd == SIMD_SSE41)
+        return accumulateLineSse41(acc, src, count);
+#endif
+    accumulateLineC(acc, src, 0, count);
+}
+
+/*****************************************************************************/
+
+/*
+ * first source pixel covered by output pixel i. As the output is never
+ * larger than the source, every output pixel covers at least one pixel.
+ */
+static inline int spanStart(int i, int srcSize, int dstSize)
+{
+    return (int64_t)i * srcSize / dstSize;
+}
+
+/*
+ * Box filters output lines [first, last) of a plane with channels
+ * interleaved samples per pixel (1 for luma, 2 for nv12 chroma).
+ */
+static void downscalePlane(int simd, const uint8_t *src, int srcStride,
+                           int srcWidth, int srcHeight,
+                           uint8_t *dst, int dstStride,
+                           int dstWidth, int dstHeight,
+                           int channels, int first, int last)
+{
+    uint16_t acc[BLOCK_BYTES];
+
+    for (int line = first; line < last; line++) {
+        int y0 = spanStart(line, srcHeight, dstHeight);
+        int y1 = spanStart(line + 1, srcHeight, dstHeight);
+        uint8_t *out = dst + line * dstStride;
+
+        int x = 0;
+        while (x < dstWidth) {
+            // take as many output pixels as fit in one column block
+            int blockStart = spanStart(x, srcWidth, dstWidth);
+            int blockEnd = x + 1;
+            while (blockEnd < dstWidth &&
+                   (spanStart(blockEnd + 1, srcWidth, dstWidth) - blockStart) *
+                   channels <= BLOCK_BYTES)
+                blockEnd++;
+            int bytes = (spanStart(blockEnd, srcWidth, dstWidth) - blockStart) *
+                        channels;
+
+            memset(acc, 0, bytes * sizeof(acc[0]));
+            for (int y = y0; y < y1; y++) {
+                accumulateLine(simd, acc,
+                               src + y * srcStride + blockStart * channels,
+                               bytes);
+            }
+
+            for (; x < blockEnd; x++) {
+                int x0 = spanStart(x, srcWidth, dstWidth);
+                int x1 = spanStart(x + 1, srcWidth, dstWidth);
+                uint32_t area = (x1 - x0) * (y1 - y0);
+                uint32_t reciprocal = (65536 + area / 2) / area;
+                const uint16_t *a = acc + (x0 - blockStart) * channels;
+                for (int c = 0; c < channels; c++) {
+                    uint32_t sum = 0;
+                    for (int i = 0; i < (x1 - x0) * channels; i += channels)
+                        sum += a[i + c];
+                    uint32_t value = (sum * reciprocal + 32768) >> 16;
+                    out[x * channels + c] = value > 255 ? 255 : value;
+                }
+            }
+        }
+    }
+}
+
+Downscaler::Downscaler(WorkerPool *pool) :
+    mPool(pool),
+    mSimdLevel(detectSimdLevel())
+{
+    LOG1("using %s downscaling kernels", simdLevelName(mSimdLevel));
+}
+
+status_t Downscaler::downscaleNv12(const uint8_t *srcY, const uint8_t *srcUV,
+                                   int srcStride, int srcWidth, int srcHeight,
+                                   void *dst, int dstStride,
+                                   int dstWidth, int dstHeight)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL2);
+
+    if (srcY == NULL || srcUV == NULL || dst == NULL)
+        return BAD_VALUE;
+
+    if (dstWidth <= 0 || dstHeight <= 0 || dstStride < dstWidth ||
+        dstWidth > srcWidth || dstHeight > srcHeight ||
+        dstWidth % 2 != 0 || dstHeight % 2 != 0 ||
+        srcHeight / dstHeight >= MAX_SCALE_RATIO ||
+        srcWidth / dstWidth >= MAX_SCALE_RATIO) {
+        LOGE("unsupported scaling %dx%d -> %dx%d",
+             srcWidth, srcHeight, dstWidth, dstHeight);
+        return BAD_VALUE;
+    }
+
+    int stripes = 1;
+    if (mPool != NULL)
+        stripes = std::max(1, std::min(mPool->size(), dstHeight / MIN_STRIPE_HEIGHT));
+    // even stripe heights, so that chroma lines are not shared
+    int stripeHeight = ((dstHeight + stripes - 1) / stripes + 1) & ~1;
+    stripes = (dstHeight + stripeHeight - 1) / stripeHeight;
+
+    int simd = mSimdLevel;
+    uint8_t *outY = static_cast<uint8_t *>(dst);
+    uint8_t *outUV = outY + dstStride * dstHeight;
+    auto job = [=](int stripe) {
+        int first = stripe * stripeHeight;
+        int last = std::min(dstHeight, first + stripeHeight);
+        downscalePlane(simd, srcY, srcStride, srcWidth, srcHeight,
+                       outY, dstStride, dstWidth, dstHeight,
+                       1, first, last);
+        downscalePlane(simd, srcUV, srcStride, srcWidth / 2, srcHeight / 2,
+                       outUV, dstStride, dstWidth / 2, dstHeight / 2,
+                       2, first / 2, last / 2);
+    };
+
+    if (stripes > 1)
+        mPool->parallelFor(stripes, job);
+    else
+        job(0);
+
+    return OK;
+}
+
+} // namespace icamera
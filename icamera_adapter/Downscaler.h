@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _DOWNSCALER_H_
+#define _DOWNSCALER_H_
+
+#include "Errors.h"
+#include "WorkerPool.h"
+#include <stdint.h>
+
+namespace icamera {
+
+/**
+ * \class Downscaler
+ *
+ * NV12 to NV12 downscaler used to produce the adapter's virtual streams
+ * from the HAL output. Every output pixel is the average of the source area
+ * it covers (box filter), which does not alias even at large ratios such as
+ * 4K to 640x360.
+ *
+ * Source lines are summed in column blocks that keep the accumulators in
+ * L1, with AVX2/SSE4.1 kernels for the summing, and output lines are split
+ * over a WorkerPool.
+ */
+class Downscaler {
+public:
+    explicit Downscaler(WorkerPool *pool);
+
+    /**
+     * \param srcY      start of the source luma plane
+     * \param srcUV     start of the source chroma plane
+     * \param srcStride bytes per line of both source planes
+     * \param dst       destination NV12 frame, the chroma lines following
+     *                  the luma lines, dstStride * dstHeight * 3 / 2 bytes
+     * \param dstStride bytes per line of both destination planes
+     */
+    status_t downscaleNv12(const uint8_t *srcY, const uint8_t *srcUV,
+                           int srcStride, int srcWidth, int srcHeight,
+                           void *dst, int dstStride,
+                           int dstWidth, int dstHeight);
+
+private:
+    WorkerPool *mPool;
+    int mSimdLevel;
+};
+
+} // namespace icamera
+
+#endif /* _DOWNSCALER_H_ */
@@ -0,0 +1,435 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FormatConverter"
+
+#include "FormatConverter.h"
+#include "SimdLevel.h"
+#include "LogHelper.h"
+#include <linux/videodev2.h>
+#include <string.h>
+#include <algorithm>
+
+#ifndef V4L2_PIX_FMT_RGBX32
+#define V4L2_PIX_FMT_RGBX32 v4l2_fourcc('X', 'B', '2', '4')
+#endif
+
+namespace icamera {
+
+// minimum number of lines per stripe, smaller frames are not worth splitting
+static const int MIN_STRIPE_HEIGHT = 32;
+
+/*
+ * BT.601 limited range YUV -> RGB in 16-bit fixed point. Every term is
+ * computed as ((x << 6) * coeff) >> 16, which is exactly what mulhi_epi16
+ * does, so all kernel variants give bit-identical output.
+ */
+static const int16_t COEFF_Y = 1192;   /* 1.164 * 1024 */
+static const int16_t COEFF_VR = 1634;  /* 1.596 * 1024 */
+static const int16_t COEFF_UG = -400;  /* -0.391 * 1024 */
+static const int16_t COEFF_VG = -832;  /* -0.813 * 1024 */
+static const int16_t COEFF_UB = 2066;  /* 2.018 * 1024 */
+
+static inline int mulhi(int x, int coeff)
+{
+    return (x * 64 * coeff) >> 16;
+}
+
+static inline uint8_t clamp8(int x)
+{
+    return x < 0 ? 0 : (x > 255 ? 255 : x);
+}
+
+/*****************************************************************************
+ * Scalar kernels, also used for the row tails of the SIMD kernels
+ */
+static void yuyvRowC(const uint8_t *srcY, const uint8_t *srcUV,
+                     uint8_t *dst, int x, int width)
+{
+    for (; x < width; x += 2) {
+        dst[2 * x + 0] = srcY[x];
+        dst[2 * x + 1] = srcUV[x];
+        dst[2 * x + 2] = srcY[x + 1];
+        dst[2 * x + 3] = srcUV[x + 1];
+    }
+}
+
+static void rgbxRowC(const uint8_t *srcY, const uint8_t *srcUV,
+                     uint8_t *dst, int x, int width)
+{
+    for (; x < width; x++) {
+        int y = mulhi(srcY[x] - 16, COEFF_Y);
+        int u = srcUV[x & ~1] - 128;
+        int v = srcUV[x | 1] - 128;
+        dst[4 * x + 0] = clamp8(y + mulhi(v, COEFF_VR));
+        dst[4 * x + 1] = clamp8(y + mulhi(u, COEFF_UG) + mulhi(v, COEFF_VG));
+        dst[4 * x + 2] = clamp8(y + mulhi(u, COEFF_UB));
+        dst[4 * x + 3] = 0xff;
+    }
+}
+
+static void splitUVRowC(const uint8_t *srcUV, uint8_t *dstU, uint8_t *dstV,
+                        int x, int chromaWidth)
+{
+    for (; x < chromaWidth; x++) {
+        dstU[x] = srcUV[2 * x];
+        dstV[x] = srcUV[2 * x + 1];
+    }
+}
+
+#ifdef ICAMERA_SIMD_X86
+/*****************************************************************************
+ * SSE4.1 kernels
+ */
+__attribute__((target("sse4.1")))
+static void yuyvRowSse41(const uint8_t *srcY, const uint8_t *srcUV,
+                         uint8_t *dst, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i y = _mm_loadu_si128((const __m128i *)(srcY + x));
+        __m128i uv = _mm_loadu_si128((const __m128i *)(srcUV + x));
+        _mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_unpacklo_epi8(y, uv));
+        _mm_storeu_si128((__m128i *)(dst + 2 * x + 16), _mm_unpackhi_epi8(y, uv));
+    }
+    yuyvRowC(srcY, srcUV, dst, x, width);
+}
+
+__attribute__((target("sse4.1")))
+static void rgbxRowSse41(const uint8_t *srcY, const uint8_t *srcUV,
+                         uint8_t *dst, int width)
+{
+    const __m128i uShuffle = _mm_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5,
+                                           8, 9, 8, 9, 12, 13, 12, 13);
+    const __m128i vShuffle = _mm_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7,
+                                           10, 11, 10, 11, 14, 15, 14, 15);
+    const __m128i c16 = _mm_set1_epi16(16);
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i cY = _mm_set1_epi16(COEFF_Y);
+    const __m128i cVR = _mm_set1_epi16(COEFF_VR);
+    const __m128i cUG = _mm_set1_epi16(COEFF_UG);
+    const __m128i cVG = _mm_set1_epi16(COEFF_VG);
+    const __m128i cUB = _mm_set1_epi16(COEFF_UB);
+    const __m128i alpha = _mm_set1_epi8((char)0xff);
+
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i y = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(srcY + x)));
+        __m128i uv = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(srcUV + x)));
+        y = _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(y, c16), 6), cY);
+        uv = _mm_slli_epi16(_mm_sub_epi16(uv, c128), 6);
+        __m128i u = _mm_shuffle_epi8(uv, uShuffle);
+        __m128i v = _mm_shuffle_epi8(uv, vShuffle);
+
+        __m128i r = _mm_add_epi16(y, _mm_mulhi_epi16(v, cVR));
+        __m128i g = _mm_add_epi16(y, _mm_add_epi16(_mm_mulhi_epi16(u, cUG),
+                                                   _mm_mulhi_epi16(v, cVG)));
+        __m128i b = _mm_add_epi16(y, _mm_mulhi_epi16(u, cUB));
+
+        __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+        __m128i bx = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), alpha);
+        _mm_storeu_si128((__m128i *)(dst + 4 * x), _mm_unpacklo_epi16(rg, bx));
+        _mm_storeu_si128((__m128i *)(dst + 4 * x + 16), _mm_unpackhi_epi16(rg, bx));
+    }
+    rgbxRowC(srcY, srcUV, dst, x, width);
+}
+
+__attribute__((target("sse4.1")))
+static void splitUVRowSse41(const uint8_t *srcUV, uint8_t *dstU, uint8_t *dstV,
+                            int chromaWidth)
+{
+    const __m128i split = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+                                        1, 3, 5, 7, 9, 11, 13, 15);
+    int x = 0;
+    for (; x + 8 <= chromaWidth; x += 8) {
+        __m128i uv = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(srcUV + 2 * x)), split);
+        _mm_storel_epi64((__m128i *)(dstU + x), uv);
+        _mm_storel_epi64((__m128i *)(dstV + x), _mm_srli_si128(uv, 8));
+    }
+    splitUVRowC(srcUV, dstU, dstV, x, chromaWidth);
+}
+
+/*****************************************************************************
+ * AVX2 kernels
+ *
+ * Most AVX2 byte operations work within 128-bit lanes, hence the
+ * permutes before storing.
+ */
+__attribute__((target("avx2")))
+static void yuyvRowAvx2(const uint8_t *srcY, const uint8_t *srcUV,
+                        uint8_t *dst, int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i y = _mm256_loadu_si256((const __m256i *)(srcY + x));
+        __m256i uv = _mm256_loadu_si256((const __m256i *)(srcUV + x));
+        __m256i lo = _mm256_unpacklo_epi8(y, uv);
+        __m256i hi = _mm256_unpackhi_epi8(y, uv);
+        _mm256_storeu_si256((__m256i *)(dst + 2 * x),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * x + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    yuyvRowC(srcY, srcUV, dst, x, width);
+}
+
+__attribute__((target("avx2")))
+static void rgbxRowAvx2(const uint8_t *srcY, const uint8_t *srcUV,
+                        uint8_t *dst, int width)
+{
+    const __m256i uShuffle = _mm256_setr_epi8(0, 1, 0, 1, 4, 5, 4, 5,
+                                              8, 9, 8, 9, 12, 13, 12, 13,
+                                              0, 1, 0, 1, 4, 5, 4, 5,
+                                              8, 9, 8, 9, 12, 13, 12, 13);
+    const __m256i vShuffle = _mm256_setr_epi8(2, 3, 2, 3, 6, 7, 6, 7,
+                                              10, 11, 10, 11, 14, 15, 14, 15,
+                                              2, 3, 2, 3, 6, 7, 6, 7,
+                                              10, 11, 10, 11, 14, 15, 14, 15);
+    const __m256i c16 = _mm256_set1_epi16(16);
+    const __m256i c128 = _mm256_set1_epi16(128);
+    const __m256i cY = _mm256_set1_epi16(COEFF_Y);
+    const __m256i cVR = _mm256_set1_epi16(COEFF_VR);
+    const __m256i cUG = _mm256_set1_epi16(COEFF_UG);
+    const __m256i cVG = _mm256_set1_epi16(COEFF_VG);
+    const __m256i cUB = _mm256_set1_epi16(COEFF_UB);
+    const __m256i alpha = _mm256_set1_epi8((char)0xff);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i y = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(srcY + x)));
+        __m256i uv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(srcUV + x)));
+        y = _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(y, c16), 6), cY);
+        uv = _mm256_slli_epi16(_mm256_sub_epi16(uv, c128), 6);
+        __m256i u = _mm256_shuffle_epi8(uv, uShuffle);
+        __m256i v = _mm256_shuffle_epi8(uv, vShuffle);
+
+        __m256i r = _mm256_add_epi16(y, _mm256_mulhi_epi16(v, cVR));
+        __m256i g = _mm256_add_epi16(y, _mm256_add_epi16(_mm256_mulhi_epi16(u, cUG),
+                                                         _mm256_mulhi_epi16(v, cVG)));
+        __m256i b = _mm256_add_epi16(y, _mm256_mulhi_epi16(u, cUB));
+
+        __m256i rg = _mm256_unpacklo_epi8(_mm256_packus_epi16(r, r),
+                                          _mm256_packus_epi16(g, g));
+        __m256i bx = _mm256_unpacklo_epi8(_mm256_packus_epi16(b, b), alpha);
+        __m256i lo = _mm256_unpacklo_epi16(rg, bx);
+        __m256i hi = _mm256_unpackhi_epi16(rg, bx);
+        _mm256_storeu_si256((__m256i *)(dst + 4 * x),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + 4 * x + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    rgbxRowC(srcY, srcUV, dst, x, width);
+}
+
+__attribute__((target("avx2")))
+static void splitUVRowAvx2(const uint8_t *srcUV, uint8_t *dstU, uint8_t *dstV,
+                           int chromaWidth)
+{
+    const __m256i split = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+                                           1, 3, 5, 7, 9, 11, 13, 15,
+                                           0, 2, 4, 6, 8, 10, 12, 14,
+                                           1, 3, 5, 7, 9, 11, 13, 15);
+    int x = 0;
+    for (; x + 16 <= chromaWidth; x += 16) {
+        __m256i uv = _mm256_loadu_si256((const __m256i *)(srcUV + 2 * x));
+        uv = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(uv, split),
+                                      _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)(dstU + x), _mm256_castsi256_si128(uv));
+        _mm_storeu_si128((__m128i *)(dstV + x), _mm256_extracti128_si256(uv, 1));
+    }
+    splitUVRowC(srcUV, dstU, dstV, x, chromaWidth);
+}
+#endif // ICAMERA_SIMD_X86
+
+/*****************************************************************************/
+
+static void yuyvRow(int simd, const uint8_t *srcY, const uint8_t *srcUV,
+                    uint8_t *dst, int width)
+{
+#ifdef ICAMERA_SIMD_X86
+    if (simd == SIMD_AVX2)
+        return yuyvRowAvx2(srcY, srcUV, dst, width);
+    if (simd == SIMD_SSE41)
+        return yuyvRowSse41(srcY, srcUV, dst, width);
+#endif
+    yuyvRowC(srcY, srcUV, dst, 0, width);
+}
+
+static void rgbxRow(int simd, const uint8_t *srcY, const uint8_t *srcUV,
+                    uint8_t *dst, int width)
+{
+#ifdef ICAMERA_SIMD_X86
+    if (simd == SIMD_AVX2)
+        return rgbxRowAvx2(srcY, srcUV, dst, width);
+    if (simd == SIMD_SSE41)
+        return rgbxRowSse41(srcY, srcUV, dst, width);
+#endif
+    rgbxRowC(srcY, srcUV, dst, 0, width);
+}
+
+static void splitUVRow(int simd, const uint8_t *srcUV, uint8_t *dstU,
+                       uint8_t *dstV, int chromaWidth)
+{
+#ifdef ICAMERA_SIMD_X86
+    if (simd == SIMD_AVX2)
+        return splitUVRowAvx2(srcUV, dstU, dstV, chromaWidth);
+    if (simd == SIMD_SSE41)
+        return splitUVRowSse41(srcUV, dstU, dstV, chromaWidth);
+#endif
+    splitUVRowC(srcUV, dstU, dstV, 0, chromaWidth);
+}
+
+/*
+ * Converts lines [first, last) of the frame. first and last must be even so
+ * that chroma lines are not shared between stripes.
+ */
+static void convertLines(int simd, const uint8_t *srcY, const uint8_t *srcUV,
+                         int srcStride, uint8_t *dst, int format,
+                         int width, int height, int first, int last)
+{
+    switch (format) {
+    case V4L2_PIX_FMT_YUYV:
+        for (int line = first; line < last; line++) {
+            yuyvRow(simd, srcY + line * srcStride,
+                    srcUV + (line / 2) * srcStride,
+                    dst + line * width * 2, width);
+        }
+        break;
+    case V4L2_PIX_FMT_RGBX32:
+        for (int line = first; line < last; line++) {
+            rgbxRow(simd, srcY + line * srcStride,
+                    srcUV + (line / 2) * srcStride,
+                    dst + line * width * 4, width);
+        }
+        break;
+    case V4L2_PIX_FMT_GREY:
+        for (int line = first; line < last; line++)
+            memcpy(dst + line * width, srcY + line * srcStride, width);
+        break;
+    case V4L2_PIX_FMT_YUV420: {
+        uint8_t *dstU = dst + width * height;
+        uint8_t *dstV = dstU + (width / 2) * (height / 2);
+        for (int line = first; line < last; line++)
+            memcpy(dst + line * width, srcY + line * srcStride, width);
+        for (int line = first / 2; line < last / 2; line++) {
+            splitUVRow(simd, srcUV + line * srcStride,
+                       dstU + line * (width / 2),
+                       dstV + line * (width / 2), width / 2);
+        }
+        break;
+    }
+    case V4L2_PIX_FMT_NV12:
+        for (int line = first; line < last; line++)
+            memcpy(dst + line * width, srcY + line * srcStride, width);
+        for (int line = first / 2; line < last / 2; line++) {
+            memcpy(dst + width * height + line * width,
+                   srcUV + line * srcStride, width);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+FormatConverter::FormatConverter(WorkerPool *pool) :
+    mPool(pool),
+    mSimdLevel(detectSimdLevel())
+{
+    LOG1("using %s conversion kernels", getSimdName());
+}
+
+const char *FormatConverter::getSimdName() const
+{
+    return simdLevelName(mSimdLevel);
+}
+
+status_t FormatConverter::convertFromNv12(const uint8_t *srcY,
+                                          const uint8_t *srcUV,
+                                          int srcStride, void *dst,
+                                          int format, int width, int height)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL2);
+
+    if (srcY == NULL || srcUV == NULL || dst == NULL || !isSupportedFormat(format))
+        return BAD_VALUE;
+
+    if (width % 2 != 0 || height % 2 != 0 || srcStride < width) {
+        LOGE("unsupported geometry %dx%d stride %d", width, height, srcStride);
+        return BAD_VALUE;
+    }
+
+    int stripes = 1;
+    if (mPool != NULL)
+        stripes = std::max(1, std::min(mPool->size(), height / MIN_STRIPE_HEIGHT));
+    // round stripe height up to an even line count
+    int stripeHeight = ((height + stripes - 1) / stripes + 1) & ~1;
+    stripes = (height + stripeHeight - 1) / stripeHeight;
+
+    int simd = mSimdLevel;
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    auto job = [=](int stripe) {
+        int first = stripe * stripeHeight;
+        int last = std::min(height, first + stripeHeight);
+        convertLines(simd, srcY, srcUV, srcStride, out, format,
+                     width, height, first, last);
+    };
+
+    if (stripes > 1)
+        mPool->parallelFor(stripes, job);
+    else
+        job(0);
+
+    return OK;
+}
+
+bool FormatConverter::isSupportedFormat(int format)
+{
+    return format != V4L2_PIX_FMT_JPEG && getBpp(format) != 0;
+}
+
+void FormatConverter::getConvertedFormats(std::vector<int> &formats)
+{
+    formats.clear();
+    formats.push_back(V4L2_PIX_FMT_YUYV);
+    formats.push_back(V4L2_PIX_FMT_YUV420);
+    formats.push_back(V4L2_PIX_FMT_RGBX32);
+    formats.push_back(V4L2_PIX_FMT_GREY);
+}
+
+int FormatConverter::getBpp(int format)
+{
+    switch (format) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+        return 12;
+    case V4L2_PIX_FMT_YUYV:
+        return 16;
+    case V4L2_PIX_FMT_RGBX32:
+        return 32;
+    case V4L2_PIX_FMT_GREY:
+    case V4L2_PIX_FMT_JPEG:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+int FormatConverter::getFrameSize(int format, int width, int height)
+{
+    return width * height * getBpp(format) / 8;
+}
+
+} // namespace icamera
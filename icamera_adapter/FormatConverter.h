@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FORMATCONVERTER_H_
+#define _FORMATCONVERTER_H_
+
+#include "Errors.h"
+#include "WorkerPool.h"
+#include <stdint.h>
+#include <vector>
+
+namespace icamera {
+
+/**
+ * \class FormatConverter
+ *
+ * Converts the NV12 frames produced by the camera3 HAL into the other v4l2
+ * formats icamerasrc may ask for, so that no videoconvert element is needed
+ * downstream. The conversion writes straight into the destination buffer and
+ * is split into row stripes over a WorkerPool.
+ *
+ * Kernels are picked at runtime: AVX2, SSE4.1 or plain C.
+ */
+class FormatConverter {
+public:
+    explicit FormatConverter(WorkerPool *pool);
+
+    /**
+     * Converts a NV12 frame into format.
+     *
+     * \param srcY     start of the luma plane
+     * \param srcUV    start of the interleaved chroma plane
+     * \param srcStride bytes per line of both source planes
+     * \param dst      destination, getFrameSize(format, width, height) bytes
+     *                 with tightly packed lines
+     */
+    status_t convertFromNv12(const uint8_t *srcY, const uint8_t *srcUV,
+                             int srcStride, void *dst, int format,
+                             int width, int height);
+
+    /** \return name of the kernel set in use, for logging */
+    const char *getSimdName() const;
+
+    /** \return true if format can be produced from NV12, NV12 included */
+    static bool isSupportedFormat(int format);
+
+    /** v4l2 formats which are produced by conversion from NV12 */
+    static void getConvertedFormats(std::vector<int> &formats);
+
+    /**
+     * \return bits per pixel of format, 0 if not supported. JPEG buffers are
+     * sized one byte per pixel, which is what the HAL encoder expects.
+     */
+    static int getBpp(int format);
+
+    /** \return tightly packed frame size in bytes, 0 if not supported */
+    static int getFrameSize(int format, int width, int height);
+
+private:
+    WorkerPool *mPool;
+    int mSimdLevel;
+};
+
+} // namespace icamera
+
+#endif /* _FORMATCONVERTER_H_ */
@@ -49,6 +49,9 @@
   *    Version        0.43       Add sensor description in camera_info_t
  *******************************************************************************
  *     Version        0.50       Support specifying input format (aka ISYS output format).
+ *******************************************************************************
+ *     Version        0.51       Add optional API camera_callback_register for HAL stall
+ *                               recovery events
  * ------------------------------------------------------------------------------
  */
 // this file is from libcamhal and ideally should be shared with it somehow
@@ -444,6 +447,60 @@ int camera_get_parameters(int camera_id, Parameters& param);
  * The API defined in this section is optional.
  */
 
+/**
+ * \struct camera_recovery_msg_t: timings of a recovery from a HAL stall
+ */
+typedef struct {
+    int64_t stall_ns;       /**< age of the oldest request when the stall was detected */
+    int64_t flush_ns;       /**< time spent in the HAL flush */
+    int64_t reconfig_ns;    /**< time spent reconfiguring the streams */
+    int64_t total_ns;       /**< from detection until the buffers were resubmitted */
+    int resubmitted;        /**< number of buffers queued to the HAL again */
+    int status;             /**< 0 if the HAL accepted the streams and requests again */
+} camera_recovery_msg_t;
+
+typedef enum {
+    CAMERA_MSG_RECOVERY = 0, /**< the adapter recovered from a HAL stall */
+} camera_msg_type_t;
+
+typedef struct {
+    camera_msg_type_t type;
+    union {
+        camera_recovery_msg_t recovery;
+    } data;
+} camera_msg_data_t;
+
+typedef struct camera_callback_ops {
+    void (*notify)(const struct camera_callback_ops *cb, const camera_msg_data_t &data);
+} camera_callback_ops_t;
+
+/**
+ * \brief
+ *   Register callbacks for events of the camera device.
+ *
+ * \note
+ *   The callbacks are called from an internal thread of the device. The
+ *   callback structure must stay valid until the device is closed.
+ *
+ * \param[in]
+ *   int camera_id: ID of the camera
+ * \param[in]
+ *   camera_callback_ops_t *callback: callbacks to call, NULL to unregister
+ *
+ * \par Sample code
+ *
+ * \code
+ *   static void notify(const camera_callback_ops_t *cb, const camera_msg_data_t &data)
+ *   {
+ *       if (data.type == CAMERA_MSG_RECOVERY)
+ *           printf("recovered in %lld ns", data.data.recovery.total_ns);
+ *   }
+ *   static camera_callback_ops_t callback = { notify };
+ *   camera_callback_register(camera_id, &callback);
+ * \endcode
+ **/
+void camera_callback_register(int camera_id, const camera_callback_ops_t *callback);
+
 /**
  * \brief
  *   Return the size information of a frame.
@@ -20,12 +20,20 @@
 #include "ICameraAdapter.h"
 #include "ParameterAdapter.h"
 #include "camera/CameraMetadata.h"
+#include "camera/CameraMetadataView.h"
 #include "camera_metadata_hidden.h"
 #include "Errors.h"
 #include "LogHelper.h"
+#include "MetadataCache.h"
+#include "SettingsOverrides.h"
 #include <linux/videodev2.h>
 #include <hardware/gralloc.h>
+#include <cutils/properties.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
 #include <string>
+#include <algorithm>
 
 using std::pair;
 using std::vector;
@@ -36,9 +44,15 @@ using android::Rect;
 using android::GraphicBufferMapper;
 using android::GraphicBuffer;
 using android::sp;
+using android::Fence;
 using android::Mutex;
 using android::Condition;
+using android::CameraMetadataView;
 const uint64_t ONE_SECOND = 1000000000;
+// consecutive recoveries without a frame in between, before giving up
+const int MAX_RECOVERY_ATTEMPTS = 3;
+// longest wait for a release fence of a returned buffer, in ms
+const int RELEASE_FENCE_TIMEOUT = 1000;
 extern camera_module_t HAL_MODULE_INFO_SYM;
 extern gralloc_module_t GRALLOC_HAL_MODULE_INFO_SYM;
 
@@ -72,10 +86,30 @@ do { \
 
 __attribute__ ((init_priority (101))) static Parameters sParameters[MAX_CAMERAS];
 static ICameraAdapter* sCamAdapters[MAX_CAMERAS];
+// the static metadata and camera_info of the cameras, from the HAL or mapped
+// from the cache files, which are read instead of the HAL at later starts
+__attribute__ ((init_priority (101))) static MetadataCache sMetadataCaches[MAX_CAMERAS];
+static MetadataCache::Contents sStaticInfo[MAX_CAMERAS];
+// request settings overriding the defaults and the parameters, parsed once
+// from the file named by the camera.icamera.overrides property
+static camera_metadata_t *sSettingsOverrides = NULL;
 static const char *sCameraNames[MAX_CAMERAS] = {
         "camera0",
         "camera1"
 };
+// sizes offered as virtual streams when the HAL does not have them
+static const camera_resolution_t sVirtualStreamSizes[] = {
+        { 640, 480 },
+        { 640, 360 },
+        { 320, 240 },
+        { 320, 180 }
+};
+
+/* bytes per line of a nv12 buffer, tightly packed unless it says otherwise */
+static int nv12Stride(const camera_buffer_t *buffer)
+{
+    return std::max(buffer->s.stride, buffer->s.width);
+}
 
 int get_number_of_cameras()
 {
@@ -88,11 +122,8 @@ int get_camera_info(int camera_id, camera_info_t& info)
     HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
     CAMERA_ID_CHECK(camera_id);
 
-    struct camera_info ac2info;
-    HAL_MODULE_INFO_SYM.get_camera_info(camera_id, &ac2info);
-
-    info.orientation = ac2info.orientation;
-    info.facing = ac2info.facing;
+    info.orientation = sStaticInfo[camera_id].orientation;
+    info.facing = sStaticInfo[camera_id].facing;
     // todo vendor metadata could be added to contain camera (and/or sensor)
     // names, but for now we use hardcoded rather anonymous names
     info.name = sCameraNames[camera_id];
@@ -108,8 +139,139 @@ int get_camera_info(int camera_id, camera_info_t& info)
     return OK;
 }
 
+/* Derives the stream configs offered to the icamera clients from the static
+ * metadata of the HAL. The caller frees the returned metadata.
+ */
+static camera_metadata_t *deriveStreamConfigs(const camera_metadata_t *meta)
+{
+    size_t entryCount;
+    const int32_t *availStreamConfig = CameraMetadataView(meta).find<int32_t>(
+            ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS, &entryCount);
+    int count = entryCount;
+
+    if (availStreamConfig == NULL || count < 4) {
+        LOGE("@%s: Empty stream configuration in static metadata.",
+             __FUNCTION__);
+        return NULL;
+    }
+
+    // formats the adapter can convert the HAL nv12 output into
+    vector<int> convertedFormats;
+    FormatConverter::getConvertedFormats(convertedFormats);
+
+    // figure out suitable stream configs, push them to vector
+    vector<int> streamConfigVec;
+    vector<pair<int, int>> halSizes;
+    for (uint32_t j = 0; j < (uint32_t)count; j += 4) {
+        // only process the nv12 outputs, for now
+        if (availStreamConfig[j] == HAL_PIXEL_FORMAT_YCbCr_420_888 &&
+            availStreamConfig[j+3] == CAMERA3_STREAM_OUTPUT) {
+            halSizes.push_back(pair<int, int>(availStreamConfig[j + 1],
+                                              availStreamConfig[j + 2]));
+            // for some strange reason, Parameters.cpp expects to read
+            // width, height & field from the metadata, and it invents
+            // stride and size. Parameters.cpp also expects the metadata to
+            // have as many ints as struct stream_t which is 8. So we need
+            // dummy ints in there.
+            streamConfigVec.push_back(V4L2_PIX_FMT_NV12);        // format
+            streamConfigVec.push_back(availStreamConfig[j + 1]); // width
+            streamConfigVec.push_back(availStreamConfig[j + 2]); // height
+            streamConfigVec.push_back(0); // field
+            streamConfigVec.push_back(0); // dummy
+            streamConfigVec.push_back(0); // dummy
+            streamConfigVec.push_back(0); // dummy
+            streamConfigVec.push_back(0); // dummy
+
+            // the same size in the formats produced by FormatConverter
+            for (auto format : convertedFormats) {
+                streamConfigVec.push_back(format);
+                streamConfigVec.push_back(availStreamConfig[j + 1]);
+                streamConfigVec.push_back(availStreamConfig[j + 2]);
+                streamConfigVec.insert(streamConfigVec.end(), 5, 0);
+            }
+        }
+    }
+
+    // still streams, encoded by the HAL
+    for (uint32_t j = 0; j < (uint32_t)count; j += 4) {
+        if (availStreamConfig[j] == HAL_PIXEL_FORMAT_BLOB &&
+            availStreamConfig[j+3] == CAMERA3_STREAM_OUTPUT) {
+            streamConfigVec.push_back(V4L2_PIX_FMT_JPEG);
+            streamConfigVec.push_back(availStreamConfig[j + 1]);
+            streamConfigVec.push_back(availStreamConfig[j + 2]);
+            streamConfigVec.insert(streamConfigVec.end(), 5, 0);
+        }
+    }
+
+    // add the virtual stream sizes which fit in some HAL stream
+    for (auto &size : sVirtualStreamSizes) {
+        bool fits = false;
+        bool halHasIt = false;
+        for (auto &halSize : halSizes) {
+            fits |= size.width <= halSize.first && size.height <= halSize.second;
+            halHasIt |= size.width == halSize.first && size.height == halSize.second;
+        }
+        if (fits && !halHasIt) {
+            streamConfigVec.push_back(V4L2_PIX_FMT_NV12);
+            streamConfigVec.push_back(size.width);
+            streamConfigVec.push_back(size.height);
+            streamConfigVec.insert(streamConfigVec.end(), 5, 0);
+        }
+    }
+
+    // pull the stream configs from the vector as an array
+    count = streamConfigVec.size();
+    if (count == 0) {
+        LOGE("no valid output stream configs");
+        return NULL;
+    }
+    // take a pointer to the array of ints
+    const int *data = &streamConfigVec[0];
+    // write configs into a metadata entry; allocate some excess space
+    camera_metadata_t *streamConfigs = allocate_camera_metadata(20, 32768);
+    add_camera_metadata_entry(streamConfigs,
+            ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS,
+            data,
+            count);
+    return streamConfigs;
+}
+
+/* Sizes the still buffers like the camera framework does: the
+ * ANDROID_JPEG_MAX_SIZE of the largest BLOB size, scaled down by the pixel
+ * count of the stream, but no smaller than a floor for the JPEG headers and
+ * the camera3_jpeg_blob trailer. One byte per pixel without the max size.
+ */
+static int jpegBufferSize(const camera_metadata_t *meta, int width, int height)
+{
+    const int minSize = 256 * 1024 + sizeof(camera3_jpeg_blob);
+    CameraMetadataView view(meta);
+    int32_t maxSize = 0;
+    if (meta == NULL || !view.get(ANDROID_JPEG_MAX_SIZE, &maxSize) || maxSize <= 0) {
+        LOGW("No jpeg max size in static metadata, using one byte per pixel");
+        return FormatConverter::getFrameSize(V4L2_PIX_FMT_JPEG, width, height);
+    }
+
+    size_t entryCount;
+    const int32_t *configs = view.find<int32_t>(
+            ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS, &entryCount);
+    int64_t maxPixels = 0;
+    for (size_t i = 0; configs != NULL && i + 3 < entryCount; i += 4) {
+        if (configs[i] == HAL_PIXEL_FORMAT_BLOB &&
+            configs[i + 3] == CAMERA3_STREAM_OUTPUT)
+            maxPixels = std::max(maxPixels, (int64_t)configs[i + 1] * configs[i + 2]);
+    }
+    if (maxPixels <= 0 || maxSize <= minSize)
+        return std::max(maxSize, minSize);
+
+    float scale = (float)((int64_t)width * height) / maxPixels;
+    int size = scale * (maxSize - minSize) + minSize;
+    return std::min(std::max(size, minSize), (int)maxSize);
+}
+
 /* This function sets up the static metadata Parameters objects, in practice
  * only the stream configs. This is called from the HAL library constructor.
+ * The static metadata comes from the cache files when they are up to date,
+ * and is written to them otherwise.
  */
 int camera_hal_init()
 {
@@ -126,84 +288,49 @@ int camera_hal_init()
         set_camera_metadata_vendor_ops(&ops);
     }
 
+    // the overrides may name vendor tags, which are known from here on
+    char overridesPath[PROPERTY_VALUE_MAX];
+    property_get("camera.icamera.overrides", overridesPath,
+                 "/etc/icamera/overrides.conf");
+    CameraMetadata overrides;
+    if (overridesPath[0] != '\0' &&
+        SettingsOverrides::load(overridesPath, overrides) == OK &&
+        !overrides.isEmpty())
+        sSettingsOverrides = overrides.release();
+
     struct camera_info ac2info;
     for (int cameraId = 0; cameraId < MAX_CAMERAS; cameraId++) {
-        int count = 0;
-        HAL_MODULE_INFO_SYM.get_camera_info(cameraId, &ac2info);
-        const camera_metadata_t *meta = ac2info.static_camera_characteristics;
-        if (!meta) {
-            LOGE("@%s: Cannot get static metadata.", __FUNCTION__);
-            return UNKNOWN_ERROR;
-        }
-
-        camera_metadata_ro_entry_t entry;
-        CLEAR(entry);
-        int ret = find_camera_metadata_ro_entry(meta,
-                                 ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS,
-                                 &entry);
-
-        if (ret != OK) {
-            LOGE("@%s: Cannot get stream configuration from static metadata.",
-                 __FUNCTION__);
-            return UNKNOWN_ERROR;
-        }
-
-        count = entry.count;
-        const int32_t *availStreamConfig = entry.data.i32;
-
-        if (availStreamConfig == NULL || count < 4) {
-            LOGE("@%s: Empty stream configuration in static metadata.",
-                 __FUNCTION__);
-            return UNKNOWN_ERROR;
-        }
-
-        // figure out suitable stream configs, push them to vector
-        vector<int> streamConfigVec;
-        for (uint32_t j = 0; j < (uint32_t)count; j += 4) {
-            // only process the nv12 outputs, for now
-            if (availStreamConfig[j] == HAL_PIXEL_FORMAT_YCbCr_420_888 &&
-                availStreamConfig[j+3] == CAMERA3_STREAM_OUTPUT) {
-                // for some strange reason, Parameters.cpp expects to read
-                // width, height & field from the metadata, and it invents
-                // stride and size. Parameters.cpp also expects the metadata to
-                // have as many ints as struct stream_t which is 8. So we need
-                // dummy ints in there.
-                streamConfigVec.push_back(V4L2_PIX_FMT_NV12);        // format
-                streamConfigVec.push_back(availStreamConfig[j + 1]); // width
-                streamConfigVec.push_back(availStreamConfig[j + 2]); // height
-                streamConfigVec.push_back(0); // field
-                streamConfigVec.push_back(0); // dummy
-                streamConfigVec.push_back(0); // dummy
-                streamConfigVec.push_back(0); // dummy
-                streamConfigVec.push_back(0); // dummy
+        MetadataCache::Contents &contents = sStaticInfo[cameraId];
+        camera_metadata_t *streamConfigs = NULL;
+        if (!sMetadataCaches[cameraId].load(cameraId, contents)) {
+            HAL_MODULE_INFO_SYM.get_camera_info(cameraId, &ac2info);
+            const camera_metadata_t *meta = ac2info.static_camera_characteristics;
+            if (!meta) {
+                LOGE("@%s: Cannot get static metadata.", __FUNCTION__);
+                return UNKNOWN_ERROR;
             }
+            streamConfigs = deriveStreamConfigs(meta);
+            if (streamConfigs == NULL)
+                return UNKNOWN_ERROR;
+
+            contents.staticMetadata = meta;
+            contents.streamConfigs = streamConfigs;
+            contents.facing = ac2info.facing;
+            contents.orientation = ac2info.orientation;
+            sMetadataCaches[cameraId].store(cameraId, contents);
         }
 
-        // pull the stream configs from the vector as an array
-        count = streamConfigVec.size();
-        if (count == 0) {
-            LOGE("no valid output stream configs");
-            return UNKNOWN_ERROR;
-        }
-        // take a pointer to the array of ints
-        const int *data = &streamConfigVec[0];
-        // write configs into a metadata entry; allocate some excess space
-        camera_metadata_t *streamConfigs = allocate_camera_metadata(20, 32768);
-        ret = add_camera_metadata_entry(streamConfigs,
-                ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS,
-                data,
-                count);
-
         // wrap them up as a CameraMetadata object for the Parameters class API
         CameraMetadata cameraMetadata;
-        // cloning requires const
-        cameraMetadata = const_cast<const camera_metadata_t *>(streamConfigs);
+        cameraMetadata = contents.streamConfigs;
 
         // now finally, merge it to the static Parameters instance
         sParameters[cameraId].merge(&cameraMetadata);
 
-        // free the metadata
-        free_camera_metadata(streamConfigs);
+        // the stream configs are only needed here
+        contents.streamConfigs = NULL;
+        if (streamConfigs != NULL)
+            free_camera_metadata(streamConfigs);
     }
     initDone = true;
     return OK;
@@ -247,9 +374,15 @@ void camera_device_close(int camera_id)
 int get_frame_size(int format, int width, int height, int field, int *bpp)
 {
     HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
-    // currently just NV12 supported, so this is easy to do:
-    *bpp = 12;
-    return width * height * 3 / 2;
+    // NV12 from the HAL, one of the formats the adapter converts it to,
+    // or a JPEG from the HAL encoder
+    if (FormatConverter::getBpp(format) == 0) {
+        LOGE("Unsupported format 0x%x", format);
+        *bpp = 0;
+        return BAD_VALUE;
+    }
+    *bpp = FormatConverter::getBpp(format);
+    return FormatConverter::getFrameSize(format, width, height);
 }
 
 int camera_device_start(int camera_id)
@@ -272,6 +405,16 @@ int camera_get_parameters(int camera_id, Parameters& param)
     CAMERA_ID_CHECK(camera_id);
     CALL_ADAPTOR_AND_RETURN(camera_id, getParameters(param));
 }
+void camera_callback_register(int camera_id, const camera_callback_ops_t *callback)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    int numCameras = HAL_MODULE_INFO_SYM.get_number_of_cameras();
+    if (camera_id < 0 || camera_id >= numCameras)
+        return;
+
+    if (sCamAdapters[camera_id] != NULL)
+        sCamAdapters[camera_id]->registerCallback(callback);
+}
 int camera_device_config_streams(int camera_id, stream_config_t *stream_list, int /*input_fmt*/)
 {
     CAMERA_ID_CHECK(camera_id);
@@ -294,12 +437,30 @@ int camera_stream_qbuf(int camera_id, int stream_id, camera_buffer_t *buffer)
 ICameraAdapter::ICameraAdapter(int cameraId) :
     mCameraId(cameraId),
     mStarted(false),
+    mJpegStreamId(-1),
+    mJpegBufferSize(0),
+    mStreamFormat(V4L2_PIX_FMT_NV12),
+    mWorkerPool(NULL),
+    mConverter(NULL),
+    mDownscaler(NULL),
+    mPostProcessExit(false),
+    mWatchdogExit(false),
+    mWatchdogThreshold(0),
+    mRecovering(false),
+    mRecoveryAttempts(0),
+    mCallbackOps(NULL),
     mRequestSettings(NULL),
+    mSettingsChanged(false),
     mOperationMode(0)
 {
     HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
     Mutex::Autolock lock(mLock);
     CLEAR(mStream);
+    CLEAR(mJpegStream);
+    char threshold[PROPERTY_VALUE_MAX];
+    // off by default, long exposures and low frame rates look like stalls
+    property_get("camera.icamera.watchdog.ms", threshold, "0");
+    mWatchdogThreshold = ms2ns(atoi(threshold));
     string sName = to_string(cameraId);
     HAL_MODULE_INFO_SYM.common.methods->
         open((hw_module_t *)&HAL_MODULE_INFO_SYM, sName.c_str(), &mDevice);
@@ -308,6 +469,11 @@ ICameraAdapter::ICameraAdapter(int cameraId) :
 ICameraAdapter::~ICameraAdapter()
 {
     HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    stopWatchdog();
+    stopPostProcessThread();
+    delete mDownscaler;
+    delete mConverter;
+    delete mWorkerPool;
 }
 
 status_t ICameraAdapter::open()
@@ -328,22 +494,39 @@ status_t ICameraAdapter::open()
 status_t ICameraAdapter::close()
 {
     HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    stopWatchdog();
     // intentionally left unlocked during flush.
     // Fix if this proves to be an issue.
     DOPS(mDevice)->flush((camera3_device_t *)mDevice);
+    stopPostProcessThread();
     Mutex::Autolock lock(mLock);
+    releaseShadowBuffers();
+    for (auto &mapping : mVirtualMappings) {
+        if (mapping.second.size > 0)
+            munmap(mapping.second.addr, mapping.second.size);
+    }
+    mVirtualMappings.clear();
+    mVirtualStreams.clear();
+    mJpegQueuedBuffers.clear();
+    mJpegRequests.clear();
+    mJpegStreamId = -1;
     mAllocatedBuffers.clear();
+    for (auto fd : mExportedFds)
+        ::close(fd);
+    mExportedFds.clear();
     mBufferMapping.clear();
-    for (auto buffer : mMappedBuffers) {
-        if (buffer != NULL) {
+    for (auto &buffer : mMappedBuffers) {
+        // a handle freed behind our back is not ours to free again
+        if (isCurrentHandle(buffer.first, buffer.second)) {
             GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
                     GRALLOC_UNMAP_FD,
-                    buffer);
-            delete (buffer);
+                    buffer.first);
         }
+        mFreeHandleCells.push_back(buffer.first);
     }
     mMappedBuffers.clear();
-    free_camera_metadata(mRequestSettings);
+    free_pooled_camera_metadata(CameraMetadata::sharedPool(), mRequestSettings);
+    mRequestSettings = NULL;
     DCOMMON(mDevice).close(mDevice);
     return OK;
 }
@@ -353,6 +536,10 @@ status_t ICameraAdapter::start()
     HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
     Mutex::Autolock lock(mLock);
     mStarted = true;
+    if (mWatchdogThreshold > 0 && !mWatchdogThread.joinable()) {
+        mWatchdogExit = false;
+        mWatchdogThread = std::thread(&ICameraAdapter::watchdogLoop, this);
+    }
     while (!mPendingBuffers.empty()) {
         BufferWrapper pendingBuffer = mPendingBuffers.at(0);
         mPendingBuffers.erase(mPendingBuffers.begin());
@@ -379,27 +566,32 @@ status_t ICameraAdapter::setParameters(const icamera::Parameters& param)
         return UNKNOWN_ERROR;
     }
 
-    struct camera_info ac2info;
-    HAL_MODULE_INFO_SYM.get_camera_info(mCameraId, &ac2info);
-    const camera_metadata_t *staticMeta = ac2info.static_camera_characteristics;
+    const camera_metadata_t *staticMeta = sStaticInfo[mCameraId].staticMetadata;
     if (staticMeta == NULL) {
         LOGE("No static metadata");
         return UNKNOWN_ERROR;
     }
 
-    CameraMetadata meta(mRequestSettings); // takes metadata ownership
+    // resizes of the settings reuse buffers of the shared pool
+    CameraMetadata meta(CameraMetadata::sharedPool());
+    meta.acquire(mRequestSettings); // takes metadata ownership
+    meta.clearDirty();
+
+    // the converted parameters are collected first, and then written into
+    // the settings as one batch
+    CameraMetadata changes(CameraMetadata::sharedPool(), 16, 256);
 
     // run ParameterAdapter on params to convert supported params to camera3
     // format
     int ev;
     param.getAeCompensation(ev);
-    status = ParameterAdapter::convertAeComp(ev, meta, *staticMeta);
+    status = ParameterAdapter::convertAeComp(ev, changes, *staticMeta);
     if (status != OK)
         LOGE("ev parameter conversion failed");
 
     int fps;
     param.getFrameRate(fps);
-    status = ParameterAdapter::convertFps(fps, meta, *staticMeta);
+    status = ParameterAdapter::convertFps(fps, changes, *staticMeta);
     if (status != OK) {
         mOperationMode = OP_MODE_DEFAULT;
         LOGE("Fps parameter conversion failed");
@@ -419,7 +611,7 @@ status_t ICameraAdapter::setParameters(const icamera::Parameters& param)
 
     camera_video_stabilization_mode_t dvsMode;
     param.getVideoStabilizationMode(dvsMode);
-    status = ParameterAdapter::convertDvs(dvsMode, meta, *staticMeta);
+    status = ParameterAdapter::convertDvs(dvsMode, changes, *staticMeta);
     if (status != OK)
         LOGE("DVS parameter conversion failed");
     if (dvsMode) {
@@ -428,22 +620,34 @@ status_t ICameraAdapter::setParameters(const icamera::Parameters& param)
 
     camera_ae_mode_t aeMode;
     param.getAeMode(aeMode);
-    status = ParameterAdapter::convertAeMode(aeMode, meta, *staticMeta);
+    status = ParameterAdapter::convertAeMode(aeMode, changes, *staticMeta);
     if (status != OK)
         LOGE("AE mode parameter conversion failed");
 
     int64_t exposureTime;
     param.getExposureTime(exposureTime);
-    status = ParameterAdapter::convertExposureTime(exposureTime, meta, *staticMeta);
+    status = ParameterAdapter::convertExposureTime(exposureTime, changes, *staticMeta);
     if (status != OK)
         LOGE("Exposure time conversion failed");
 
     camera_antibanding_mode_t bandingMode;
     param.getAntiBandingMode(bandingMode);
-    status = ParameterAdapter::convertBandingMode(bandingMode, meta, *staticMeta);
+    status = ParameterAdapter::convertBandingMode(bandingMode, changes, *staticMeta);
     if (status != OK)
         LOGE("Antibanding mode conversion failed");
 
+    // the overrides win over the parameters
+    if (sSettingsOverrides != NULL)
+        changes.updateBatch(sSettingsOverrides);
+
+    const camera_metadata_t *changed = changes.getAndLock();
+    if (meta.updateBatch(changed) != OK)
+        LOGE("Couldn't update the request settings");
+    changes.unlock(changed);
+    // parameters which convert to the settings already in use change nothing
+    if (meta.isDirty())
+        mSettingsChanged = true;
+
     mRequestSettings = meta.release(); // restore metadata ownership (new ptr)
 
     return status;
@@ -461,20 +665,64 @@ status_t ICameraAdapter::configStreams(icamera::stream_config_t *stream_list)
     HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
     Mutex::Autolock lock(mLock);
 
-    // only support one stream for now - that's hardcoded in gstcamerasrc anyway
-    if (stream_list == NULL || stream_list->num_streams != 1) {
+    // one stream goes to the HAL, the rest are downscaled from it, except
+    // for an optional still stream, which the HAL encodes
+    if (stream_list == NULL || stream_list->num_streams < 1) {
         LOGE("bad stream config");
         return UNKNOWN_ERROR;
     }
 
-    camera3_stream_configuration_t streamConfig;
-    camera3_stream_t *streamPtrs[1];
+    int format = stream_list->streams[0].format;
+    if (!FormatConverter::isSupportedFormat(format)) {
+        LOGE("Unsupported stream format 0x%x", format);
+        return BAD_VALUE;
+    }
 
-    streamPtrs[0] = &mStream;
+    vector<VirtualStream> virtualStreams;
+    int jpegStreamId = -1;
+    for (int i = 1; i < stream_list->num_streams; i++) {
+        const stream_t &s = stream_list->streams[i];
+        if (s.format == V4L2_PIX_FMT_JPEG && jpegStreamId < 0) {
+            jpegStreamId = i;
+            continue;
+        }
+        if (s.format != V4L2_PIX_FMT_NV12 ||
+            s.width > stream_list->streams[0].width ||
+            s.height > stream_list->streams[0].height ||
+            s.width % 2 != 0 || s.height % 2 != 0) {
+            LOGE("Unsupported virtual stream %dx%d format 0x%x",
+                 s.width, s.height, s.format);
+            return BAD_VALUE;
+        }
+        VirtualStream virtualStream;
+        virtualStream.id = i;
+        virtualStream.width = s.width;
+        virtualStream.height = s.height;
+        virtualStreams.push_back(virtualStream);
+    }
 
-    streamConfig.num_streams = 1;
-    streamConfig.operation_mode = mOperationMode;
-    streamConfig.streams = streamPtrs;
+    mStreamFormat = format;
+    mVirtualStreams = virtualStreams;
+    mJpegStreamId = jpegStreamId;
+    for (int i = 0; i < stream_list->num_streams; i++)
+        stream_list->streams[i].id = i;
+
+    // the HAL always produces nv12, other formats are converted by us
+    bool convert = format != V4L2_PIX_FMT_NV12;
+    if ((convert || !mVirtualStreams.empty()) && mWorkerPool == NULL) {
+        char workers[PROPERTY_VALUE_MAX];
+        property_get("camera.icamera.workers", workers, "0");
+        mWorkerPool = new WorkerPool(atoi(workers));
+    }
+    if (convert && mConverter == NULL)
+        mConverter = new FormatConverter(mWorkerPool);
+    if (!mVirtualStreams.empty() && mDownscaler == NULL)
+        mDownscaler = new Downscaler(mWorkerPool);
+    // also resubmits the buffers the HAL returns without a frame
+    if (!mPostProcessThread.joinable()) {
+        mPostProcessExit = false;
+        mPostProcessThread = std::thread(&ICameraAdapter::postProcessLoop, this);
+    }
 
     mStream.format = HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED;
     mStream.width = stream_list->streams[0].width;
@@ -492,6 +740,79 @@ status_t ICameraAdapter::configStreams(icamera::stream_config_t *stream_list)
     mStream.max_buffers = mAllocatedBuffers.size() > 0 ?
                           mAllocatedBuffers.size() : 2;
 
+    if (mJpegStreamId >= 0) {
+        CLEAR(mJpegStream);
+        mJpegStream.format = HAL_PIXEL_FORMAT_BLOB;
+        mJpegStream.width = stream_list->streams[mJpegStreamId].width;
+        mJpegStream.height = stream_list->streams[mJpegStreamId].height;
+        mJpegStream.stream_type = CAMERA3_STREAM_OUTPUT;
+        mJpegStream.usage = 0;
+        mJpegStream.priv = NULL;
+        mJpegStream.max_buffers = 2;
+        mJpegBufferSize = jpegBufferSize(sStaticInfo[mCameraId].staticMetadata,
+                                         mJpegStream.width, mJpegStream.height);
+    }
+    reserveHandles(mStream.max_buffers +
+                   (mJpegStreamId >= 0 ? mJpegStream.max_buffers : 0));
+
+    return configureHalStreams();
+}
+
+/*
+ * Sizes the gralloc handle slab and the cells of the mapped buffer handles
+ * for count buffers, so that mapping the buffers of a stream does not
+ * allocate.
+ *
+ * this function must be called with the mLock locked already
+ */
+void ICameraAdapter::reserveHandles(size_t count)
+{
+    GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_RESERVE_HANDLES,
+            count);
+    while (mFreeHandleCells.size() < count) {
+        mHandleCells.push_back(NULL);
+        mFreeHandleCells.push_back(&mHandleCells.back());
+    }
+}
+
+/*
+ * Returns a cell for the handle of a mapped buffer, the cells are reused
+ * once close() unmapped their buffers.
+ *
+ * this function must be called with the mLock locked already
+ */
+buffer_handle_t *ICameraAdapter::takeHandleCell()
+{
+    if (mFreeHandleCells.empty()) {
+        mHandleCells.push_back(NULL);
+        return &mHandleCells.back();
+    }
+    buffer_handle_t *cell = mFreeHandleCells.back();
+    mFreeHandleCells.pop_back();
+    *cell = NULL;
+    return cell;
+}
+
+/*
+ * Configures mStream, and mJpegStream if there is a still stream, to the HAL.
+ *
+ * this function must be called with the mLock locked already
+ */
+status_t ICameraAdapter::configureHalStreams()
+{
+    camera3_stream_configuration_t streamConfig;
+    camera3_stream_t *streamPtrs[2];
+
+    streamPtrs[0] = &mStream;
+    streamPtrs[1] = &mJpegStream;
+
+    streamConfig.num_streams = mJpegStreamId < 0 ? 1 : 2;
+    streamConfig.operation_mode = mOperationMode;
+    streamConfig.streams = streamPtrs;
+
+    // the first request after a configuration must carry settings
+    mSettingsChanged = true;
     return DOPS(mDevice)->
             configure_streams((camera3_device_t *)mDevice, &streamConfig);
 }
@@ -504,8 +825,8 @@ status_t ICameraAdapter::mapMemory(icamera::camera_buffer_t *buffer)
     if (buffer == NULL)
         return BAD_VALUE;
 
-    if (buffer->s.format != V4L2_PIX_FMT_NV12) {
-        LOGE("Only NV12 is supported at the moment");
+    if (buffer->s.format != mStreamFormat) {
+        LOGE("Buffer format 0x%x does not match the stream", buffer->s.format);
         return BAD_VALUE;
     }
 
@@ -514,12 +835,34 @@ status_t ICameraAdapter::mapMemory(icamera::camera_buffer_t *buffer)
 
     int width = buffer->s.width;
     int height = buffer->s.height;
+
+    if (mStreamFormat != V4L2_PIX_FMT_NV12) {
+        // the HAL writes into a nv12 shadow buffer, and the converted frame
+        // goes to the fd, which needs a writable mapping of its own
+        size_t size = FormatConverter::getFrameSize(mStreamFormat, width, height);
+        void *dstAddr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             buffer->dmafd, 0);
+        if (dstAddr == MAP_FAILED) {
+            LOGE("Could not mmap fd %d: %s", buffer->dmafd, strerror(errno));
+            return UNKNOWN_ERROR;
+        }
+        void *key = mappingKey(buffer);
+        status_t status = allocateShadowBuffer(key, dstAddr, size, streamBuffer);
+        if (status != OK) {
+            munmap(dstAddr, size);
+            return status;
+        }
+        buffer->addr = dstAddr;
+        mBufferMapping[key] = streamBuffer;
+        return OK;
+    }
+
     int stride = width;
     size_t size = width * height * 3 / 2; /* nv12 */
-    buffer_handle_t *pHandle = new buffer_handle_t;
+    buffer_handle_t *pHandle = takeHandleCell();
 
     // map the FD
-    GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+    int ret = GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
             GRALLOC_MAP_FD,
             pHandle,
             &buffer->addr,
@@ -530,10 +873,19 @@ status_t ICameraAdapter::mapMemory(icamera::camera_buffer_t *buffer)
             stride,
             HAL_PIXEL_FORMAT_YCrCb_420_SP,
             GRALLOC_USAGE_HW_VIDEO_ENCODER);
+    int generation = -1;
+    if (ret == 0)
+        ret = GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+                GRALLOC_GET_GENERATION, pHandle, &generation);
+    if (ret != 0) {
+        LOGE("Could not map buffer fd %d: %d", buffer->dmafd, ret);
+        mFreeHandleCells.push_back(pHandle);
+        return UNKNOWN_ERROR;
+    }
 
     streamBuffer.stream = &mStream;
-    streamBuffer.acquire_fence = 0;
-    streamBuffer.release_fence = 0;
+    streamBuffer.acquire_fence = -1;
+    streamBuffer.release_fence = -1;
     streamBuffer.status = CAMERA3_BUFFER_STATUS_OK;
     streamBuffer.buffer = pHandle;
 
@@ -541,7 +893,7 @@ status_t ICameraAdapter::mapMemory(icamera::camera_buffer_t *buffer)
     // so that they can be easily found during capture
     mBufferMapping[reinterpret_cast<void*>(buffer->dmafd)] = streamBuffer;
 
-    mMappedBuffers.push_back(pHandle);
+    mMappedBuffers[pHandle] = generation;
 
     return OK;
 }
@@ -554,8 +906,13 @@ status_t ICameraAdapter::allocateMemory(icamera::camera_buffer_t *buffer)
     if (buffer == NULL)
         return BAD_VALUE;
 
-    if (buffer->s.format != V4L2_PIX_FMT_NV12) {
-        LOGE("Only NV12 is supported at the moment");
+    if (isVirtualStream(buffer->s.id))
+        return allocateVirtualMemory(buffer);
+    if (buffer->s.id == mJpegStreamId && mJpegStreamId >= 0)
+        return allocateJpegMemory(buffer);
+
+    if (buffer->s.format != mStreamFormat) {
+        LOGE("Buffer format 0x%x does not match the stream", buffer->s.format);
         return BAD_VALUE;
     }
 
@@ -564,11 +921,22 @@ status_t ICameraAdapter::allocateMemory(icamera::camera_buffer_t *buffer)
 
     int width = buffer->s.width;
     int height = buffer->s.height;
-
-    GraphicBuffer *gb = new GraphicBuffer(width,
-                                          height,
-                                          HAL_PIXEL_FORMAT_YCbCr_420_888,
-                                          GRALLOC_USAGE_HW_COMPOSER);
+    bool convert = mStreamFormat != V4L2_PIX_FMT_NV12;
+
+    // converted frames go to a plain blob buffer (width = size, height = 1),
+    // which is filled from a nv12 shadow buffer after capture
+    GraphicBuffer *gb;
+    if (convert) {
+        width = FormatConverter::getFrameSize(mStreamFormat, width, height);
+        height = 1;
+        gb = new GraphicBuffer(width, height, HAL_PIXEL_FORMAT_BLOB,
+                               GRALLOC_USAGE_SW_WRITE_OFTEN);
+    } else {
+        gb = new GraphicBuffer(width,
+                               height,
+                               HAL_PIXEL_FORMAT_YCbCr_420_888,
+                               GRALLOC_USAGE_HW_COMPOSER);
+    }
     if (gb == NULL)
         return NO_MEMORY;
 
@@ -579,8 +947,8 @@ status_t ICameraAdapter::allocateMemory(icamera::camera_buffer_t *buffer)
         return status;
 
     streamBuffer.stream = &mStream;
-    streamBuffer.acquire_fence = 0;
-    streamBuffer.release_fence = 0;
+    streamBuffer.acquire_fence = -1;
+    streamBuffer.release_fence = -1;
     streamBuffer.status = CAMERA3_BUFFER_STATUS_OK;
     streamBuffer.buffer = &gb->getNativeBuffer()->handle;
 
@@ -607,31 +975,316 @@ status_t ICameraAdapter::allocateMemory(icamera::camera_buffer_t *buffer)
         return status;
     }
 
+    if (convert)
+        status = exportBuffer(buffer, spBuf, buffer->s.width, width);
+    else
+        status = exportBuffer(buffer, spBuf, gb->getStride(),
+                              gb->getStride() * height * 3 / 2); /* nv12 */
+    if (status != OK)
+        return status;
+
+    // the buffer is found by its exported fd from now on
+    void *key = mappingKey(buffer);
+    if (convert) {
+        status = allocateShadowBuffer(key, address, 0, streamBuffer);
+        if (status != OK)
+            return status;
+    }
+
     // create a mapping for the buffers
     // so that they can be easily found during capture
-    mBufferMapping[address] = streamBuffer;
+    mBufferMapping[key] = streamBuffer;
     // store the buffer with strong pointer for destruction later
     mAllocatedBuffers.push_back(spBuf);
     return OK;
 }
 
+/*
+ * Allocates the nv12 buffer the HAL captures into when the user buffer at
+ * dstAddr has to be converted, and points streamBuffer at it. dstSize is the
+ * length of our own mapping of dstAddr, or 0 if the mapping is not ours.
+ *
+ * this function must be called with the mLock locked already
+ */
+status_t ICameraAdapter::allocateShadowBuffer(void *key, void *dstAddr,
+                                              size_t dstSize,
+                                              camera3_stream_buffer &streamBuffer)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+
+    sp<GraphicBuffer> gb = new GraphicBuffer(mStream.width,
+                                             mStream.height,
+                                             HAL_PIXEL_FORMAT_YCbCr_420_888,
+                                             mStream.usage);
+    status_t status = gb->initCheck();
+    if (status != OK)
+        return status;
+
+    void *address;
+    status = gb->lock(GRALLOC_USAGE_SW_READ_OFTEN, &address);
+    if (status != OK) {
+        LOGE("Could not lock shadow buffer");
+        return status;
+    }
+    gb->unlock();
+
+    streamBuffer.stream = &mStream;
+    streamBuffer.acquire_fence = -1;
+    streamBuffer.release_fence = -1;
+    streamBuffer.status = CAMERA3_BUFFER_STATUS_OK;
+    streamBuffer.buffer = &gb->getNativeBuffer()->handle;
+
+    ShadowBuffer shadow;
+    shadow.buffer = gb;
+    shadow.addr = address;
+    shadow.dstAddr = dstAddr;
+    shadow.dstSize = dstSize;
+    mShadowBuffers[key] = shadow;
+
+    return OK;
+}
+
+/* this function must be called with the mLock locked already */
+void ICameraAdapter::releaseShadowBuffers()
+{
+    for (auto &shadow : mShadowBuffers) {
+        if (shadow.second.dstSize > 0)
+            munmap(shadow.second.dstAddr, shadow.second.dstSize);
+    }
+    mShadowBuffers.clear();
+}
+
+/* this function must be called with the mLock locked already */
+bool ICameraAdapter::isVirtualStream(int stream_id) const
+{
+    for (auto &virtualStream : mVirtualStreams) {
+        if (virtualStream.id == stream_id)
+            return true;
+    }
+    return false;
+}
+
+/* this function must be called with the mLock locked already */
+ICameraAdapter::VirtualStream *ICameraAdapter::findVirtualStream(int stream_id)
+{
+    for (auto &virtualStream : mVirtualStreams) {
+        if (virtualStream.id == stream_id)
+            return &virtualStream;
+    }
+    return NULL;
+}
+
+/*
+ * Buffers of the first stream may be queued and dequeued with any id which
+ * is not one of the other streams, gstcamerasrc does not care about ids.
+ *
+ * this function must be called with the mLock locked already
+ */
+int ICameraAdapter::dequeueStreamId(int stream_id) const
+{
+    if (isVirtualStream(stream_id) || (mJpegStreamId >= 0 && stream_id == mJpegStreamId))
+        return stream_id;
+    return 0;
+}
+
+/*
+ * Still buffers are BLOBs of mJpegBufferSize bytes, like the HAL expects,
+ * with the camera3_jpeg_blob trailer at the end.
+ *
+ * this function must be called with the mLock locked already
+ */
+status_t ICameraAdapter::allocateJpegMemory(icamera::camera_buffer_t *buffer)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+
+    if (buffer->s.format != V4L2_PIX_FMT_JPEG) {
+        LOGE("Buffer format 0x%x does not match the still stream", buffer->s.format);
+        return BAD_VALUE;
+    }
+
+    int size = mJpegBufferSize;
+    sp<GraphicBuffer> gb = new GraphicBuffer(size, 1, HAL_PIXEL_FORMAT_BLOB,
+                                             GRALLOC_USAGE_SW_READ_OFTEN);
+    status_t status = gb->initCheck();
+    if (status != OK)
+        return status;
+
+    void *address;
+    status = gb->lock(GRALLOC_USAGE_SW_READ_OFTEN, &address);
+    if (status != OK) {
+        LOGE("Could not lock buffer");
+        return status;
+    }
+    gb->unlock();
+
+    buffer->addr = address;
+    status = exportBuffer(buffer, gb, size, size);
+    if (status != OK)
+        return status;
+
+    camera3_stream_buffer streamBuffer;
+    CLEAR(streamBuffer);
+    streamBuffer.stream = &mJpegStream;
+    streamBuffer.acquire_fence = -1;
+    streamBuffer.release_fence = -1;
+    streamBuffer.status = CAMERA3_BUFFER_STATUS_OK;
+    streamBuffer.buffer = &gb->getNativeBuffer()->handle;
+
+    mBufferMapping[mappingKey(buffer)] = streamBuffer;
+    mAllocatedBuffers.push_back(gb);
+    return OK;
+}
+
+/*
+ * Virtual stream buffers are only written by the downscaler, so they are
+ * plain nv12 buffers without any HAL mapping.
+ *
+ * this function must be called with the mLock locked already
+ */
+status_t ICameraAdapter::allocateVirtualMemory(icamera::camera_buffer_t *buffer)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+
+    if (buffer->s.format != V4L2_PIX_FMT_NV12) {
+        LOGE("Virtual streams are NV12 only");
+        return BAD_VALUE;
+    }
+
+    sp<GraphicBuffer> gb = new GraphicBuffer(buffer->s.width,
+                                             buffer->s.height,
+                                             HAL_PIXEL_FORMAT_YCbCr_420_888,
+                                             GRALLOC_USAGE_SW_WRITE_OFTEN);
+    status_t status = gb->initCheck();
+    if (status != OK)
+        return status;
+
+    void *address;
+    status = gb->lock(GRALLOC_USAGE_SW_WRITE_OFTEN, &address);
+    if (status != OK) {
+        LOGE("Could not lock buffer");
+        return status;
+    }
+    gb->unlock();
+
+    buffer->addr = address;
+    status = exportBuffer(buffer, gb, gb->getStride(),
+                          gb->getStride() * buffer->s.height * 3 / 2); /* nv12 */
+    if (status != OK)
+        return status;
+
+    // already mapped, qBuf must not map the exported fd again
+    UserMapping userMapping;
+    userMapping.addr = address;
+    userMapping.size = 0;
+    mVirtualMappings[buffer->dmafd] = userMapping;
+    mAllocatedBuffers.push_back(gb);
+    return OK;
+}
+
+/*
+ * Gives the caller a dup of the fd backing gb, so that the frames can be
+ * imported downstream without a copy. Gralloc buffers always start at offset
+ * 0 of their fd. The fd stays valid until the device is closed, callers
+ * which keep it longer need to dup it.
+ *
+ * this function must be called with the mLock locked already
+ */
+status_t ICameraAdapter::exportBuffer(icamera::camera_buffer_t *buffer,
+                                      const sp<GraphicBuffer> &gb,
+                                      int stride, int size)
+{
+    const native_handle_t *handle = gb->getNativeBuffer()->handle;
+    if (handle == NULL || handle->numFds < 1) {
+        LOGE("No fd to export");
+        return UNKNOWN_ERROR;
+    }
+
+    int fd = dup(handle->data[0]);
+    if (fd < 0) {
+        LOGE("Could not dup fd %d: %s", handle->data[0], strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+
+    buffer->dmafd = fd;
+    buffer->flags |= BUFFER_FLAG_DMA_EXPORT;
+    buffer->s.stride = stride;
+    buffer->s.size = size;
+    mExportedFds.push_back(fd);
+    return OK;
+}
+
+/* this function must be called with the mLock locked already */
+status_t ICameraAdapter::mapVirtualMemory(icamera::camera_buffer_t *buffer)
+{
+    map<int, UserMapping>::iterator mapping = mVirtualMappings.find(buffer->dmafd);
+    if (mapping == mVirtualMappings.end()) {
+        UserMapping userMapping;
+        userMapping.size = nv12Stride(buffer) * buffer->s.height * 3 / 2; /* nv12 */
+        userMapping.addr = mmap(NULL, userMapping.size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, buffer->dmafd, 0);
+        if (userMapping.addr == MAP_FAILED) {
+            LOGE("Could not mmap fd %d: %s", buffer->dmafd, strerror(errno));
+            return UNKNOWN_ERROR;
+        }
+        mapping = mVirtualMappings.insert(
+                pair<int, UserMapping>(buffer->dmafd, userMapping)).first;
+    }
+    buffer->addr = mapping->second.addr;
+    return OK;
+}
+
+/* dma buffers are identified by their fd, others by their address */
+void *ICameraAdapter::mappingKey(const icamera::camera_buffer_t *buffer)
+{
+    if (buffer->dmafd > 0)
+        return reinterpret_cast<void*>(buffer->dmafd);
+    return buffer->addr;
+}
+
+/*
+ * Handles are recycled by gralloc once freed, so a handle mapped here may
+ * have been replaced by another one in the same place. The generation it
+ * was mapped at tells them apart; -1 skips the check for handles of
+ * buffers we did not map.
+ */
+bool ICameraAdapter::isCurrentHandle(buffer_handle_t *handle, int generation)
+{
+    if (handle == NULL || *handle == NULL)
+        return false;
+    if (generation < 0)
+        return true;
+    int current = -1;
+    int ret = GRALLOC_HAL_MODULE_INFO_SYM.perform(&GRALLOC_HAL_MODULE_INFO_SYM,
+            GRALLOC_GET_GENERATION, handle, &current);
+    return ret == 0 && current == generation;
+}
+
 status_t ICameraAdapter::dqBuf(int stream_id, icamera::camera_buffer_t **buffer)
 {
     HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL2);
     Mutex::Autolock lock(mLock);
 
-    if (mCapturedBuffers.empty()) {
-        mCondition.waitRelative(mLock, ONE_SECOND);
-        if (mCapturedBuffers.empty()) {
+    int id = dequeueStreamId(stream_id);
+    nsecs_t deadline = systemTime() + ONE_SECOND;
+    vector<BufferWrapper>::iterator buf;
+    while (true) {
+        for (buf = mCapturedBuffers.begin(); buf != mCapturedBuffers.end(); ++buf) {
+            if (dequeueStreamId(buf->stream_id) == id)
+                break;
+        }
+        if (buf != mCapturedBuffers.end())
+            break;
+
+        nsecs_t now = systemTime();
+        if (now >= deadline) {
             LOGE("capture timed out");
             return UNKNOWN_ERROR;
         }
+        mCondition.waitRelative(mLock, deadline - now);
     }
 
-    BufferWrapper buf = mCapturedBuffers.at(0);
-    mCapturedBuffers.erase(mCapturedBuffers.begin());
-
-    *buffer = buf.buffer;
+    *buffer = buf->buffer;
+    mCapturedBuffers.erase(buf);
 
     return OK;
 }
@@ -645,7 +1298,35 @@ status_t ICameraAdapter::qBuf(int stream_id, icamera::camera_buffer_t *buffer)
         return BAD_VALUE;
     }
 
-    if (mStarted) {
+    VirtualStream *virtualStream = findVirtualStream(stream_id);
+    if (virtualStream != NULL) {
+        // filled from the next HAL frame, nothing to send to the HAL
+        if (buffer->dmafd > 0) {
+            status_t status = mapVirtualMemory(buffer);
+            if (status != OK)
+                return status;
+        }
+        BufferWrapper virtualBuffer;
+        virtualBuffer.stream_id = stream_id;
+        virtualBuffer.buffer = buffer;
+        virtualStream->queuedBuffers.push_back(virtualBuffer);
+        return OK;
+    }
+
+    if (mJpegStreamId >= 0 && stream_id == mJpegStreamId) {
+        // goes to the HAL with the next capture request
+        if (mBufferMapping.find(mappingKey(buffer)) == mBufferMapping.end()) {
+            LOGE("Still buffers must be allocated by the adapter");
+            return BAD_VALUE;
+        }
+        BufferWrapper jpegBuffer;
+        jpegBuffer.stream_id = stream_id;
+        jpegBuffer.buffer = buffer;
+        mJpegQueuedBuffers.push_back(jpegBuffer);
+        return OK;
+    }
+
+    if (mStarted && !mRecovering) {
         return capture(stream_id, buffer);
     } else {
         BufferWrapper pendingBuffer;
@@ -674,11 +1355,14 @@ status_t ICameraAdapter::constructDefaultRequest()
             LOGE("couldn't create default request");
             return UNKNOWN_ERROR;
         }
-        CameraMetadata cameraMetadata;
+        CameraMetadata cameraMetadata(CameraMetadata::sharedPool());
         cameraMetadata = metadata; // clone
         int32_t requestId = CAMERA3_TEMPLATE_PREVIEW;
-        cameraMetadata.update(ANDROID_REQUEST_ID, &requestId, 1);
+        cameraMetadata.update<ANDROID_REQUEST_ID>(&requestId, 1);
+        if (sSettingsOverrides != NULL)
+            cameraMetadata.updateBatch(sSettingsOverrides);
         mRequestSettings = cameraMetadata.release(); // assign the clone to member
+        mSettingsChanged = true;
     }
     return status;
 }
@@ -691,37 +1375,43 @@ status_t ICameraAdapter::capture(int stream_id, icamera::camera_buffer_t *buffer
 
     map<void *, camera3_stream_buffer>::iterator mapping;
 
-    // try handling dma buffers first
-    if (buffer->dmafd > 0) {
-        // try to find the mapped address, if any
-        mapping = mBufferMapping.find(reinterpret_cast<void*>(buffer->dmafd));
-        if (mapping == mBufferMapping.end()) {
-            // mapping not found -> do mmap for the buffer
-            status = mapMemory(buffer);
-            mapping = mBufferMapping.find(reinterpret_cast<void*>(buffer->dmafd));
-        }
-    } else {
-        // we should always have a buffer here
-        mapping = mBufferMapping.find(buffer->addr);
+    // we should always have a buffer here, dma buffers are mapped lazily
+    mapping = mBufferMapping.find(mappingKey(buffer));
+    if (mapping == mBufferMapping.end() && buffer->dmafd > 0) {
+        // mapping not found -> do mmap for the buffer
+        status = mapMemory(buffer);
+        mapping = mBufferMapping.find(mappingKey(buffer));
     }
 
     if (status == OK && mapping != mBufferMapping.end()) {
         static int frame_number = 0;
         camera3_capture_request_t request;
-        camera3_stream_buffer streamBuffer = mapping->second;
-        // just one stream supported ATM in camerasrc,
-        // and the qbuf API of icamera isn't much better as it does not offer
-        // possibility to send more than one buffer at a time, so num out = 1
+        camera3_stream_buffer streamBuffers[2];
+        streamBuffers[0] = mapping->second;
+        // the qbuf API of icamera does not offer a possibility to send more
+        // than one buffer at a time, so a queued still buffer simply goes
+        // along with the next buffer of the first stream
         request.num_output_buffers = 1;
         request.input_buffer = NULL;
-        request.settings = mRequestSettings;
+        // NULL settings tell the HAL to keep the ones of the last request
+        request.settings = mSettingsChanged ? mRequestSettings : NULL;
+        mSettingsChanged = false;
         request.frame_number = frame_number++;
-        request.output_buffers = &streamBuffer;
+        request.output_buffers = streamBuffers;
+
+        if (!mJpegQueuedBuffers.empty()) {
+            BufferWrapper jpegBuffer = mJpegQueuedBuffers.at(0);
+            mJpegQueuedBuffers.erase(mJpegQueuedBuffers.begin());
+            streamBuffers[request.num_output_buffers++] =
+                    mBufferMapping[mappingKey(jpegBuffer.buffer)];
+            mJpegRequests[request.frame_number] = jpegBuffer;
+        }
 
         BufferWrapper queuedBuffer;
         CLEAR(queuedBuffer);
         queuedBuffer.stream_id = stream_id;
         queuedBuffer.buffer = buffer;
+        queuedBuffer.queueTime = systemTime();
         mQueuedBuffers.push_back(queuedBuffer);
 
         mLock.unlock(); // process_capture_request may block, so we must unlock
@@ -732,6 +1422,8 @@ status_t ICameraAdapter::capture(int stream_id, icamera::camera_buffer_t *buffer
             LOGE("capture failed");
         }
         mLock.lock(); // lock was held when this function is called, so lock again
+        if (status != OK && request.settings != NULL)
+            mSettingsChanged = true;
     } else {
         LOGE("Capture error. Buffer fd is this: %d addr: %x", buffer->dmafd, buffer->addr);
         return UNKNOWN_ERROR;
@@ -759,12 +1451,10 @@ void ICameraAdapter::processCaptureResult(const camera3_capture_result_t *result
     if (result->num_output_buffers == 0) {
         // this is the metadata, so fetch the necessary parts from it
         // (just timestamp, for now)
-        camera_metadata_ro_entry entry;
-        find_camera_metadata_ro_entry(result->result,
-                                      ANDROID_SENSOR_TIMESTAMP,
-                                      &entry);
-        if (entry.count == 1) {
-            captureResult->second.timestamp = entry.data.i64[0];
+        CameraMetadataView meta(result->result);
+        int64_t timestamp;
+        if (meta.get(ANDROID_SENSOR_TIMESTAMP, &timestamp)) {
+            captureResult->second.timestamp = timestamp;
         } else {
             LOGW("No shutter timestamp in result metadata");
         }
@@ -772,43 +1462,509 @@ void ICameraAdapter::processCaptureResult(const camera3_capture_result_t *result
         captureResult->second.metadataDone = true;
     }
 
-    // just one stream supported at the moment, hence checking for
-    // output buffer count of one
-    if (result->num_output_buffers == 1) {
-        const camera3_stream_buffer_t &c3Buf = result->output_buffers[0];
-        int width = c3Buf.stream->width;
-        int height = c3Buf.stream->height;
-        buffer_handle_t *pHandle = c3Buf.buffer;
-
-        GraphicBufferMapper &gbm = GraphicBufferMapper::get();
-        Rect bounds(width,height);
-        void *address;
-        status_t status = gbm.lock(static_cast<const native_handle*>(*pHandle),
-                                                                     0,
-                                                                     bounds,
-                                                                     &address);
+    for (uint32_t i = 0; i < result->num_output_buffers; i++) {
+        const camera3_stream_buffer_t &c3Buf = result->output_buffers[i];
+        if (c3Buf.stream == &mJpegStream) {
+            // read by the post processing thread, like the frames
+            captureResult->second.jpegFence = c3Buf.release_fence;
+            captureResult->second.jpegFailed = c3Buf.status != CAMERA3_BUFFER_STATUS_OK;
+            captureResult->second.jpegDone = true;
+            continue;
+        }
 
-        BufferWrapper queuedBuffer = mQueuedBuffers.at(0);
-        if (queuedBuffer.buffer->addr != address) {
-            LOGE("wrong address %p in result buffer, expected %p - "
-                 "sequence mismatch maybe?",
-                 address, queuedBuffer.buffer->addr);
+        if (c3Buf.status != CAMERA3_BUFFER_STATUS_OK) {
+            // failed or flushed, the buffer holds no frame
+            if (c3Buf.release_fence >= 0)
+                ::close(c3Buf.release_fence);
+            captureResult->second.bufferFailed = true;
+            captureResult->second.buffersDone = true;
+            continue;
         }
-        queuedBuffer.buffer->addr = address;
-        queuedBuffer.buffer->sequence = result->frame_number;
 
+        // the HAL may still be writing the buffer. The post processing
+        // thread waits for the release fence and reads the frame, so the
+        // callbacks do not hold mLock for that
+        captureResult->second.handle = c3Buf.buffer;
+        map<buffer_handle_t *, int>::iterator mapped = mMappedBuffers.find(c3Buf.buffer);
+        captureResult->second.generation =
+                mapped != mMappedBuffers.end() ? mapped->second : -1;
+        captureResult->second.releaseFence = c3Buf.release_fence;
+        captureResult->second.width = c3Buf.stream->width;
+        captureResult->second.height = c3Buf.stream->height;
         captureResult->second.buffersDone = true;
     }
 
     // once both metadata and buffers are received, we are done with the results
     // and can timestamp the buffer and return it to icamera user.
-    if (captureResult->second.buffersDone && captureResult->second.metadataDone) {
+    // a failed buffer is sent to the HAL again instead of handing it out
+    Result &r = captureResult->second;
+    if (r.buffersDone && (r.metadataDone || r.bufferFailed) && !r.frameDone) {
         BufferWrapper queuedBuffer = mQueuedBuffers.at(0);
         mQueuedBuffers.erase(mQueuedBuffers.begin());
-        queuedBuffer.buffer->timestamp = captureResult->second.timestamp;
-        mCapturedBuffers.push_back(queuedBuffer);
+        if (r.bufferFailed) {
+            resubmitBuffer(queuedBuffer);
+        } else {
+            queuedBuffer.buffer->timestamp = r.timestamp;
+            queuedBuffer.buffer->sequence = result->frame_number;
+            completeFrame(queuedBuffer, r);
+            mRecoveryAttempts = 0;
+        }
+        r.frameDone = true;
+    }
+    if (r.jpegDone && r.metadataDone)
+        completeJpeg(result->frame_number, r);
+
+    if (r.frameDone && r.metadataDone &&
+        mJpegRequests.find(result->frame_number) == mJpegRequests.end())
+        mResults.erase(captureResult);
+}
+
+/*
+ * A request of which the HAL will not send the result metadata is done
+ * with once its buffers are back.
+ */
+void ICameraAdapter::notifyError(const camera3_error_msg_t &error)
+{
+    Mutex::Autolock lock(mLock);
+    if (error.error_code != CAMERA3_MSG_ERROR_REQUEST &&
+        error.error_code != CAMERA3_MSG_ERROR_RESULT)
+        return;
+
+    map<uint32_t, Result>::iterator captureResult = mResults.find(error.frame_number);
+    if (captureResult == mResults.end()) {
+        Result resultStruct;
+        CLEAR(resultStruct);
+        mResults[error.frame_number] = resultStruct;
+        captureResult = mResults.find(error.frame_number);
+    }
+    Result &r = captureResult->second;
+    r.metadataDone = true;
+    if (r.jpegDone)
+        completeJpeg(error.frame_number, r);
+    if (r.frameDone && mJpegRequests.find(error.frame_number) == mJpegRequests.end())
         mResults.erase(captureResult);
-        mCondition.signal();
+}
+
+/*
+ * Sends a buffer which the HAL returned without a frame to the HAL again.
+ * The HAL callbacks must not send requests, so the post processing thread
+ * sends it; during a recovery, or when stopped, it waits with the new
+ * buffers in mPendingBuffers.
+ *
+ * this function must be called with the mLock locked already
+ */
+void ICameraAdapter::resubmitBuffer(const BufferWrapper &buffer)
+{
+    if (mRecovering || !mStarted || !mPostProcessThread.joinable()) {
+        mPendingBuffers.push_back(buffer);
+        return;
+    }
+
+    PostProcessJob job;
+    job.kind = PostProcessJob::RESUBMIT;
+    job.primary = buffer;
+    job.releaseFence = -1;
+    mPostProcessJobs.push_back(job);
+    mPostProcessCondition.signal();
+}
+
+/*
+ * Reads the JPEG length from the camera3_jpeg_blob trailer into s.size, which
+ * is left 0 when the still capture failed. Only the job is used, so it runs
+ * without mLock.
+ */
+void ICameraAdapter::processJpeg(PostProcessJob &job)
+{
+    camera_buffer_t *buffer = job.primary.buffer;
+    buffer->s.size = 0;
+
+    sp<Fence> releaseFence = new Fence(job.releaseFence);
+    status_t status = releaseFence->wait(RELEASE_FENCE_TIMEOUT);
+    if (status != OK) {
+        LOGE("Still buffer release fence failed in frame %u: %d", buffer->sequence, status);
+        return;
+    }
+    if (job.failed) {
+        LOGE("Still capture failed in frame %u", buffer->sequence);
+        return;
+    }
+
+    int size = job.bufferSize;
+    const camera3_jpeg_blob *blob = reinterpret_cast<const camera3_jpeg_blob *>(
+            static_cast<const uint8_t *>(buffer->addr) + size - sizeof(camera3_jpeg_blob));
+    if (blob->jpeg_blob_id != CAMERA3_JPEG_BLOB_ID ||
+        blob->jpeg_size > (uint32_t)size) {
+        LOGE("Bad jpeg blob, id 0x%x size %u", blob->jpeg_blob_id, blob->jpeg_size);
+    } else {
+        buffer->s.size = blob->jpeg_size;
+    }
+}
+
+/*
+ * Hands a still buffer to the post processing thread, which reads it once
+ * the HAL is done with it. The result no longer holds the still buffer or
+ * its release fence afterwards, so later callbacks of the frame do not
+ * hand it on again.
+ *
+ * this function must be called with the mLock locked already
+ */
+void ICameraAdapter::completeJpeg(uint32_t frameNumber, Result &result)
+{
+    int releaseFence = result.jpegFence;
+    result.jpegDone = false;
+    result.jpegFence = -1;
+
+    map<uint32_t, BufferWrapper>::iterator jpeg = mJpegRequests.find(frameNumber);
+    if (jpeg == mJpegRequests.end()) {
+        LOGE("Unexpected still buffer in frame %u", frameNumber);
+        if (releaseFence >= 0)
+            ::close(releaseFence);
+        return;
+    }
+
+    PostProcessJob job;
+    job.kind = PostProcessJob::JPEG;
+    job.primary = jpeg->second;
+    job.primary.buffer->timestamp = result.timestamp;
+    job.primary.buffer->sequence = frameNumber;
+    job.releaseFence = releaseFence;
+    job.failed = result.jpegFailed;
+    job.bufferSize = mJpegBufferSize;
+    mJpegRequests.erase(jpeg);
+    mPostProcessJobs.push_back(job);
+    mPostProcessCondition.signal();
+}
+
+/*
+ * Hands a finished HAL frame to the post processing thread, which converts
+ * it into the user buffer and fills the virtual streams from it. Every frame
+ * goes through the thread, which keeps the frames in order.
+ *
+ * this function must be called with the mLock locked already
+ */
+void ICameraAdapter::completeFrame(BufferWrapper &buffer, const Result &result)
+{
+    PostProcessJob job;
+    job.kind = PostProcessJob::FRAME;
+    job.primary = buffer;
+    job.handle = result.handle;
+    job.generation = result.generation;
+    job.releaseFence = result.releaseFence;
+    job.width = result.width;
+    job.height = result.height;
+    job.expectedAddr = buffer.buffer->addr;
+    job.convertTo = NULL;
+    job.format = mStreamFormat;
+    map<void *, ShadowBuffer>::iterator shadow =
+            mShadowBuffers.find(mappingKey(buffer.buffer));
+    if (shadow != mShadowBuffers.end()) {
+        // converted stream: the HAL fills our nv12 shadow buffer
+        job.expectedAddr = shadow->second.addr;
+        job.convertTo = shadow->second.dstAddr;
+    }
+    for (auto &virtualStream : mVirtualStreams) {
+        if (virtualStream.queuedBuffers.empty())
+            continue;
+        BufferWrapper virtualBuffer = virtualStream.queuedBuffers.at(0);
+        virtualStream.queuedBuffers.erase(virtualStream.queuedBuffers.begin());
+        virtualBuffer.buffer->timestamp = buffer.buffer->timestamp;
+        virtualBuffer.buffer->sequence = buffer.buffer->sequence;
+        job.virtualBuffers.push_back(virtualBuffer);
+    }
+    mPostProcessJobs.push_back(job);
+    mPostProcessCondition.signal();
+}
+
+/*
+ * Reads a HAL frame: converts it into the user buffer and downscales it into
+ * the virtual stream buffers. Only the job is used, so it runs without mLock.
+ */
+status_t ICameraAdapter::processFrame(PostProcessJob &job)
+{
+    camera_buffer_t *primary = job.primary.buffer;
+
+    // a fence the HAL never signals must not hold up the later frames
+    sp<Fence> releaseFence = new Fence(job.releaseFence);
+    status_t status = releaseFence->wait(RELEASE_FENCE_TIMEOUT);
+    if (status != OK) {
+        LOGE("Release fence of frame %u failed: %d", primary->sequence, status);
+        return status;
+    }
+
+    if (!isCurrentHandle(job.handle, job.generation)) {
+        LOGE("Result buffer of frame %u was unmapped", primary->sequence);
+        return UNKNOWN_ERROR;
+    }
+
+    GraphicBufferMapper &gbm = GraphicBufferMapper::get();
+    Rect bounds(job.width, job.height);
+    android_ycbcr ycbcr;
+    CLEAR(ycbcr);
+    status = gbm.lockAsyncYCbCr(static_cast<const native_handle*>(*job.handle),
+                                0,
+                                bounds,
+                                &ycbcr,
+                                -1);
+    if (status != OK) {
+        LOGE("Could not lock result buffer of frame %u", primary->sequence);
+        return status;
+    }
+    if (ycbcr.y != job.expectedAddr) {
+        LOGE("wrong address %p in result buffer, expected %p - "
+             "sequence mismatch maybe?",
+             ycbcr.y, job.expectedAddr);
+    }
+    const uint8_t *srcY = static_cast<const uint8_t *>(ycbcr.y);
+    // imported buffers are registered as nv21, the chroma plane starts
+    // at whichever of cb and cr comes first
+    const uint8_t *srcUV = static_cast<const uint8_t *>(std::min(ycbcr.cb, ycbcr.cr));
+
+    if (job.convertTo != NULL) {
+        status = mConverter->convertFromNv12(srcY,
+                                             srcUV,
+                                             ycbcr.ystride,
+                                             job.convertTo,
+                                             job.format,
+                                             primary->s.width,
+                                             primary->s.height);
+        if (status != OK)
+            LOGE("Format conversion failed");
+        primary->addr = job.convertTo;
+    } else {
+        primary->addr = ycbcr.y;
+    }
+
+    for (auto &virtualBuffer : job.virtualBuffers) {
+        camera_buffer_t *dst = virtualBuffer.buffer;
+        status = mDownscaler->downscaleNv12(srcY, srcUV,
+                                            ycbcr.ystride,
+                                            primary->s.width,
+                                            primary->s.height,
+                                            dst->addr,
+                                            nv12Stride(dst),
+                                            dst->s.width,
+                                            dst->s.height);
+        if (status != OK)
+            LOGE("Downscaling to virtual stream %d failed", virtualBuffer.stream_id);
+    }
+
+    // unlocking a handle which took the place of ours would drop its lock
+    if (!isCurrentHandle(job.handle, job.generation)) {
+        LOGE("Result buffer of frame %u was unmapped while locked", primary->sequence);
+        return UNKNOWN_ERROR;
+    }
+    gbm.unlock(static_cast<const native_handle*>(*job.handle));
+    return OK;
+}
+
+/*
+ * Sends a buffer without a frame to the HAL again, or keeps it with the new
+ * buffers in mPendingBuffers during a recovery or when stopped.
+ *
+ * this function must be called with the mLock locked already
+ */
+void ICameraAdapter::requeueBuffer(const BufferWrapper &buffer)
+{
+    if (mStarted && !mRecovering)
+        capture(buffer.stream_id, buffer.buffer);
+    else
+        mPendingBuffers.push_back(buffer);
+}
+
+void ICameraAdapter::postProcessLoop()
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    Mutex::Autolock lock(mLock);
+    while (true) {
+        while (!mPostProcessExit && mPostProcessJobs.empty())
+            mPostProcessCondition.wait(mLock);
+        if (mPostProcessExit)
+            return;
+
+        PostProcessJob job = mPostProcessJobs.front();
+        mPostProcessJobs.pop_front();
+
+        if (job.kind == PostProcessJob::RESUBMIT) {
+            requeueBuffer(job.primary);
+            continue;
+        }
+
+        if (job.kind == PostProcessJob::JPEG) {
+            mLock.unlock();
+            processJpeg(job);
+            mLock.lock();
+            mCapturedBuffers.push_back(job.primary);
+            mCondition.broadcast();
+            continue;
+        }
+
+        // reading the frame takes a while, so let the HAL callbacks run meanwhile
+        mLock.unlock();
+        status_t status = processFrame(job);
+        mLock.lock();
+
+        if (status != OK) {
+            // nothing to hand out, the virtual buffers wait for the next frame
+            requeueBuffer(job.primary);
+            for (auto &virtualBuffer : job.virtualBuffers) {
+                VirtualStream *virtualStream = findVirtualStream(virtualBuffer.stream_id);
+                if (virtualStream != NULL)
+                    virtualStream->queuedBuffers.insert(
+                            virtualStream->queuedBuffers.begin(), virtualBuffer);
+            }
+            continue;
+        }
+
+        mCapturedBuffers.push_back(job.primary);
+        mCapturedBuffers.insert(mCapturedBuffers.end(),
+                                job.virtualBuffers.begin(),
+                                job.virtualBuffers.end());
+        mCondition.broadcast();
+    }
+}
+
+void ICameraAdapter::stopPostProcessThread()
+{
+    if (!mPostProcessThread.joinable())
+        return;
+
+    mLock.lock();
+    mPostProcessExit = true;
+    for (auto &job : mPostProcessJobs) {
+        if (job.releaseFence >= 0)
+            ::close(job.releaseFence);
+    }
+    mPostProcessJobs.clear();
+    mPostProcessCondition.signal();
+    mLock.unlock();
+
+    mPostProcessThread.join();
+}
+
+void ICameraAdapter::registerCallback(const icamera::camera_callback_ops_t *callback)
+{
+    Mutex::Autolock lock(mLock);
+    mCallbackOps = callback;
+}
+
+void ICameraAdapter::watchdogLoop()
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    Mutex::Autolock lock(mLock);
+    while (!mWatchdogExit) {
+        mWatchdogCondition.waitRelative(mLock, mWatchdogThreshold / 4);
+        if (mWatchdogExit || !mStarted || mRecovering || mQueuedBuffers.empty())
+            continue;
+
+        nsecs_t age = systemTime() - mQueuedBuffers.at(0).queueTime;
+        if (age < mWatchdogThreshold)
+            continue;
+
+        if (mRecoveryAttempts >= MAX_RECOVERY_ATTEMPTS) {
+            if (mRecoveryAttempts++ == MAX_RECOVERY_ATTEMPTS)
+                LOGE("HAL still stalled after %d recoveries, giving up", MAX_RECOVERY_ATTEMPTS);
+            continue;
+        }
+        mRecoveryAttempts++;
+        recover(age);
+    }
+}
+
+void ICameraAdapter::stopWatchdog()
+{
+    if (!mWatchdogThread.joinable())
+        return;
+
+    mLock.lock();
+    mWatchdogExit = true;
+    mWatchdogCondition.signal();
+    mLock.unlock();
+
+    mWatchdogThread.join();
+}
+
+/*
+ * Flushes the stalled HAL, configures the streams again with the cached
+ * configuration and resubmits all the buffers which did not come back.
+ * New buffers are held in mPendingBuffers meanwhile.
+ *
+ * this function must be called with the mLock locked already
+ */
+void ICameraAdapter::recover(nsecs_t stallAge)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    LOGW("HAL stalled, oldest request is %" PRId64 " ms old, recovering",
+         ns2ms(stallAge));
+
+    camera_msg_data_t msg;
+    CLEAR(msg);
+    msg.type = CAMERA_MSG_RECOVERY;
+    camera_recovery_msg_t &recovery = msg.data.recovery;
+    recovery.stall_ns = stallAge;
+
+    nsecs_t startTime = systemTime();
+    mRecovering = true;
+
+    // flush returns the buffers through processCaptureResult, so unlock
+    mLock.unlock();
+    DOPS(mDevice)->flush((camera3_device_t *)mDevice);
+    mLock.lock();
+    nsecs_t flushTime = systemTime();
+    recovery.flush_ns = flushTime - startTime;
+
+    // whatever did not complete is reclaimed, the results are incomplete
+    vector<BufferWrapper> reclaimed = mQueuedBuffers;
+    mQueuedBuffers.clear();
+    vector<BufferWrapper> jpegBuffers;
+    for (auto &jpeg : mJpegRequests)
+        jpegBuffers.push_back(jpeg.second);
+    mJpegQueuedBuffers.insert(mJpegQueuedBuffers.begin(),
+                              jpegBuffers.begin(), jpegBuffers.end());
+    mJpegRequests.clear();
+    for (auto &result : mResults) {
+        const Result &r = result.second;
+        if (r.buffersDone && !r.bufferFailed && !r.frameDone && r.releaseFence >= 0)
+            ::close(r.releaseFence);
+        if (r.jpegDone && r.jpegFence >= 0)
+            ::close(r.jpegFence);
+    }
+    mResults.clear();
+
+    recovery.status = configureHalStreams();
+    recovery.reconfig_ns = systemTime() - flushTime;
+
+    if (recovery.status == OK) {
+        reclaimed.insert(reclaimed.end(), mPendingBuffers.begin(), mPendingBuffers.end());
+        mPendingBuffers.clear();
+        // capture unlocks, so buffers queued meanwhile land in mPendingBuffers
+        while (!reclaimed.empty()) {
+            for (auto &buffer : reclaimed) {
+                if (capture(buffer.stream_id, buffer.buffer) == OK)
+                    recovery.resubmitted++;
+                else
+                    recovery.status = UNKNOWN_ERROR;
+            }
+            reclaimed = mPendingBuffers;
+            mPendingBuffers.clear();
+        }
+    } else {
+        LOGE("Could not configure the streams again");
+        mPendingBuffers.insert(mPendingBuffers.begin(), reclaimed.begin(), reclaimed.end());
+    }
+    mRecovering = false;
+    recovery.total_ns = systemTime() - startTime;
+
+    LOGW("Recovery %s: flush %" PRId64 " ms, reconfigure %" PRId64 " ms, "
+         "total %" PRId64 " ms, %d buffers resubmitted",
+         recovery.status == OK ? "done" : "failed",
+         ns2ms(recovery.flush_ns), ns2ms(recovery.reconfig_ns),
+         ns2ms(recovery.total_ns), recovery.resubmitted);
+
+    const camera_callback_ops_t *callback = mCallbackOps;
+    if (callback != NULL && callback->notify != NULL) {
+        mLock.unlock();
+        callback->notify(callback, msg);
+        mLock.lock();
     }
 }
 
@@ -826,6 +1982,11 @@ void ICameraAdapter::s_notify(const struct camera3_callback_ops *ops,
             LOGE("Received error code %d for frame %d",
                  msg->message.error.error_code,
                  msg->message.error.frame_number);
+            {
+                ICameraAdapter *adapter =
+                    const_cast<ICameraAdapter*>(static_cast<const ICameraAdapter*>(ops));
+                adapter->notifyError(msg->message.error);
+            }
             break;
         case CAMERA3_MSG_SHUTTER:
             LOG2("Shutter received for frame %d timestamp %" PRId64 "",
@@ -17,16 +17,44 @@
 #ifndef _ICAMERAADAPTER_H_
 #define _ICAMERAADAPTER_H_
 
+#include "ICamera.h"
 #include "Parameters.h"
 #include "hardware/camera3.h"
+#include "ui/Fence.h"
 #include "ui/GraphicBuffer.h"
 #include "ui/GraphicBufferMapper.h"
 #include "Errors.h"
+#include "FormatConverter.h"
+#include "Downscaler.h"
+#include "WorkerPool.h"
 #include <vector>
 #include <map>
+#include <deque>
+#include <thread>
 
 namespace icamera {
 
+/**
+ * \class ICameraAdapter
+ *
+ * The first stream of a configuration is configured to the HAL. Any further
+ * streams are "virtual": NV12 streams no larger than the first one, which are
+ * downscaled from its frames after capture. The supported stream list also
+ * offers the virtual sizes, but they can be used only next to a HAL stream.
+ *
+ * One of the further streams may instead be a JPEG still stream, which is
+ * configured to the HAL as a second, BLOB stream and encoded by it. A queued
+ * still buffer is captured together with the next frame of the first stream,
+ * and it is returned with the JPEG length in s.size.
+ *
+ * A watchdog thread recovers from HAL stalls: when the oldest request has been
+ * in the HAL longer than camera.icamera.watchdog.ms, the HAL is flushed, the
+ * streams are configured again and the buffers are resubmitted. It is off
+ * unless the property is set, which must then allow for the longest exposure.
+ *
+ * Buffers which the HAL returns with an error, such as the ones a flush
+ * returns, are not handed out but sent to the HAL again.
+ */
 class ICameraAdapter : private camera3_callback_ops {
 public:
     ICameraAdapter(int cameraId);
@@ -39,6 +67,7 @@ public:
                 const camera3_capture_result_t *result);
     // camera3_callback_ops instance implementation(s)
     void processCaptureResult(const camera3_capture_result_t *result);
+    void notifyError(const camera3_error_msg_t &error);
 
     status_t open();
     status_t close();
@@ -50,6 +79,7 @@ public:
     status_t allocateMemory(icamera::camera_buffer_t *buffer);
     status_t dqBuf(int stream_id, icamera::camera_buffer_t **buffer);
     status_t qBuf(int stream_id, icamera::camera_buffer_t *buffer);
+    void registerCallback(const icamera::camera_callback_ops_t *callback);
 
 private: // types
     // operation modes used in stream config
@@ -65,19 +95,100 @@ private: // types
     struct BufferWrapper {
         int stream_id;
         icamera::camera_buffer_t *buffer;
+        nsecs_t queueTime; /**< when the request was sent to the HAL */
     };
 
     struct Result {
         bool metadataDone;
         bool buffersDone;
+        bool bufferFailed;  /**< the HAL returned the buffer without a frame */
+        bool jpegDone;      /**< still buffer received and not handed on yet */
+        bool jpegFailed;    /**< the HAL returned the still buffer with an error */
+        int jpegFence;      /**< release fence of the still buffer, while jpegDone */
+        bool frameDone;     /**< first stream buffer handed on */
         uint64_t timestamp; /**< buffer timestamp, for storing metadata value before buffer arrives */
+        buffer_handle_t *handle;  /**< HAL output, read once the release fence signals */
+        int generation;     /**< of a mapped handle, -1 for other handles */
+        int releaseFence;
+        int width;
+        int height;
+    };
+
+    /* stream which is not configured to the HAL but downscaled from it */
+    struct VirtualStream {
+        int id;
+        int width;
+        int height;
+        std::vector<BufferWrapper> queuedBuffers; /**< waiting for the next HAL frame */
+    };
+
+    /* HAL frame waiting for its virtual stream buffers to be filled */
+    struct PostProcessJob {
+        enum {
+            FRAME,          /**< hand out primary and fill the virtual buffers */
+            RESUBMIT,       /**< only send primary to the HAL again */
+            JPEG            /**< primary is a still buffer */
+        } kind;
+        BufferWrapper primary;
+        buffer_handle_t *handle;  /**< HAL buffer with the frame */
+        int generation;     /**< of a mapped handle, -1 for other handles */
+        int releaseFence;
+        bool failed;        /**< JPEG: the HAL returned the buffer with an error */
+        int bufferSize;     /**< JPEG: bytes of the still buffer */
+        int width;          /**< of the HAL buffer */
+        int height;
+        void *expectedAddr; /**< where the HAL buffer is mapped */
+        void *convertTo;    /**< user buffer of a converted stream, else NULL */
+        int format;         /**< v4l2 format to convert to */
+        std::vector<BufferWrapper> virtualBuffers;
+    };
+
+    struct UserMapping {
+        void *addr;
+        size_t size;  /**< 0 if the mapping is not ours */
+    };
+
+    /* NV12 buffer the HAL fills when the user buffer needs format conversion */
+    struct ShadowBuffer {
+        android::sp<android::GraphicBuffer> buffer;
+        void *addr;      /**< NV12 data written by the HAL */
+        void *dstAddr;   /**< user buffer the converted frame is written to */
+        size_t dstSize;  /**< size of our own mapping of dstAddr, 0 if none */
     };
 
 
 private: // functions
     status_t capture(int stream_id, icamera::camera_buffer_t *buffer);
+    status_t configureHalStreams();
+    void reserveHandles(size_t count);
+    buffer_handle_t *takeHandleCell();
     status_t constructDefaultRequest();
     status_t mapMemory(icamera::camera_buffer_t *buffer);
+    status_t allocateShadowBuffer(void *key, void *dstAddr, size_t dstSize,
+                                  camera3_stream_buffer &streamBuffer);
+    void releaseShadowBuffers();
+    static void *mappingKey(const icamera::camera_buffer_t *buffer);
+    static bool isCurrentHandle(buffer_handle_t *handle, int generation);
+    bool isVirtualStream(int stream_id) const;
+    VirtualStream *findVirtualStream(int stream_id);
+    int dequeueStreamId(int stream_id) const;
+    status_t allocateJpegMemory(icamera::camera_buffer_t *buffer);
+    void processJpeg(PostProcessJob &job);
+    void completeJpeg(uint32_t frameNumber, Result &result);
+    status_t allocateVirtualMemory(icamera::camera_buffer_t *buffer);
+    status_t mapVirtualMemory(icamera::camera_buffer_t *buffer);
+    status_t exportBuffer(icamera::camera_buffer_t *buffer,
+                          const android::sp<android::GraphicBuffer> &gb,
+                          int stride, int size);
+    void completeFrame(BufferWrapper &buffer, const Result &result);
+    void resubmitBuffer(const BufferWrapper &buffer);
+    status_t processFrame(PostProcessJob &job);
+    void requeueBuffer(const BufferWrapper &buffer);
+    void postProcessLoop();
+    void stopPostProcessThread();
+    void watchdogLoop();
+    void stopWatchdog();
+    void recover(nsecs_t stallAge);
 
 private: // members
     hw_device_t *mDevice;
@@ -85,15 +196,42 @@ private: // members
     bool mStarted;
     std::vector<BufferWrapper> mPendingBuffers;       /**< buffers which are queued in HAL before calling start() */
     std::vector<android::sp<android::GraphicBuffer>> mAllocatedBuffers; /**< buffer destruction storage */
+    std::vector<int> mExportedFds;                    /**< dup'd fds given out with allocated buffers */
     std::vector<BufferWrapper> mQueuedBuffers;        /**< buffers which are queued for capture */
     std::vector<BufferWrapper> mCapturedBuffers;      /**< buffers which are waiting for dqbuf */
-    std::vector<buffer_handle_t *> mMappedBuffers;    /**< mmapped buffers, storage for destruction */
+    std::map<buffer_handle_t *, int> mMappedBuffers;  /**< mmapped buffers and the generations of their handles */
+    std::deque<buffer_handle_t> mHandleCells;         /**< storage of the mMappedBuffers handles, never shrinks */
+    std::vector<buffer_handle_t *> mFreeHandleCells;  /**< cells of mHandleCells not in use */
     std::map<uint32_t, Result> mResults;              /**< camera3hal capture results */
     std::map<void *, camera3_stream_buffer> mBufferMapping; /**< for finding the cam3 buffer struct with a pointer */
+    std::map<void *, ShadowBuffer> mShadowBuffers;    /**< conversion sources, same keys as mBufferMapping */
     camera3_stream_t mStream;
+    camera3_stream_t mJpegStream;                     /**< HAL BLOB stream of the still stream */
+    int mJpegStreamId;                                /**< -1 if no still stream is configured */
+    int mJpegBufferSize;                              /**< bytes of the still buffers, with the blob trailer */
+    std::vector<BufferWrapper> mJpegQueuedBuffers;    /**< waiting for the next capture request */
+    std::map<uint32_t, BufferWrapper> mJpegRequests;  /**< still buffers in the HAL, by frame number */
+    int mStreamFormat;                                /**< v4l2 format requested by the user */
+    WorkerPool *mWorkerPool;
+    FormatConverter *mConverter;                      /**< created when a non-NV12 stream is configured */
+    Downscaler *mDownscaler;                          /**< created when a virtual stream is configured */
+    std::vector<VirtualStream> mVirtualStreams;
+    std::map<int, UserMapping> mVirtualMappings;      /**< mappings of virtual stream dma buffers, by fd */
+    std::deque<PostProcessJob> mPostProcessJobs;      /**< in capture order */
+    std::thread mPostProcessThread;
+    android::Condition mPostProcessCondition;
+    bool mPostProcessExit;
+    std::thread mWatchdogThread;
+    android::Condition mWatchdogCondition;
+    bool mWatchdogExit;
+    nsecs_t mWatchdogThreshold;                       /**< request age which counts as a stall, 0 disables */
+    bool mRecovering;                                 /**< requests are held back while set */
+    int mRecoveryAttempts;                            /**< recoveries since the last completed frame */
+    const icamera::camera_callback_ops_t *mCallbackOps;
     android::Mutex mLock;
     android::Condition mCondition;
     camera_metadata_t *mRequestSettings;
+    bool mSettingsChanged;                            /**< mRequestSettings were not sent to the HAL yet */
     int mOperationMode; /**< used to pass fps to HAL */
 };
 
@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "MetadataCache"
+
+#include "MetadataCache.h"
+#include "ICamera.h"
+#include "LogHelper.h"
+#include <hardware/camera3.h>
+#include <cutils/properties.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+extern camera_module_t HAL_MODULE_INFO_SYM;
+
+namespace icamera {
+
+/*
+ * A cache file is a CacheHeader followed by the static metadata and the
+ * stream configs, each a camera_metadata_t packet at an offset aligned for
+ * camera_metadata. The packets are sorted and carry their tag index, and
+ * lookups in the read-only mapping use both without writing to it.
+ */
+static const uint32_t CACHE_MAGIC = 0x434d4349; // "ICMC"
+static const uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;           /**< hash of the builds and sensors, see cacheKey() */
+    uint64_t checksum;      /**< hash of the file after the header */
+    uint64_t fileSize;
+    int32_t facing;
+    int32_t orientation;
+    uint32_t staticOffset;
+    uint32_t staticSize;
+    uint32_t streamConfigsOffset;
+    uint32_t streamConfigsSize;
+};
+
+static uint64_t fnv1a(const void *data, size_t size,
+                      uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+struct BuildIdSearch {
+    uintptr_t address;  /**< an address inside the object */
+    string buildId;     /**< hex GNU build id of the object, if it has one */
+    bool found;
+};
+
+static int findBuildId(struct dl_phdr_info *info, size_t, void *data)
+{
+    BuildIdSearch *search = static_cast<BuildIdSearch *>(data);
+    bool contains = false;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+        if (phdr.p_type == PT_LOAD &&
+            search->address >= start && search->address < start + phdr.p_memsz)
+            contains = true;
+    }
+    if (!contains)
+        return 0;
+
+    search->found = true;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_NOTE)
+            continue;
+        const uint8_t *note = (const uint8_t *)(info->dlpi_addr + phdr.p_vaddr);
+        const uint8_t *end = note + phdr.p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)note;
+            const uint8_t *name = note + sizeof(ElfW(Nhdr));
+            const uint8_t *desc = name + ((nhdr->n_namesz + 3) & ~3);
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+                memcmp(name, "GNU", 4) == 0) {
+                char hex[3];
+                for (uint32_t j = 0; j < nhdr->n_descsz; j++) {
+                    snprintf(hex, sizeof(hex), "%02x", desc[j]);
+                    search->buildId += hex;
+                }
+                return 1;
+            }
+            note = desc + ((nhdr->n_descsz + 3) & ~3);
+        }
+    }
+    return 1;
+}
+
+/*
+ * The GNU build id of the loaded object containing address, or the size and
+ * modification time of its file if it has none. Empty if neither is known.
+ */
+static string buildIdOf(const void *address)
+{
+    BuildIdSearch search = { (uintptr_t)address, string(), false };
+    dl_iterate_phdr(findBuildId, &search);
+    if (!search.buildId.empty())
+        return search.buildId;
+
+    Dl_info info;
+    struct stat st;
+    if (dladdr(address, &info) == 0 || info.dli_fname == NULL ||
+        stat(info.dli_fname, &st) != 0)
+        return string();
+    return std::to_string(st.st_size) + "-" + std::to_string(st.st_mtime);
+}
+
+/*
+ * The names of the V4L2 sub-devices, the sensors among them, which tell
+ * whether other sensors were attached since the cache was written.
+ */
+static string sensorNames()
+{
+    static const char *dirName = "/sys/class/video4linux";
+    vector<string> names;
+    DIR *dir = opendir(dirName);
+    if (dir == NULL)
+        return string();
+    struct dirent *dirEntry;
+    while ((dirEntry = readdir(dir)) != NULL) {
+        if (strncmp(dirEntry->d_name, "v4l-subdev", 10) != 0)
+            continue;
+        string path = string(dirName) + "/" + dirEntry->d_name + "/name";
+        char name[64] = "";
+        FILE *file = fopen(path.c_str(), "r");
+        if (file == NULL)
+            continue;
+        if (fgets(name, sizeof(name), file) != NULL)
+            names.push_back(name);
+        fclose(file);
+    }
+    closedir(dir);
+
+    std::sort(names.begin(), names.end());
+    string joined;
+    for (auto &name : names)
+        joined += name;
+    return joined;
+}
+
+/*
+ * The key of the cache files of the running process, from the builds of the
+ * HAL, of this adapter, which chooses the stream configs, and of the
+ * camera_metadata library, whose packet layout the cache holds, and from the
+ * sensors. 0 if the builds are unknown, which disables the cache.
+ */
+static uint64_t cacheKey()
+{
+    static const uint64_t key = [] {
+        string hal = buildIdOf(&HAL_MODULE_INFO_SYM);
+        string adapter = buildIdOf((const void *)&camera_hal_init);
+        string metadata = buildIdOf((const void *)&validate_camera_metadata_structure);
+        if (hal.empty() || adapter.empty() || metadata.empty())
+            return (uint64_t)0;
+        string key = "hal:" + hal + ";adapter:" + adapter +
+                     ";metadata:" + metadata + ";sensors:" + sensorNames();
+        return fnv1a(key.data(), key.size());
+    }();
+    return key;
+}
+
+/*
+ * A sorted and compacted copy of a packet with its tag index built, as it is
+ * written to the cache. The caller frees it.
+ */
+static camera_metadata_t *prepareForCache(const camera_metadata_t *metadata)
+{
+    camera_metadata_t *copy = allocate_camera_metadata(
+            get_camera_metadata_entry_count(metadata),
+            get_camera_metadata_data_count(metadata));
+    if (copy == NULL)
+        return NULL;
+    if (append_camera_metadata(copy, metadata) != OK ||
+        compact_camera_metadata(copy) != OK ||
+        sort_camera_metadata(copy) != OK) {
+        free_camera_metadata(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+static bool writeAll(int fd, const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+/*
+ * The packet at offset of a mapped cache file, or NULL if it is not a valid
+ * packet.
+ */
+static const camera_metadata_t *mappedPacket(const uint8_t *map, size_t mapSize,
+                                             uint32_t offset, uint32_t size)
+{
+    if (offset % get_camera_metadata_alignment() != 0 ||
+        offset > mapSize || size > mapSize - offset)
+        return NULL;
+    const camera_metadata_t *packet =
+            reinterpret_cast<const camera_metadata_t *>(map + offset);
+    size_t packetSize = size;
+    if (validate_camera_metadata_structure(packet, &packetSize) != OK)
+        return NULL;
+    return packet;
+}
+
+MetadataCache::MetadataCache() :
+    mMap(NULL),
+    mMapSize(0)
+{
+}
+
+MetadataCache::~MetadataCache()
+{
+    unmap();
+}
+
+void MetadataCache::unmap()
+{
+    if (mMap != NULL)
+        munmap(mMap, mMapSize);
+    mMap = NULL;
+    mMapSize = 0;
+}
+
+bool MetadataCache::cachePath(int cameraId, string &path)
+{
+    char dir[PROPERTY_VALUE_MAX];
+    property_get("camera.icamera.cache.dir", dir, "/var/cache/icamera");
+    if (dir[0] == '\0' || cacheKey() == 0)
+        return false;
+    path = string(dir) + "/camera" + std::to_string(cameraId) + ".cache";
+    return true;
+}
+
+bool MetadataCache::load(int cameraId, Contents &contents)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    string path;
+    if (!cachePath(cameraId, path))
+        return false;
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+    unmap();
+    mMapSize = st.st_size;
+    mMap = mmap(NULL, mMapSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mMap == MAP_FAILED) {
+        mMap = NULL;
+        return false;
+    }
+
+    const uint8_t *map = static_cast<const uint8_t *>(mMap);
+    const CacheHeader *header = reinterpret_cast<const CacheHeader *>(map);
+    if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION ||
+        header->key != cacheKey() || header->fileSize != mMapSize ||
+        header->checksum != fnv1a(map + sizeof(CacheHeader),
+                                  mMapSize - sizeof(CacheHeader))) {
+        LOG1("stale or damaged cache %s", path.c_str());
+        unmap();
+        return false;
+    }
+
+    contents.staticMetadata = mappedPacket(map, mMapSize,
+            header->staticOffset, header->staticSize);
+    contents.streamConfigs = mappedPacket(map, mMapSize,
+            header->streamConfigsOffset, header->streamConfigsSize);
+    if (contents.staticMetadata == NULL || contents.streamConfigs == NULL) {
+        LOGW("invalid metadata in cache %s", path.c_str());
+        unmap();
+        return false;
+    }
+    contents.facing = header->facing;
+    contents.orientation = header->orientation;
+    LOG1("static metadata of camera %d loaded from %s", cameraId, path.c_str());
+    return true;
+}
+
+status_t MetadataCache::store(int cameraId, const Contents &contents)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    string path;
+    if (!cachePath(cameraId, path))
+        return INVALID_OPERATION;
+
+    camera_metadata_t *packets[2] = {
+        prepareForCache(contents.staticMetadata),
+        prepareForCache(contents.streamConfigs)
+    };
+    if (packets[0] == NULL || packets[1] == NULL) {
+        free_camera_metadata(packets[0]);
+        free_camera_metadata(packets[1]);
+        LOGE("couldn't prepare the metadata of camera %d for the cache", cameraId);
+        return NO_MEMORY;
+    }
+
+    // lay out the packets after the header, and checksum them with padding
+    const size_t alignment = get_camera_metadata_alignment();
+    size_t offsets[2];
+    size_t sizes[2];
+    size_t fileSize = sizeof(CacheHeader);
+    for (int i = 0; i < 2; i++) {
+        offsets[i] = (fileSize + alignment - 1) / alignment * alignment;
+        sizes[i] = get_camera_metadata_size(packets[i]);
+        fileSize = offsets[i] + sizes[i];
+    }
+    vector<uint8_t> body(fileSize - sizeof(CacheHeader), 0);
+    for (int i = 0; i < 2; i++)
+        memcpy(&body[offsets[i] - sizeof(CacheHeader)], packets[i], sizes[i]);
+    free_camera_metadata(packets[0]);
+    free_camera_metadata(packets[1]);
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.key = cacheKey();
+    header.checksum = fnv1a(body.data(), body.size());
+    header.fileSize = fileSize;
+    header.facing = contents.facing;
+    header.orientation = contents.orientation;
+    header.staticOffset = offsets[0];
+    header.staticSize = sizes[0];
+    header.streamConfigsOffset = offsets[1];
+    header.streamConfigsSize = sizes[1];
+
+    // the cache directory may not exist yet, its parent has to
+    string dir = path.substr(0, path.rfind('/'));
+    mkdir(dir.c_str(), 0755);
+
+    // written to a temporary file first, a reader sees the old file or the
+    // complete new one
+    string tmpPath = path + ".tmp" + std::to_string(getpid());
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOGW("couldn't create cache %s: %s", tmpPath.c_str(), strerror(errno));
+        return UNKNOWN_ERROR;
+    }
+    bool written = writeAll(fd, &header, sizeof(header)) &&
+                   writeAll(fd, body.data(), body.size()) &&
+                   fsync(fd) == 0;
+    close(fd);
+    if (!written || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        LOGW("couldn't write cache %s: %s", path.c_str(), strerror(errno));
+        unlink(tmpPath.c_str());
+        return UNKNOWN_ERROR;
+    }
+    LOG1("static metadata of camera %d stored in %s", cameraId, path.c_str());
+    return OK;
+}
+
+} // namespace icamera
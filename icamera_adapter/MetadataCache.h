@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _METADATACACHE_H_
+#define _METADATACACHE_H_
+
+#include <system/camera_metadata.h>
+#include <stddef.h>
+#include <string>
+#include "Errors.h"
+
+namespace icamera {
+
+/**
+ * \class MetadataCache
+ *
+ * On-disk cache of what the adapter learns about a camera at startup: the
+ * static metadata from the HAL, the camera_info fields and the stream
+ * configs the adapter derives from them. A warm start maps the cache file
+ * read-only instead of asking the HAL, so the pages are shared by all the
+ * processes using the camera.
+ *
+ * A cache file is valid for one camera of one HAL build with the same
+ * sensors attached, and is checksummed. Files are replaced by writing a
+ * temporary file and renaming it, so readers never see a partial file.
+ */
+class MetadataCache {
+public:
+    /** What is cached for a camera */
+    struct Contents {
+        const camera_metadata_t *staticMetadata;
+        const camera_metadata_t *streamConfigs;
+        int facing;
+        int orientation;
+    };
+
+    MetadataCache();
+    ~MetadataCache();
+
+    /**
+     * Maps the cache file of a camera. Returns true, with the contents
+     * pointing into the mapping, if the file is valid for the running HAL
+     * and sensors. The contents stay valid as long as the cache object.
+     */
+    bool load(int cameraId, Contents &contents);
+
+    /**
+     * Writes the cache file of a camera, replacing the one there is.
+     */
+    status_t store(int cameraId, const Contents &contents);
+
+private:
+    bool cachePath(int cameraId, std::string &path);
+    void unmap();
+
+private:
+    void *mMap;      /**< read-only mapping of the loaded cache file */
+    size_t mMapSize;
+
+    // a MetadataCache cannot be copied
+    MetadataCache(const MetadataCache&);
+    MetadataCache& operator=(const MetadataCache&);
+};
+
+} // namespace icamera
+
+#endif /* _METADATACACHE_H_ */
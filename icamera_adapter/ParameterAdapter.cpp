@@ -72,9 +72,8 @@ namespace ParameterAdapter {
             stepCount = evRangeEntry.data.i32[0];
         }
 
-        status_t status = outputMetadata.update(ANDROID_CONTROL_AE_EXPOSURE_COMPENSATION,
-                                                &stepCount,
-                                                1);
+        status_t status = outputMetadata.update<ANDROID_CONTROL_AE_EXPOSURE_COMPENSATION>(
+                &stepCount, 1);
 
         return status;
     }
@@ -137,9 +136,8 @@ namespace ParameterAdapter {
         fpsRange[1] = fpsRangesEntry.data.i32[index + 1];
         LOG1("Setting target fps range [%d, %d]", fpsRange[0], fpsRange[1]);
 
-        status_t status = outputMetadata.update(ANDROID_CONTROL_AE_TARGET_FPS_RANGE,
-                                                fpsRange,
-                                                2);
+        status_t status = outputMetadata.update<ANDROID_CONTROL_AE_TARGET_FPS_RANGE>(
+                fpsRange, 2);
 
         return status;
     }
@@ -178,9 +176,8 @@ namespace ParameterAdapter {
         }
         LOG1("DVS mode: %u", dvsMode);
 
-        status_t status = outputMetadata.update(ANDROID_CONTROL_VIDEO_STABILIZATION_MODE,
-                                                &dvsMode,
-                                                1);
+        status_t status = outputMetadata.update<ANDROID_CONTROL_VIDEO_STABILIZATION_MODE>(
+                &dvsMode, 1);
         return status;
     }
 
@@ -199,9 +196,8 @@ namespace ParameterAdapter {
             aeMode = ANDROID_CONTROL_AE_MODE_OFF;
 
         LOG1("AE mode: %d", aeMode);
-        status_t status = outputMetadata.update(ANDROID_CONTROL_AE_MODE,
-                                                &aeMode,
-                                                1);
+        status_t status = outputMetadata.update<ANDROID_CONTROL_AE_MODE>(
+                &aeMode, 1);
 
         return status;
     }
@@ -247,9 +243,8 @@ namespace ParameterAdapter {
 
         LOG1("exposureTime (ns): %ld. Supported range [%ld, %ld]", exposureTimeNs, etMin, etMax);
 
-        status_t status = outputMetadata.update(ANDROID_SENSOR_EXPOSURE_TIME,
-                                                &exposureTimeNs,
-                                                1);
+        status_t status = outputMetadata.update<ANDROID_SENSOR_EXPOSURE_TIME>(
+                &exposureTimeNs, 1);
 
         return status;
     }
@@ -305,9 +300,8 @@ namespace ParameterAdapter {
         }
         LOG1("Antibanding mode: %u", androidMode);
 
-        status_t status = outputMetadata.update(ANDROID_CONTROL_AE_ANTIBANDING_MODE,
-                                                &androidMode,
-                                                1);
+        status_t status = outputMetadata.update<ANDROID_CONTROL_AE_ANTIBANDING_MODE>(
+                &androidMode, 1);
         return status;
     }
 
@@ -19,15 +19,22 @@
 
 #include "RWLock.h"
 #include "Parameters.h"
+#include "FormatConverter.h"
 #include "camera/CameraMetadata.h"
+#include "camera/CameraMetadataSnapshot.h"
+#include "camera/CameraMetadataView.h"
 #include "LogHelper.h"
 
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 
 namespace icamera {
+using android::CameraMetadataPublisher;
+using android::CameraMetadataSnapshot;
+using android::CameraMetadataView;
+using android::sp;
 
 Parameters::Parameters() :
-        mMetadata(new CameraMetadata()),
+        mMetadata(new CameraMetadataPublisher()),
         mRwLock(new RWLock()),
         mEv(0),
         mFps(30),
@@ -38,7 +45,7 @@ Parameters::Parameters() :
 {}
 
 Parameters::Parameters(const Parameters& other) :
-        mMetadata(new CameraMetadata(*other.mMetadata)),
+        mMetadata(new CameraMetadataPublisher(other.mMetadata->current())),
         mRwLock(new RWLock()),
         mEv(other.mEv),
         mFps(other.mFps),
@@ -50,10 +57,10 @@ Parameters::Parameters(const Parameters& other) :
 
 Parameters& Parameters::operator=(const Parameters& other)
 {
-    // Release the old buffer and assign to a new one
+    // Release the old buffer and share the other one
     AutoWMutex wl(*mRwLock);
     if (&other != this) {
-        *mMetadata = *other.mMetadata;
+        mMetadata->publish(other.mMetadata->current());
         mEv = other.mEv;
         mFps = other.mFps;
         mDvsMode = other.mDvsMode;
@@ -66,10 +73,8 @@ Parameters& Parameters::operator=(const Parameters& other)
 
 Parameters::~Parameters()
 {
-    if (mMetadata) {
-        delete mMetadata;
-        mMetadata = NULL;
-    }
+    delete mMetadata;
+    mMetadata = NULL;
     delete mRwLock;
     mRwLock = NULL;
 }
@@ -362,8 +367,9 @@ int Parameters::getSupportedFpsRange(camera_range_array_t& ranges) const
 int Parameters::getSupportedStreamConfig(stream_array_t& config) const
 {
     config.clear();
-    AutoRMutex rl(*mRwLock);
-    camera_metadata_ro_entry_t entry = getConstPtr()->find(ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS);
+    sp<CameraMetadataSnapshot> snapshot = mMetadata->current();
+    camera_metadata_ro_entry_t entry = CameraMetadataView(snapshot->buffer()).find(
+            ANDROID_SCALER_AVAILABLE_STREAM_CONFIGURATIONS);
     const int streamConfMemberNum = STREAM_MEMBER_NUM;
     if (entry.count == 0 || entry.count % streamConfMemberNum != 0) {
         return NAME_NOT_FOUND;
@@ -379,8 +385,7 @@ int Parameters::getSupportedStreamConfig(stream_array_t& config) const
         s.field = entry.data.i32[i + 3];
         s.stride = s.width; // fixme
         //s.stride = CameraUtils::getStride(s.format, s.width);
-        s.size = s.stride * s.height * 3 / 2; // fixme
-        //s.size = CameraUtils::getFrameSize(s.format, s.width, s.height, s.field);
+        s.size = FormatConverter::getFrameSize(s.format, s.width, s.height);
         config.push_back(s);
     }
     return OK;
@@ -483,7 +488,20 @@ int Parameters::getYuvColorRangeMode(camera_yuv_color_range_mode_t& colorRange)
 
 void Parameters::merge(const Parameters& other)
 {
-    merge(other.mMetadata);
+    HAL_TRACE_CALL(2);
+    sp<CameraMetadataSnapshot> snapshot = other.mMetadata->current();
+    if (snapshot->isEmpty()) {
+        // Nothing needs to be merged
+        return;
+    }
+
+    AutoWMutex wl(*mRwLock);
+    if (mMetadata->current()->isEmpty()) {
+        // Nothing to merge into, share the other buffer
+        mMetadata->publish(snapshot);
+        return;
+    }
+    mergeBuffer(snapshot->buffer());
 }
 
 void Parameters::merge(const CameraMetadata* metadata)
@@ -496,7 +514,20 @@ void Parameters::merge(const CameraMetadata* metadata)
 
     AutoWMutex wl(*mRwLock);
     const camera_metadata_t* src = const_cast<CameraMetadata*>(metadata)->getAndLock();
-    size_t count = metadata->entryCount();
+    mergeBuffer(src);
+    const_cast<CameraMetadata*>(metadata)->unlock(src);
+}
+
+/* Copies the current metadata, merges src into the copy and publishes it.
+ * The readers of the current metadata keep reading it meanwhile.
+ * Called with the write lock held.
+ */
+void Parameters::mergeBuffer(const camera_metadata_t* src)
+{
+    CameraMetadata merged(CameraMetadata::sharedPool());
+    merged = mMetadata->current()->buffer();
+
+    size_t count = get_camera_metadata_entry_count(src);
     camera_metadata_ro_entry_t entry;
     for (size_t i = 0; i < count; i++) {
         CLEAR(entry);
@@ -505,29 +536,29 @@ void Parameters::merge(const CameraMetadata* metadata)
         }
         switch (entry.type) {
         case TYPE_BYTE:
-            mMetadata->update(entry.tag, entry.data.u8, entry.count);
+            merged.update(entry.tag, entry.data.u8, entry.count);
             break;
         case TYPE_INT32:
-            mMetadata->update(entry.tag, entry.data.i32, entry.count);
+            merged.update(entry.tag, entry.data.i32, entry.count);
             break;
         case TYPE_FLOAT:
-            mMetadata->update(entry.tag, entry.data.f, entry.count);
+            merged.update(entry.tag, entry.data.f, entry.count);
             break;
         case TYPE_INT64:
-            mMetadata->update(entry.tag, entry.data.i64, entry.count);
+            merged.update(entry.tag, entry.data.i64, entry.count);
             break;
         case TYPE_DOUBLE:
-            mMetadata->update(entry.tag, entry.data.d, entry.count);
+            merged.update(entry.tag, entry.data.d, entry.count);
             break;
         case TYPE_RATIONAL:
-            mMetadata->update(entry.tag, entry.data.r, entry.count);
+            merged.update(entry.tag, entry.data.r, entry.count);
             break;
         default:
             LOGW("Invalid entry type, should never happen");
             break;
         }
     }
-    const_cast<CameraMetadata*>(metadata)->unlock(src);
+    mMetadata->publish(CameraMetadataSnapshot::acquire(merged));
 }
 
 int Parameters::setRegions(camera_window_list_t regions, int tag)
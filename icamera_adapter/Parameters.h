@@ -44,6 +44,10 @@
 #include <vector>
 #include <stdint.h>
 
+namespace android {
+class CameraMetadataPublisher;
+}
+
 namespace icamera {
 using android::CameraMetadata;
 
@@ -1015,14 +1019,15 @@ public:
 
     int updateDebugLevel();
 private:
-    const CameraMetadata* getConstPtr() const
-            { return const_cast<const CameraMetadata*>(mMetadata); }
+    void mergeBuffer(const camera_metadata_t* src);
 
     int setRegions(camera_window_list_t regions, int tag);
     int getRegions(camera_window_list_t& regions, int tag) const;
 
 private:
-    CameraMetadata* mMetadata; // Internal data structure
+    // Internal data structure, shared with the copies of this object until
+    // either is changed
+    android::CameraMetadataPublisher* mMetadata;
     RWLock* mRwLock;           // Read-write lock to make this class thread-safe
     // parameters for which conversion is supported are stored here
     int mEv;
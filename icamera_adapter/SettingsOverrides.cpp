@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "SettingsOverrides"
+
+#include "LogHelper.h"
+#include "SettingsOverrides.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+using android::CameraMetadata;
+using std::vector;
+
+namespace icamera {
+namespace SettingsOverrides {
+
+static char *trim(char *text)
+{
+    while (isspace((unsigned char)*text))
+        text++;
+    char *end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return text;
+}
+
+/* the next value of a list, NULL at the end of it */
+static char *nextValue(char *&values)
+{
+    while (*values == ',' || isspace((unsigned char)*values))
+        values++;
+    if (*values == '\0')
+        return NULL;
+    char *value = values;
+    while (*values != '\0' && *values != ',' && !isspace((unsigned char)*values))
+        values++;
+    if (*values != '\0')
+        *values++ = '\0';
+    return value;
+}
+
+static bool parseValue(const char *text, int64_t &value)
+{
+    char *end;
+    errno = 0;
+    value = strtoll(text, &end, 0);
+    return errno == 0 && end != text && *end == '\0';
+}
+
+static bool parseValue(const char *text, double &value)
+{
+    char *end;
+    errno = 0;
+    value = strtod(text, &end);
+    return errno == 0 && end != text && *end == '\0';
+}
+
+static bool parseValue(const char *text, camera_metadata_rational_t &value)
+{
+    int64_t numerator, denominator;
+    char number[32];
+    const char *slash = strchr(text, '/');
+    if (slash == NULL || slash - text >= (int)sizeof(number))
+        return false;
+    memcpy(number, text, slash - text);
+    number[slash - text] = '\0';
+    if (!parseValue(number, numerator) || !parseValue(slash + 1, denominator))
+        return false;
+    if (numerator < std::numeric_limits<int32_t>::min() ||
+        numerator > std::numeric_limits<int32_t>::max() ||
+        denominator < std::numeric_limits<int32_t>::min() ||
+        denominator > std::numeric_limits<int32_t>::max())
+        return false;
+    value.numerator = numerator;
+    value.denominator = denominator;
+    return true;
+}
+
+/* whether a parsed value can be stored as T without changing it */
+template<typename T>
+static bool fits(int64_t value)
+{
+    return value >= std::numeric_limits<T>::min() &&
+           value <= std::numeric_limits<T>::max();
+}
+
+template<typename T>
+static bool fits(double value)
+{
+    return !std::isfinite(value) || std::fabs(value) <= std::numeric_limits<T>::max();
+}
+
+template<typename T>
+static bool fits(const camera_metadata_rational_t &)
+{
+    return true;
+}
+
+/* parses the values as Parsed, and updates the tag with them as T */
+template<typename T, typename Parsed>
+static status_t updateValues(uint32_t tag, char *values, CameraMetadata &patch,
+                             const char *path, int lineNumber)
+{
+    vector<T> data;
+    Parsed parsed;
+    for (char *value = nextValue(values); value != NULL; value = nextValue(values)) {
+        if (!parseValue(value, parsed))
+            return BAD_VALUE;
+        if (!fits<T>(parsed)) {
+            LOGW("%s:%d: %s is out of range for %s", path, lineNumber, value,
+                 get_camera_metadata_tag_name(tag));
+            return BAD_VALUE;
+        }
+        data.push_back(static_cast<T>(parsed));
+    }
+    if (data.empty())
+        return BAD_VALUE;
+    return patch.update(tag, data.data(), data.size());
+}
+
+static status_t parseLine(char *line, CameraMetadata &patch,
+                          const char *path, int lineNumber)
+{
+    char *equals = strchr(line, '=');
+    if (equals == NULL)
+        return BAD_VALUE;
+    *equals = '\0';
+    const char *name = trim(line);
+    char *values = equals + 1;
+
+    uint32_t tag;
+    if (find_camera_metadata_tag(name, &tag) != OK) {
+        LOGW("unknown tag %s", name);
+        return NAME_NOT_FOUND;
+    }
+    switch (get_camera_metadata_tag_type(tag)) {
+    case TYPE_BYTE:
+        return updateValues<uint8_t, int64_t>(tag, values, patch, path, lineNumber);
+    case TYPE_INT32:
+        return updateValues<int32_t, int64_t>(tag, values, patch, path, lineNumber);
+    case TYPE_INT64:
+        return updateValues<int64_t, int64_t>(tag, values, patch, path, lineNumber);
+    case TYPE_FLOAT:
+        return updateValues<float, double>(tag, values, patch, path, lineNumber);
+    case TYPE_DOUBLE:
+        return updateValues<double, double>(tag, values, patch, path, lineNumber);
+    case TYPE_RATIONAL:
+        return updateValues<camera_metadata_rational_t,
+                            camera_metadata_rational_t>(tag, values, patch,
+                                                        path, lineNumber);
+    default:
+        return BAD_TYPE;
+    }
+}
+
+status_t load(const char *path, CameraMetadata &patch)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        LOG1("no settings overrides in %s", path);
+        return NAME_NOT_FOUND;
+    }
+
+    char line[1024];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char *text = trim(line);
+        if (*text == '\0')
+            continue;
+        if (parseLine(text, patch, path, lineNumber) != OK)
+            LOGW("%s:%d: invalid override, skipped", path, lineNumber);
+    }
+    fclose(file);
+    LOG1("%zu settings overrides from %s", patch.entryCount(), path);
+    return OK;
+}
+
+} // namespace SettingsOverrides
+} // namespace icamera
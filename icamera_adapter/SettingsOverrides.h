@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SETTINGSOVERRIDES_H_
+#define _SETTINGSOVERRIDES_H_
+
+#include "camera/CameraMetadata.h"
+#include "Errors.h"
+
+/**
+ * Overrides of request settings, read from a text file so that HAL controls
+ * can be tuned without rebuilding. Each line sets one tag by its full name,
+ * with the values in the type of the tag, separated by commas or spaces,
+ * and rationals written as numerator/denominator:
+ *
+ *   # comment
+ *   android.control.aeMode = 1
+ *   android.control.aeTargetFpsRange = 15, 30
+ *   android.colorCorrection.transform = 1/1 0/1 0/1 0/1 1/1 0/1 0/1 0/1 1/1
+ *
+ * The file is parsed once into a metadata patch, which is applied to the
+ * request settings after the settings from the icamera parameters.
+ */
+namespace icamera {
+namespace SettingsOverrides {
+    /**
+     * \param [IN]  path of the override file
+     * \param [OUT] patch where the overridden tags are written
+     * \return OK if the file was read, NAME_NOT_FOUND if there is none.
+     *         Lines which can't be parsed, or with values out of the
+     *         range of the type of the tag, are skipped with a warning.
+     */
+    status_t load(const char *path, android::CameraMetadata &patch);
+} // namespace SettingsOverrides
+} // namespace icamera
+
+#endif /* _SETTINGSOVERRIDES_H_ */
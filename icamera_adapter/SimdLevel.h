@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SIMDLEVEL_H_
+#define _SIMDLEVEL_H_
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ICAMERA_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace icamera {
+
+/**
+ * Instruction set extensions the pixel kernels are built for. The kernels
+ * are compiled with per-function target attributes, so the whole library
+ * still runs on cpus without them.
+ */
+enum {
+    SIMD_NONE,
+    SIMD_SSE41,
+    SIMD_AVX2,
+};
+
+inline int detectSimdLevel()
+{
+#ifdef ICAMERA_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SIMD_SSE41;
+#endif
+    return SIMD_NONE;
+}
+
+inline const char *simdLevelName(int level)
+{
+    switch (level) {
+    case SIMD_AVX2:
+        return "AVX2";
+    case SIMD_SSE41:
+        return "SSE4.1";
+    default:
+        return "C";
+    }
+}
+
+} // namespace icamera
+
+#endif /* _SIMDLEVEL_H_ */
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "WorkerPool"
+
+#include "WorkerPool.h"
+#include "LogHelper.h"
+#include <unistd.h>
+#include <algorithm>
+
+using android::Mutex;
+
+namespace icamera {
+
+WorkerPool::WorkerPool(int numThreads) :
+    mExit(false)
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    if (numThreads <= 0)
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads <= 0)
+        numThreads = 1;
+
+    // the caller of parallelFor() is one of the workers
+    for (int i = 1; i < numThreads; i++)
+        mWorkers.push_back(std::thread(&WorkerPool::workerLoop, this));
+
+    LOG1("worker pool started with %d threads", numThreads);
+}
+
+WorkerPool::~WorkerPool()
+{
+    HAL_TRACE_CALL(CAMERA_DEBUG_LOG_LEVEL1);
+    {
+        Mutex::Autolock lock(mLock);
+        mExit = true;
+        mWorkAvailable.broadcast();
+    }
+    for (auto &worker : mWorkers)
+        worker.join();
+}
+
+void WorkerPool::parallelFor(int count, const std::function<void(int)> &job)
+{
+    if (count <= 0)
+        return;
+
+    if (mWorkers.empty() || count == 1) {
+        for (int i = 0; i < count; i++)
+            job(i);
+        return;
+    }
+
+    Batch batch;
+    batch.job = &job;
+    batch.count = count;
+    batch.next = 0;
+    batch.remaining = count;
+
+    Mutex::Autolock lock(mLock);
+    mBatches.push_back(&batch);
+    mWorkAvailable.broadcast();
+
+    // help out until everything is handed out, then wait for stragglers
+    while (runOne(&batch)) {}
+    while (batch.remaining > 0)
+        mBatchDone.wait(mLock);
+}
+
+/* this function must be called with the mLock locked already */
+bool WorkerPool::runOne(Batch *batch)
+{
+    if (batch->next >= batch->count)
+        return false;
+
+    int index = batch->next++;
+    if (batch->next == batch->count) {
+        // nothing left to hand out, hide the batch from idle workers
+        mBatches.erase(std::find(mBatches.begin(), mBatches.end(), batch));
+    }
+
+    mLock.unlock();
+    (*batch->job)(index);
+    mLock.lock();
+
+    if (--batch->remaining == 0)
+        mBatchDone.broadcast();
+
+    return true;
+}
+
+void WorkerPool::workerLoop()
+{
+    Mutex::Autolock lock(mLock);
+    while (true) {
+        while (!mExit && mBatches.empty())
+            mWorkAvailable.wait(mLock);
+        if (mExit)
+            return;
+        runOne(mBatches.front());
+    }
+}
+
+} // namespace icamera
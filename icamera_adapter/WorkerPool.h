@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2016 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _WORKERPOOL_H_
+#define _WORKERPOOL_H_
+
+#include <utils/Mutex.h>
+#include <utils/Condition.h>
+#include <functional>
+#include <thread>
+#include <deque>
+#include <vector>
+
+namespace icamera {
+
+/**
+ * \class WorkerPool
+ *
+ * Small fixed-size thread pool for splitting per-frame pixel work into
+ * stripes. The calling thread takes part in parallelFor(), so a pool of
+ * size 1 runs everything inline without any thread hand-off.
+ */
+class WorkerPool {
+public:
+    /**
+     * \param numThreads total number of threads doing work, including the
+     *        caller. 0 means one per online cpu.
+     */
+    explicit WorkerPool(int numThreads = 0);
+    ~WorkerPool();
+
+    /** Number of threads taking part in parallelFor(), caller included */
+    int size() const { return mWorkers.size() + 1; }
+
+    /**
+     * Runs job(0) .. job(count - 1) on the pool and returns when all of
+     * them are done.
+     */
+    void parallelFor(int count, const std::function<void(int)> &job);
+
+private:
+    struct Batch {
+        const std::function<void(int)> *job;
+        int count;
+        int next;       /**< next index to hand out */
+        int remaining;  /**< indices not yet finished */
+    };
+
+    void workerLoop();
+    bool runOne(Batch *batch);
+
+private:
+    std::vector<std::thread> mWorkers;
+    std::deque<Batch *> mBatches;   /**< batches with indices left to hand out */
+    android::Mutex mLock;
+    android::Condition mWorkAvailable;
+    android::Condition mBatchDone;
+    bool mExit;
+
+    // a WorkerPool cannot be copied
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+};
+
+} // namespace icamera
+
+#endif /* _WORKERPOOL_H_ */
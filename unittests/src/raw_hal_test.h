@@ -22,6 +22,7 @@
 #include <vector>
 #include <map>
 #include "camera/CameraMetadata.h"
+#include "camera/CameraMetadataView.h"
 #include "camera_metadata_hidden.h"
 // For Mutex etc also:
 #include "ui/GraphicBuffer.h"
@@ -225,15 +226,20 @@ public:
 
         if (result->num_output_buffers == 0 || result->partial_result > 0) {
             // metadata, check 3A convergence
-            CameraMetadata meta;
-            meta = result->result; // clone (because const)
-
-            camera_metadata_entry aeState = meta.find(ANDROID_CONTROL_AE_STATE);
-            camera_metadata_entry awbState = meta.find(ANDROID_CONTROL_AWB_STATE);
-            camera_metadata_entry afState = meta.find(ANDROID_CONTROL_AF_STATE);
-            camera_metadata_entry afMode = meta.find(ANDROID_CONTROL_AF_MODE);
-            camera_metadata_entry aeMode = meta.find(ANDROID_CONTROL_AE_MODE);
-            camera_metadata_entry awbMode = meta.find(ANDROID_CONTROL_AWB_MODE);
+            static const uint32_t tags3A[] = {
+                ANDROID_CONTROL_AE_STATE, ANDROID_CONTROL_AWB_STATE,
+                ANDROID_CONTROL_AF_STATE, ANDROID_CONTROL_AF_MODE,
+                ANDROID_CONTROL_AE_MODE, ANDROID_CONTROL_AWB_MODE,
+            };
+            CameraMetadataView meta(result->result); // no copy of the result
+            meta.prefetch(tags3A, sizeof(tags3A) / sizeof(tags3A[0]));
+
+            camera_metadata_ro_entry aeState = meta.find(ANDROID_CONTROL_AE_STATE);
+            camera_metadata_ro_entry awbState = meta.find(ANDROID_CONTROL_AWB_STATE);
+            camera_metadata_ro_entry afState = meta.find(ANDROID_CONTROL_AF_STATE);
+            camera_metadata_ro_entry afMode = meta.find(ANDROID_CONTROL_AF_MODE);
+            camera_metadata_ro_entry aeMode = meta.find(ANDROID_CONTROL_AE_MODE);
+            camera_metadata_ro_entry awbMode = meta.find(ANDROID_CONTROL_AWB_MODE);
 
             if (aeState.count == 1 && awbState.count == 1 && afState.count == 1 &&
                 aeMode.count == 1 && awbMode.count == 1 && afMode.count == 1) {
@@ -260,11 +266,12 @@ public:
                     afDone) {
                     m3AConverged = true;
                     // get exposure time and sensitivity
-                    camera_metadata_entry exposureTimeEntry = meta.find(ANDROID_SENSOR_EXPOSURE_TIME);
-                    camera_metadata_entry sensitivityEntry = meta.find(ANDROID_SENSOR_SENSITIVITY);
-                    if (exposureTimeEntry.count == 1 && sensitivityEntry.count == 1) {
-                        mConvergedExposureTime = exposureTimeEntry.data.i64[0];
-                        mConvergedIso = sensitivityEntry.data.i32[0];
+                    int64_t exposureTime;
+                    int32_t sensitivity;
+                    if (meta.get(ANDROID_SENSOR_EXPOSURE_TIME, &exposureTime) &&
+                        meta.get(ANDROID_SENSOR_SENSITIVITY, &sensitivity)) {
+                        mConvergedExposureTime = exposureTime;
+                        mConvergedIso = sensitivity;
                     } else {
                         PRINTLN("metadata missing either exposure time or sensitivity");
                         mConvergedExposureTime = 0;